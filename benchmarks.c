@@ -0,0 +1,886 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cbar.h"
+
+/****************************************************************************/
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct field {
+    const char *key;
+    const char *string;             /**< String value, or NULL for a number. */
+    double number;
+};
+
+#define STRING(KEY, VALUE) { KEY, VALUE, 0 }
+#define NUMBER(KEY, VALUE) { KEY, NULL, VALUE }
+
+static bool json;
+
+/**
+ * Print one result, as "key=value" pairs or as a JSON object per line.
+ * @param fields Fields, terminated with a NULL key.
+ */
+static void report(const char *bench, const struct field *fields)
+{
+    printf(json ? "{\"bench\": \"%s\"" : "%-10s", bench);
+    for (const struct field *field=fields; field->key; field++) {
+        if (json && field->string)
+            printf(", \"%s\": \"%s\"", field->key, field->string);
+        else if (json)
+            printf(", \"%s\": %.10g", field->key, field->number);
+        else if (field->string)
+            printf(" %s=%s", field->key, field->string);
+        else
+            printf(" %s=%.10g", field->key, field->number);
+    }
+    printf(json ? "}\n" : "\n");
+    fflush(stdout);
+}
+
+/****************************************************************************/
+
+#define CONTENTION_INPUTS 64
+#define CONTENTION_SECONDS 1.0
+
+/* Simulates a slow ADC read. */
+static int slow_get(intptr_t priv)
+{
+    double until = now() + 50e-6;
+    while (now() < until)
+        ;
+    return priv;
+}
+
+static struct cbar_line_config contention_configs[2*CONTENTION_INPUTS+2];
+static volatile bool contention_running;
+
+struct contention_worker {
+    pthread_t thread;
+    struct cbar *cbar;
+    unsigned seed;
+    long ops;
+    double worst;
+};
+
+static void *contention_recalculate(void *arg)
+{
+    struct contention_worker *worker = arg;
+    while (contention_running) {
+        cbar_recalculate(worker->cbar, 1);
+        worker->ops++;
+    }
+    return NULL;
+}
+
+static void *contention_produce(void *arg)
+{
+    struct contention_worker *worker = arg;
+    while (contention_running) {
+        int id = rand_r(&worker->seed) % CONTENTION_INPUTS;
+        double start = now();
+        cbar_input(worker->cbar, id, rand_r(&worker->seed) % 2);
+        cbar_pending(worker->cbar, CONTENTION_INPUTS + 1 + id);
+        double elapsed = now() - start;
+        if (elapsed > worker->worst)
+            worker->worst = elapsed;
+        worker->ops += 2;
+    }
+    return NULL;
+}
+
+/**
+ * Producers calling cbar_input() and cbar_pending() while another thread
+ * keeps recalculating a graph with a slow external line.
+ */
+static void bench_contention(int producers)
+{
+    struct cbar_line_config *configs = contention_configs;
+    for (int i=0; i<CONTENTION_INPUTS; i++)
+        configs[i] = (struct cbar_line_config) { "input", CBAR_INPUT };
+    configs[CONTENTION_INPUTS] = (struct cbar_line_config) { "slow", CBAR_EXTERNAL, .external = { slow_get, 1 } };
+    for (int i=0; i<CONTENTION_INPUTS; i++)
+        configs[CONTENTION_INPUTS+1+i] = (struct cbar_line_config) { "monitor", CBAR_MONITOR, .monitor = { i } };
+
+    CBAR_DECLARE(cbar, contention_configs);
+    CBAR_INIT(cbar, contention_configs);
+
+    struct contention_worker workers[1+producers];
+    for (int i=0; i<1+producers; i++)
+        workers[i] = (struct contention_worker) { .cbar = &cbar, .seed = i };
+
+    contention_running = true;
+    double start = now();
+    pthread_create(&workers[0].thread, NULL, contention_recalculate, &workers[0]);
+    for (int i=1; i<1+producers; i++)
+        pthread_create(&workers[i].thread, NULL, contention_produce, &workers[i]);
+    while (now() - start < CONTENTION_SECONDS)
+        ;
+    contention_running = false;
+    for (int i=0; i<1+producers; i++)
+        pthread_join(workers[i].thread, NULL);
+    double elapsed = now() - start;
+
+    long ops = 0;
+    double worst = 0;
+    for (int i=1; i<1+producers; i++) {
+        ops += workers[i].ops;
+        if (workers[i].worst > worst)
+            worst = workers[i].worst;
+    }
+    report("contention", (const struct field[]) {
+        NUMBER("producers", producers),
+        NUMBER("ops_per_s", (long) (ops / elapsed)),
+        NUMBER("worst_us", (long) (worst * 1e7) / 10.0),
+        NUMBER("recalculate_per_s", (long) (workers[0].ops / elapsed)),
+        { NULL },
+    });
+}
+
+/****************************************************************************/
+
+#define GRAPH_MAX_LINES 100000
+#define GRAPH_SAMPLES 1024
+#define GRAPH_FANOUT_ROOTS 8
+#define GRAPH_CHURN 10
+#define GRAPH_WORK 20000000
+
+enum graph_shape {
+    GRAPH_CHAIN,                    /**< Every line reads the one before it. */
+    GRAPH_FANOUT,                   /**< Every line reads one of a few roots. */
+    GRAPH_DAG,                      /**< Every line reads a random earlier line. */
+};
+
+static const char *graph_shapes[] = { "chain", "fanout", "dag" };
+
+/* Relative line type frequencies, by type. */
+struct graph_mix {
+    const char *name;
+    int weights[CBAR_LOGIC+1];
+};
+
+static const struct graph_mix graph_mixes[] = {
+    { "mixed", {
+        [CBAR_INPUT] = 1, [CBAR_EXTERNAL] = 2, [CBAR_THRESHOLD] = 2, [CBAR_DEBOUNCE] = 2,
+        [CBAR_REQUEST] = 1, [CBAR_CALCULATED] = 1, [CBAR_MONITOR] = 2, [CBAR_PERIODIC] = 1,
+    } },
+    { "analog", {
+        [CBAR_EXTERNAL] = 1, [CBAR_THRESHOLD] = 1, [CBAR_DEBOUNCE] = 1, [CBAR_MONITOR] = 1,
+    } },
+    { "digital", {
+        [CBAR_INPUT] = 2, [CBAR_DEBOUNCE] = 2, [CBAR_MONITOR] = 1,
+    } },
+};
+
+static const char *graph_types[] = {
+    [CBAR_INPUT] = "input", [CBAR_EXTERNAL] = "external", [CBAR_THRESHOLD] = "threshold",
+    [CBAR_DEBOUNCE] = "debounce", [CBAR_REQUEST] = "request", [CBAR_CALCULATED] = "calculated",
+    [CBAR_MONITOR] = "monitor", [CBAR_PERIODIC] = "periodic", [CBAR_LOGIC] = "logic",
+};
+
+static int graph_samples[GRAPH_SAMPLES];
+
+static int graph_get(intptr_t priv)
+{
+    return graph_samples[priv];
+}
+
+static int graph_calculate(struct cbar *cbar)
+{
+    return !cbar_value(cbar, 0);
+}
+
+static struct cbar_line_config graph_configs[GRAPH_MAX_LINES+1];
+static int graph_logic_inputs[GRAPH_MAX_LINES][3];
+CBAR_DECLARE(graph, graph_configs);
+CBAR_PROFILE_DECLARE(graph, graph_configs);
+static bool graph_profiling;
+
+static enum cbar_line_type graph_pick(const struct graph_mix *mix, unsigned *seed)
+{
+    int total = 0;
+    for (int type=CBAR_INPUT; type<=CBAR_LOGIC; type++)
+        total += mix->weights[type];
+    int pick = rand_r(seed) % total;
+    for (int type=CBAR_INPUT; type<=CBAR_LOGIC; type++) {
+        pick -= mix->weights[type];
+        if (pick < 0)
+            return type;
+    }
+    return CBAR_INPUT;
+}
+
+/**
+ * Fill graph_configs with a synthetic graph. Lines only read lines declared
+ * before them; lines that need an input but have none to read become
+ * external lines instead.
+ */
+static void graph_generate(enum graph_shape shape, int lines, const struct graph_mix *mix)
+{
+    unsigned seed = lines;
+
+    for (int id=0; id<lines; id++) {
+        struct cbar_line_config *config = &graph_configs[id];
+        enum cbar_line_type type = graph_pick(mix, &seed);
+        int input = -1;
+
+        if (id > 0) {
+            switch (shape) {
+                case GRAPH_CHAIN: input = id - 1; break;
+                case GRAPH_FANOUT: input = rand_r(&seed) % (id < GRAPH_FANOUT_ROOTS ? id : GRAPH_FANOUT_ROOTS); break;
+                case GRAPH_DAG: input = rand_r(&seed) % id; break;
+            }
+        }
+        if (input == -1 && (type == CBAR_THRESHOLD || type == CBAR_DEBOUNCE ||
+                            type == CBAR_MONITOR || type == CBAR_LOGIC))
+            type = CBAR_EXTERNAL;
+        /* Analog inputs get analog thresholds. */
+        bool analog = input != -1 && graph_configs[input].type == CBAR_EXTERNAL;
+
+        switch (type) {
+            case CBAR_EXTERNAL:
+                *config = (struct cbar_line_config) { "external", type,
+                    .external = { graph_get, rand_r(&seed) % GRAPH_SAMPLES } };
+                break;
+            case CBAR_THRESHOLD:
+                *config = (struct cbar_line_config) { "threshold", type,
+                    .threshold = { input, analog ? 600 : 1, analog ? 400 : 1 } };
+                break;
+            case CBAR_DEBOUNCE:
+                *config = (struct cbar_line_config) { "debounce", type,
+                    .debounce = { input, 20, 30 } };
+                break;
+            case CBAR_CALCULATED:
+                *config = (struct cbar_line_config) { "calculated", type,
+                    .calculated = { graph_calculate } };
+                break;
+            case CBAR_MONITOR:
+                *config = (struct cbar_line_config) { "monitor", type,
+                    .monitor = { input } };
+                break;
+            case CBAR_PERIODIC:
+                *config = (struct cbar_line_config) { "periodic", type,
+                    .periodic = { 100 } };
+                break;
+            case CBAR_LOGIC:
+                /* A gate of the input and any earlier line. */
+                graph_logic_inputs[id][0] = input;
+                graph_logic_inputs[id][1] = rand_r(&seed) % id;
+                graph_logic_inputs[id][2] = -1;
+                *config = (struct cbar_line_config) { "logic", type,
+                    .logic = { CBAR_AND + rand_r(&seed) % 3, graph_logic_inputs[id] } };
+                break;
+            default:
+                *config = (struct cbar_line_config) { graph_types[type], type };
+                break;
+        }
+    }
+    graph_configs[lines] = (struct cbar_line_config) { NULL };
+}
+
+/**
+ * A synthetic graph, with a fraction of the samples and inputs changing on
+ * every tick and all pending lines consumed after it.
+ */
+static void bench_graph(enum graph_shape shape, int lines, const struct graph_mix *mix)
+{
+    graph_generate(shape, lines, mix);
+    for (int i=0; i<GRAPH_SAMPLES; i++)
+        graph_samples[i] = 0;
+    if (CBAR_INIT(graph, graph_configs) == -1) {
+        perror("cbar_init");
+        exit(1);
+    }
+    if (graph_profiling)
+        CBAR_PROFILE_START(graph);
+
+    unsigned seed = 1;
+    int ticks = GRAPH_WORK / lines;
+    double elapsed = 0;
+    for (int tick=0; tick<ticks; tick++) {
+        for (int i=0; i<GRAPH_SAMPLES*GRAPH_CHURN/100; i++)
+            graph_samples[rand_r(&seed) % GRAPH_SAMPLES] = rand_r(&seed) % 1000;
+        for (int i=0; i<lines*GRAPH_CHURN/100; i++) {
+            int id = rand_r(&seed) % lines;
+            if (graph_configs[id].type == CBAR_INPUT)
+                cbar_input(&graph, id, rand_r(&seed) % 2);
+        }
+
+        double start = now();
+        cbar_recalculate(&graph, 10);
+        elapsed += now() - start;
+
+        for (int id=0; id<lines; id++)
+            if (graph_configs[id].type >= CBAR_MONITOR)
+                cbar_pending(&graph, id);
+    }
+
+    report("graph", (const struct field[]) {
+        STRING("shape", graph_shapes[shape]),
+        STRING("mix", mix->name),
+        STRING("profile", graph_profiling ? "on" : "off"),
+        NUMBER("lines", lines),
+        NUMBER("ns_per_line", (long) (elapsed * 1e11 / ticks / lines) / 100.0),
+        NUMBER("state_bytes_per_line", (long) (CBAR_STORAGE_SIZE(lines) * 100.0 / lines) / 100.0),
+        NUMBER("config_bytes_per_line", sizeof(struct cbar_line_config)),
+        { NULL },
+    });
+}
+
+/****************************************************************************/
+
+/* Worst case frame: a varint ID gap and value per line, plus the header. */
+#define SNAPSHOT_BUF_SIZE (GRAPH_MAX_LINES * 8 + 32)
+
+static int snapshot_encoder_values[GRAPH_MAX_LINES];
+static int snapshot_decoder_values[GRAPH_MAX_LINES];
+static uint8_t snapshot_buf[SNAPSHOT_BUF_SIZE];
+
+/**
+ * Telemetry frames of a synthetic graph: one delta per tick, against the
+ * text of cbar_dump().
+ */
+static void bench_snapshot(int lines)
+{
+    graph_generate(GRAPH_DAG, lines, &graph_mixes[0]);
+    for (int i=0; i<GRAPH_SAMPLES; i++)
+        graph_samples[i] = 0;
+    CBAR_INIT(graph, graph_configs);
+
+    struct cbar_snapshot encoder, decoder;
+    cbar_snapshot_init(&encoder, snapshot_encoder_values, lines);
+    cbar_snapshot_init(&decoder, snapshot_decoder_values, lines);
+    int keyframe = cbar_snapshot_encode(&graph, &encoder, snapshot_buf, SNAPSHOT_BUF_SIZE, true);
+    cbar_snapshot_decode(&decoder, snapshot_buf, keyframe);
+
+    char *dump;
+    size_t dump_size;
+    FILE *stream = open_memstream(&dump, &dump_size);
+    cbar_dump(stream, &graph);
+    fclose(stream);
+    free(dump);
+
+    unsigned seed = 1;
+    int ticks = GRAPH_WORK / lines;
+    double encoding = 0, decoding = 0;
+    long bytes = 0;
+    for (int tick=0; tick<ticks; tick++) {
+        for (int i=0; i<GRAPH_SAMPLES*GRAPH_CHURN/100; i++)
+            graph_samples[rand_r(&seed) % GRAPH_SAMPLES] = rand_r(&seed) % 1000;
+        for (int i=0; i<lines*GRAPH_CHURN/100; i++) {
+            int id = rand_r(&seed) % lines;
+            if (graph_configs[id].type == CBAR_INPUT)
+                cbar_input(&graph, id, rand_r(&seed) % 2);
+        }
+        cbar_recalculate(&graph, 10);
+
+        double start = now();
+        int size = cbar_snapshot_encode(&graph, &encoder, snapshot_buf, SNAPSHOT_BUF_SIZE, false);
+        encoding += now() - start;
+        start = now();
+        cbar_snapshot_decode(&decoder, snapshot_buf, size);
+        decoding += now() - start;
+        bytes += size;
+    }
+
+    if (memcmp(snapshot_encoder_values, snapshot_decoder_values, lines * sizeof(int))) {
+        printf("snapshot mismatch\n");
+        exit(1);
+    }
+    report("snapshot", (const struct field[]) {
+        NUMBER("lines", lines),
+        NUMBER("dump_bytes", dump_size),
+        NUMBER("keyframe_bytes", keyframe),
+        NUMBER("delta_bytes_per_tick", (long) (bytes * 100.0 / ticks) / 100.0),
+        NUMBER("encode_ns_per_line", (long) (encoding * 1e11 / ticks / lines) / 100.0),
+        NUMBER("decode_ns_per_tick", (long) (decoding * 1e11 / ticks) / 100.0),
+        { NULL },
+    });
+}
+
+/****************************************************************************/
+
+#define LOGIC_INPUTS 16
+
+/* Gate k reads inputs k and k+1, whether it's a logic or calculated line. */
+#define LOGIC_GATE(K) \
+    static int logic_gate_ ## K(struct cbar *cbar) \
+    { \
+        return cbar_value(cbar, K) && cbar_value(cbar, ((K) + 1) % LOGIC_INPUTS); \
+    }
+LOGIC_GATE(0) LOGIC_GATE(1) LOGIC_GATE(2) LOGIC_GATE(3)
+LOGIC_GATE(4) LOGIC_GATE(5) LOGIC_GATE(6) LOGIC_GATE(7)
+LOGIC_GATE(8) LOGIC_GATE(9) LOGIC_GATE(10) LOGIC_GATE(11)
+LOGIC_GATE(12) LOGIC_GATE(13) LOGIC_GATE(14) LOGIC_GATE(15)
+
+static int (*const logic_gates[LOGIC_INPUTS])(struct cbar *) = {
+    logic_gate_0, logic_gate_1, logic_gate_2, logic_gate_3,
+    logic_gate_4, logic_gate_5, logic_gate_6, logic_gate_7,
+    logic_gate_8, logic_gate_9, logic_gate_10, logic_gate_11,
+    logic_gate_12, logic_gate_13, logic_gate_14, logic_gate_15,
+};
+
+static int logic_inputs[LOGIC_INPUTS][3];
+
+/**
+ * Two-input AND gates over a few inputs, two of which change on every tick:
+ * as logic lines, and as calculated lines declaring their inputs.
+ */
+static void bench_logic(int lines)
+{
+    const char *kinds[] = { "logic", "calculated" };
+
+    for (int k=0; k<LOGIC_INPUTS; k++) {
+        logic_inputs[k][0] = k;
+        logic_inputs[k][1] = (k + 1) % LOGIC_INPUTS;
+        logic_inputs[k][2] = -1;
+    }
+
+    for (int kind=0; kind<2; kind++) {
+        for (int id=0; id<lines; id++) {
+            int k = id % LOGIC_INPUTS;
+            if (id < LOGIC_INPUTS)
+                graph_configs[id] = (struct cbar_line_config) { "input", CBAR_INPUT };
+            else if (kind == 0)
+                graph_configs[id] = (struct cbar_line_config) { "logic", CBAR_LOGIC,
+                    .logic = { CBAR_AND, logic_inputs[k] } };
+            else
+                graph_configs[id] = (struct cbar_line_config) { "calculated", CBAR_CALCULATED,
+                    .calculated = { logic_gates[k], logic_inputs[k] } };
+        }
+        graph_configs[lines] = (struct cbar_line_config) { NULL };
+        CBAR_INIT(graph, graph_configs);
+
+        unsigned seed = 1;
+        int ticks = GRAPH_WORK / lines;
+        double elapsed = 0;
+        for (int tick=0; tick<ticks; tick++) {
+            for (int i=0; i<2; i++)
+                cbar_input(&graph, rand_r(&seed) % LOGIC_INPUTS, rand_r(&seed) % 2);
+
+            double start = now();
+            cbar_recalculate(&graph, 10);
+            elapsed += now() - start;
+        }
+
+        report("logic", (const struct field[]) {
+            STRING("kind", kinds[kind]),
+            NUMBER("lines", lines),
+            NUMBER("ns_per_line", (long) (elapsed * 1e11 / ticks / lines) / 100.0),
+            { NULL },
+        });
+    }
+}
+
+/****************************************************************************/
+
+#define FILTER_INPUTS 16
+#define FILTER_WINDOW 8
+
+CBAR_FILTER_DECLARE(graph, GRAPH_MAX_LINES * CBAR_FILTER_SIZE(FILTER_WINDOW));
+
+/**
+ * Filter lines smoothing a few noisy inputs, all of which change on every
+ * tick, for each kind of filter.
+ */
+static void bench_filter(int lines)
+{
+    const char *kinds[] = { [CBAR_AVERAGE] = "average", [CBAR_EXPONENTIAL] = "exponential",
+                            [CBAR_MEDIAN] = "median" };
+
+    for (int kind=CBAR_AVERAGE; kind<=CBAR_MEDIAN; kind++) {
+        for (int id=0; id<lines; id++) {
+            if (id < FILTER_INPUTS)
+                graph_configs[id] = (struct cbar_line_config) { "input", CBAR_INPUT };
+            else
+                graph_configs[id] = (struct cbar_line_config) { "filter", CBAR_FILTER,
+                    .filter = { id % FILTER_INPUTS, (enum cbar_filter_kind) kind,
+                                kind == CBAR_EXPONENTIAL ? 3 : FILTER_WINDOW } };
+        }
+        graph_configs[lines] = (struct cbar_line_config) { NULL };
+        CBAR_INIT(graph, graph_configs);
+        CBAR_FILTER_START(graph);
+
+        unsigned seed = 1;
+        int ticks = GRAPH_WORK / lines;
+        double elapsed = 0;
+        for (int tick=0; tick<ticks; tick++) {
+            for (int i=0; i<FILTER_INPUTS; i++)
+                cbar_input(&graph, i, rand_r(&seed) % 4096);
+
+            double start = now();
+            cbar_recalculate(&graph, 10);
+            elapsed += now() - start;
+        }
+
+        report("filter", (const struct field[]) {
+            STRING("kind", kinds[kind]),
+            NUMBER("lines", lines),
+            NUMBER("window", kind == CBAR_EXPONENTIAL ? 1 << 3 : FILTER_WINDOW),
+            NUMBER("ns_per_line", (long) (elapsed * 1e11 / ticks / lines) / 100.0),
+            { NULL },
+        });
+    }
+}
+
+/****************************************************************************/
+
+#define IMAGE_RUNS 10
+
+/**
+ * Startup time of a synthetic graph: scheduling it with cbar_init() against
+ * booting it from a config image written beforehand.
+ */
+static void bench_image(int lines)
+{
+    graph_generate(GRAPH_DAG, lines, &graph_mixes[0]);
+    for (int i=0; i<GRAPH_SAMPLES; i++)
+        graph_samples[i] = 0;
+
+    double scheduling = 0;
+    for (int run=0; run<IMAGE_RUNS; run++) {
+        double start = now();
+        CBAR_INIT(graph, graph_configs);
+        scheduling += now() - start;
+    }
+
+    char *image;
+    size_t size;
+    FILE *stream = open_memstream(&image, &size);
+    cbar_image_write(stream, &graph);
+    fclose(stream);
+
+    double booting = 0;
+    for (int run=0; run<IMAGE_RUNS; run++) {
+        double start = now();
+        if (CBAR_INIT_IMAGE(graph, graph_configs, image, size) == -1) {
+            perror("cbar_init_image");
+            exit(1);
+        }
+        booting += now() - start;
+    }
+    free(image);
+
+    report("image", (const struct field[]) {
+        NUMBER("lines", lines),
+        NUMBER("image_bytes", size),
+        NUMBER("init_us", (long) (scheduling * 1e8 / IMAGE_RUNS) / 100.0),
+        NUMBER("init_image_us", (long) (booting * 1e8 / IMAGE_RUNS) / 100.0),
+        { NULL },
+    });
+}
+
+/****************************************************************************/
+
+#define FLEET_LINES 100
+#define FLEET_VEHICLES 10000
+#define FLEET_THREADS 8
+#define FLEET_TICKS 100
+
+static struct cbar_line_config fleet_configs[FLEET_LINES+1];
+CBAR_DECLARE(vehicle, fleet_configs);
+CBAR_FLEET_DECLARE(fleet, fleet_configs, FLEET_VEHICLES, FLEET_THREADS);
+
+/**
+ * The same vehicle logic run for many vehicles: one cbar instance
+ * recalculated once per vehicle, as separate instances would be, against a
+ * fleet sharded over a growing number of threads.
+ */
+static void bench_fleet(void)
+{
+    graph_generate(GRAPH_DAG, FLEET_LINES, &graph_mixes[1]);
+    for (int id=0; id<=FLEET_LINES; id++)
+        fleet_configs[id] = graph_configs[id];
+    for (int i=0; i<GRAPH_SAMPLES; i++)
+        graph_samples[i] = 0;
+    CBAR_INIT(vehicle, fleet_configs);
+
+    unsigned seed = 1;
+    double separate = 0;
+    for (int tick=0; tick<FLEET_TICKS; tick++) {
+        for (int v=0; v<FLEET_VEHICLES; v++) {
+            for (int i=0; i<GRAPH_SAMPLES*GRAPH_CHURN/100; i++)
+                graph_samples[rand_r(&seed) % GRAPH_SAMPLES] = rand_r(&seed) % 1000;
+
+            double start = now();
+            cbar_recalculate(&vehicle, 10);
+            separate += now() - start;
+
+            for (int id=0; id<FLEET_LINES; id++)
+                if (fleet_configs[id].type == CBAR_MONITOR)
+                    cbar_pending(&vehicle, id);
+        }
+    }
+
+    report("fleet", (const struct field[]) {
+        NUMBER("lines", FLEET_LINES),
+        NUMBER("vehicles", FLEET_VEHICLES),
+        STRING("mode", "separate"),
+        NUMBER("threads", 1),
+        NUMBER("ns_per_vehicle_line", (long) (separate * 1e11 / FLEET_TICKS / FLEET_VEHICLES / FLEET_LINES) / 100.0),
+        { NULL },
+    });
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int threads=1; threads<=FLEET_THREADS && threads<=cpus; threads*=2) {
+        /* CBAR_FLEET_INIT always starts all declared threads. */
+        cbar_fleet_init(&fleet, &vehicle, FLEET_VEHICLES, sizeof(fleet_values) / sizeof(fleet_values[0]),
+                        fleet_values, fleet_state, fleet_scratch, fleet_workers, fleet_threads, threads);
+
+        seed = 1;
+        double elapsed = 0;
+        for (int tick=0; tick<FLEET_TICKS; tick++) {
+            for (int v=0; v<FLEET_VEHICLES; v++)
+                for (int id=0; id<FLEET_LINES; id++)
+                    if (fleet_configs[id].type == CBAR_EXTERNAL && rand_r(&seed) % 100 < GRAPH_CHURN)
+                        cbar_fleet_input(&fleet, v, id, rand_r(&seed) % 1000);
+
+            double start = now();
+            cbar_fleet_recalculate(&fleet, 10);
+            elapsed += now() - start;
+
+            for (int id=0; id<FLEET_LINES; id++)
+                if (fleet_configs[id].type == CBAR_MONITOR)
+                    for (int v=0; v<FLEET_VEHICLES; v++)
+                        cbar_fleet_pending(&fleet, v, id);
+        }
+        cbar_fleet_stop(&fleet);
+
+        report("fleet", (const struct field[]) {
+            NUMBER("lines", FLEET_LINES),
+            NUMBER("vehicles", FLEET_VEHICLES),
+            STRING("mode", "fleet"),
+            NUMBER("threads", threads),
+            NUMBER("ns_per_vehicle_line", (long) (elapsed * 1e11 / FLEET_TICKS / FLEET_VEHICLES / FLEET_LINES) / 100.0),
+            { NULL },
+        });
+    }
+}
+
+/****************************************************************************/
+
+#define SIMULATE_INPUTS 64
+#define SIMULATE_HOURS 24
+#define SIMULATE_TICKED_MS (10*60*1000)
+
+static struct cbar_line_config simulate_configs[3*SIMULATE_INPUTS+1];
+CBAR_DECLARE(simulate, simulate_configs);
+CBAR_TRACE_DECLARE(simulate, 1024);
+
+static void simulate_init(void)
+{
+    CBAR_INIT(simulate, simulate_configs);
+    CBAR_TRACE_START(simulate);
+}
+
+/**
+ * A day of switch inputs, each toggling every few seconds, with debouncers
+ * and monitors: replayed with cbar_simulate(), and ticked every milisecond
+ * for comparison.
+ */
+static void bench_simulate(void)
+{
+    for (int i=0; i<SIMULATE_INPUTS; i++) {
+        simulate_configs[i] = (struct cbar_line_config) { "switch", CBAR_INPUT };
+        simulate_configs[SIMULATE_INPUTS+i] = (struct cbar_line_config) { "debounce", CBAR_DEBOUNCE, .debounce = { i, 50, 50 } };
+        simulate_configs[2*SIMULATE_INPUTS+i] = (struct cbar_line_config) { "monitor", CBAR_MONITOR, .monitor = { SIMULATE_INPUTS+i } };
+    }
+
+    FILE *recording = tmpfile();
+    unsigned seed = 1;
+    long events = 0;
+    for (unsigned long time=1; time<SIMULATE_HOURS*3600000UL; time+=rand_r(&seed)%100) {
+        int id = rand_r(&seed) % SIMULATE_INPUTS;
+        fprintf(recording, "%lu %d 0 %d\n", time, id, rand_r(&seed) % 2);
+        events++;
+    }
+
+    simulate_init();
+    rewind(recording);
+    FILE *output = fopen("/dev/null", "w");
+    double start = now();
+    cbar_simulate(&simulate, recording, output, SIMULATE_HOURS*3600000UL);
+    double simulated = now() - start;
+    fclose(output);
+
+    simulate_init();
+    rewind(recording);
+    struct cbar_trace_event event;
+    int status = cbar_trace_scan(recording, &event);
+    start = now();
+    for (unsigned long time=1; time<=SIMULATE_TICKED_MS; time++) {
+        for (; status == 1 && event.time <= time; status = cbar_trace_scan(recording, &event))
+            cbar_input(&simulate, event.id, event.value);
+        cbar_recalculate(&simulate, 1);
+        for (int i=0; i<SIMULATE_INPUTS; i++)
+            cbar_pending(&simulate, 2*SIMULATE_INPUTS+i);
+        struct cbar_trace_event events[64];
+        while (cbar_trace_read(&simulate, events, 64))
+            ;
+    }
+    double ticked = now() - start;
+    fclose(recording);
+
+    report("simulate", (const struct field[]) {
+        NUMBER("events", events),
+        NUMBER("simulated_hours", SIMULATE_HOURS),
+        NUMBER("jump_ms_per_s", (long) (SIMULATE_HOURS*3600000.0 / simulated)),
+        NUMBER("tick_ms_per_s", (long) (SIMULATE_TICKED_MS / ticked)),
+        { NULL },
+    });
+}
+
+/****************************************************************************/
+
+#define POOL_LINES 256
+#define POOL_TICKS 20
+
+static struct cbar_line_config pool_configs[POOL_LINES+1];
+
+/**
+ * A wide graph of slow external lines, recalculated without a pool and with
+ * pools of growing size.
+ */
+static void bench_pool(int threads)
+{
+    for (int i=0; i<POOL_LINES; i++)
+        pool_configs[i] = (struct cbar_line_config) { "slow", CBAR_EXTERNAL, .external = { slow_get, i } };
+
+    CBAR_DECLARE(cbar, pool_configs);
+    CBAR_INIT(cbar, pool_configs);
+    CBAR_POOL_DECLARE(cbar, threads ? threads : 1);
+    if (threads)
+        CBAR_POOL_START(cbar);
+
+    double start = now();
+    for (int tick=0; tick<POOL_TICKS; tick++)
+        cbar_recalculate(&cbar, 1);
+    double elapsed = now() - start;
+
+    if (threads)
+        cbar_pool_stop(&cbar);
+    report("pool", (const struct field[]) {
+        NUMBER("lines", POOL_LINES),
+        NUMBER("threads", threads),
+        NUMBER("ms_per_tick", (long) (elapsed * 1e5 / POOL_TICKS) / 100.0),
+        { NULL },
+    });
+}
+
+/****************************************************************************/
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-j] [-p] [-s chain|fanout|dag] [-m mixed|analog|digital|TYPE=WEIGHT,...]\n", name);
+    exit(2);
+}
+
+/* Parse a "type=weight,..." list into a custom mix. */
+static bool parse_mix(struct graph_mix *mix, char *spec)
+{
+    *mix = (struct graph_mix) { "custom" };
+    for (char *item=strtok(spec, ","); item; item=strtok(NULL, ",")) {
+        char *weight = strchr(item, '=');
+        if (!weight)
+            return false;
+        *weight++ = '\0';
+        int type;
+        for (type=CBAR_INPUT; type<=CBAR_LOGIC; type++)
+            if (!strcmp(item, graph_types[type]))
+                break;
+        if (type > CBAR_LOGIC)
+            return false;
+        mix->weights[type] = atoi(weight);
+    }
+
+    int total = 0;
+    for (int type=CBAR_INPUT; type<=CBAR_LOGIC; type++)
+        total += mix->weights[type];
+    return total > 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int shape = -1;
+    const struct graph_mix *mixes = graph_mixes;
+    int n_mixes = sizeof(graph_mixes) / sizeof(graph_mixes[0]);
+    struct graph_mix custom;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "jps:m:")) != -1) {
+        switch (opt) {
+            case 'j': {
+                json = true;
+            } break;
+            case 'p': {
+                graph_profiling = true;
+            } break;
+            case 's': {
+                for (shape=GRAPH_DAG; shape>=0; shape--)
+                    if (!strcmp(optarg, graph_shapes[shape]))
+                        break;
+                if (shape < 0)
+                    usage(argv[0]);
+            } break;
+            case 'm': {
+                int i;
+                for (i=0; i<n_mixes; i++)
+                    if (!strcmp(optarg, graph_mixes[i].name))
+                        break;
+                if (i < n_mixes) {
+                    mixes = &graph_mixes[i];
+                } else if (parse_mix(&custom, optarg)) {
+                    mixes = &custom;
+                } else {
+                    usage(argv[0]);
+                }
+                n_mixes = 1;
+            } break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    for (int producers=1; producers<=4; producers*=2)
+        bench_contention(producers);
+    bench_simulate();
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int threads=0; threads<cpus; threads=2*threads+1)
+        bench_pool(threads);
+    for (int lines=100; lines<=GRAPH_MAX_LINES; lines*=10)
+        bench_snapshot(lines);
+    for (int lines=100; lines<=GRAPH_MAX_LINES; lines*=10)
+        bench_image(lines);
+    for (int lines=100; lines<=GRAPH_MAX_LINES; lines*=10)
+        bench_logic(lines);
+    for (int lines=100; lines<=GRAPH_MAX_LINES; lines*=10)
+        bench_filter(lines);
+    bench_fleet();
+    for (int s=GRAPH_CHAIN; s<=GRAPH_DAG; s++)
+        if (shape == -1 || s == shape)
+            for (int m=0; m<n_mixes; m++)
+                for (int lines=100; lines<=GRAPH_MAX_LINES; lines*=10)
+                    bench_graph(s, lines, &mixes[m]);
+
+    return 0;
+}
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,133 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <utility>
+
+#include "cbar.hpp"
+
+/****************************************************************************/
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/****************************************************************************/
+
+#define FANOUT_GROUPS 64
+#define FANOUT_LINES (4*FANOUT_GROUPS+1)
+#define FANOUT_TICKS 100000
+
+static int fanout_samples[FANOUT_GROUPS];
+
+static int fanout_get(intptr_t priv)
+{
+    return fanout_samples[priv];
+}
+
+/* Number of debounced lines that are high. */
+static int fanout_count(struct cbar *cbar)
+{
+    int count = 0;
+    for (int i=0; i<FANOUT_GROUPS; i++)
+        count += cbar_value(cbar, 2*FANOUT_GROUPS+i);
+    return count;
+}
+
+template <class Ids> struct fanout;
+
+template <std::size_t... Ids>
+struct fanout<std::index_sequence<Ids...>> {
+    using type = cbar_static::graph<
+        cbar_static::external<fanout_get, Ids>...,
+        cbar_static::threshold<int(Ids), 600, 400>...,
+        cbar_static::debounce<int(FANOUT_GROUPS+Ids), 30, 30>...,
+        cbar_static::monitor<int(2*FANOUT_GROUPS+Ids)>...,
+        cbar_static::calculated<fanout_count>
+    >;
+};
+
+using fanout_graph = fanout<std::make_index_sequence<FANOUT_GROUPS>>::type;
+
+static struct cbar_line_config fanout_configs[FANOUT_LINES+1];
+CBAR_DECLARE(fanout_cbar, fanout_configs);
+
+static void fanout_shake(unsigned *seed, int percent)
+{
+    for (int i=0; i<FANOUT_GROUPS*percent/100; i++)
+        fanout_samples[rand_r(seed) % FANOUT_GROUPS] = rand_r(seed) % 1000;
+}
+
+/**
+ * The same graph built at compile time and through cbar_init(), driven by
+ * the same inputs. Values are compared on every tick before timing.
+ */
+static int bench_fanout(int percent)
+{
+    static_assert(fanout_graph::count == FANOUT_LINES, "fanout graph size");
+
+    for (int i=0; i<FANOUT_GROUPS; i++)
+        fanout_samples[i] = 0;
+    fanout_graph graph;
+    for (int i=0; i<=FANOUT_LINES; i++)
+        fanout_configs[i] = graph.configs()[i];
+    CBAR_INIT(fanout_cbar, fanout_configs);
+
+    unsigned seed = 1;
+    for (int tick=0; tick<FANOUT_TICKS/100; tick++) {
+        fanout_shake(&seed, percent);
+        graph.recalculate(10);
+        cbar_recalculate(&fanout_cbar, 10);
+        for (int i=0; i<FANOUT_LINES; i++) {
+            if (graph.value(i) != cbar_value(&fanout_cbar, i)) {
+                printf("fanout mismatch: tick %d line %d\n", tick, i);
+                return 1;
+            }
+        }
+    }
+
+    seed = 2;
+    double start = now();
+    for (int tick=0; tick<FANOUT_TICKS; tick++) {
+        fanout_shake(&seed, percent);
+        graph.recalculate(10);
+    }
+    double compiled = now() - start;
+
+    seed = 2;
+    start = now();
+    for (int tick=0; tick<FANOUT_TICKS; tick++) {
+        fanout_shake(&seed, percent);
+        cbar_recalculate(&fanout_cbar, 10);
+    }
+    double runtime = now() - start;
+
+    printf("fanout lines=%d changing=%d%% static ns/line=%.2f cbar_recalculate ns/line=%.2f\n",
+           FANOUT_LINES, percent,
+           compiled * 1e9 / FANOUT_TICKS / FANOUT_LINES,
+           runtime * 1e9 / FANOUT_TICKS / FANOUT_LINES);
+    return 0;
+}
+
+/****************************************************************************/
+
+int main()
+{
+    for (int percent=1; percent<=100; percent*=10)
+        if (bench_fanout(percent))
+            return 1;
+
+    return 0;
+}
+
+/* vim: set ts=4 sw=4 et: */
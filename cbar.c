@@ -9,28 +9,519 @@
 #include "cbar.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#if !defined(CBAR_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#elif !defined(CBAR_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-void cbar_init(struct cbar *cbar, const struct cbar_line_config *configs, struct cbar_line *lines)
+/* Highest line type value. */
+#define CBAR_TYPE_MAX CBAR_FILTER
+
+/* Maximum number of lines evaluated side by side. */
+#define CBAR_BATCH 16
+
+/* Seeds tried per name index bucket before giving up. */
+#define CBAR_INDEX_TRIES (1 << 20)
+
+/* Maximum number of callbacks handed to the worker pool at once. */
+#define CBAR_JOB 64
+
+/* Line IDs counted per call when recording more inputs than fit. */
+#define CBAR_RECORD_WINDOW 1024
+
+static void cbar_mark(unsigned long *bitmap, int bit)
 {
-    cbar->configs = configs;
-    cbar->lines = lines;
+    bitmap[bit / CBAR_BITS] |= 1UL << (bit % CBAR_BITS);
+}
 
-    pthread_mutex_init(&cbar->mutex, NULL);
+static void cbar_unmark(unsigned long *bitmap, int bit)
+{
+    bitmap[bit / CBAR_BITS] &= ~(1UL << (bit % CBAR_BITS));
+}
 
-    for (int id=0; cbar->configs[id].type; id++) {
-        struct cbar_line *line = &cbar->lines[id];
+static void cbar_touch(atomic_ulong *bitmap, int bit)
+{
+    atomic_fetch_or_explicit(&bitmap[bit / CBAR_BITS], 1UL << (bit % CBAR_BITS), memory_order_release);
+}
+
+/**
+ * Returns the ID of the n-th line read by a given line, or -1 if there's none.
+ */
+static int cbar_line_input(const struct cbar_line_config *config, int n)
+{
+    if (config->type == CBAR_CALCULATED)
+        return config->calculated.inputs ? config->calculated.inputs[n] : -1;
+    if (config->type == CBAR_LOGIC)
+        return config->logic.inputs[n];
+    if (n > 0)
+        return -1;
+
+    switch (config->type) {
+        case CBAR_THRESHOLD: return config->threshold.input;
+        case CBAR_DEBOUNCE: return config->debounce.input;
+        case CBAR_MONITOR: return config->monitor.input;
+        case CBAR_FILTER: return config->filter.input;
+        default: return -1;
+    }
+}
+
+/**
+ * Returns the partition a given line belongs to.
+ */
+static struct cbar_partition *cbar_partition(struct cbar *cbar, int rank)
+{
+    struct cbar_partition *part = cbar->partitions;
+    while (rank >= part->end)
+        part++;
+    return part;
+}
+
+/**
+ * Returns the partition owning a given bitmap word.
+ */
+static struct cbar_partition *cbar_partition_at(struct cbar *cbar, int word)
+{
+    struct cbar_partition *part = cbar->partitions;
+    while (word >= part->word + part->words)
+        part++;
+    return part;
+}
+
+/**
+ * Schedule all lines reading a given line for evaluation. Lines only read
+ * lines in their own partition.
+ */
+static void cbar_mark_dependents(struct cbar *cbar, struct cbar_partition *part, int rank)
+{
+    for (int dep=cbar->ops[rank].dependents; dep != -1; dep=cbar->ops[dep].sibling)
+        cbar_mark(cbar->dirty, dep + part->offset);
+}
+
+/**
+ * Same as above, but safe to call without holding the mutex.
+ */
+static void cbar_touch_dependents(struct cbar *cbar, int rank)
+{
+    int offset = cbar_partition(cbar, rank)->offset;
+
+    atomic_fetch_add_explicit(&cbar->lines[rank].version, 1, memory_order_relaxed);
+    for (int dep=cbar->ops[rank].dependents; dep != -1; dep=cbar->ops[dep].sibling)
+        cbar_touch(cbar->touched, dep + offset);
+}
+
+/**
+ * Append a transition to the trace, if there's one and it has room.
+ */
+static void cbar_trace_transition(struct cbar *cbar, int id, int previous, int value)
+{
+    if (!cbar->tracing)
+        return;
+
+    struct cbar_trace *trace = cbar->trace;
+    unsigned long head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+    /* Don't overwrite events the reader may still be copying. */
+    if (head - atomic_load_explicit(&trace->tail, memory_order_acquire) > trace->mask) {
+        atomic_fetch_add_explicit(&trace->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    trace->events[head & trace->mask] = (struct cbar_trace_event) { id, previous, value, cbar->time };
+    atomic_store_explicit(&trace->head, head + 1, memory_order_release);
+}
+
+/**
+ * Raise a request/monitor/periodic line.
+ */
+static bool cbar_queue_push(struct cbar_queue *queue, int id)
+{
+    unsigned long pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+    for (;;) {
+        struct cbar_queue_cell *cell = &queue->cells[pos % queue->size];
+        unsigned long sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        long diff = (long) (sequence - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                cell->id = id;
+                atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            /* The cell still holds a line from the previous lap. */
+            return false;
+        } else {
+            pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * @returns Line ID, or -1 if the queue is empty.
+ */
+static int cbar_queue_pop(struct cbar_queue *queue)
+{
+    unsigned long pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+
+    for (;;) {
+        struct cbar_queue_cell *cell = &queue->cells[pos % queue->size];
+        unsigned long sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        long diff = (long) (sequence - (pos + 1));
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                int id = cell->id;
+                atomic_store_explicit(&cell->sequence, pos + queue->size, memory_order_release);
+                return id;
+            }
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * Let cbar_pending_drain() know a pending line was raised.
+ */
+static void cbar_signal(struct cbar *cbar, int id)
+{
+    atomic_fetch_or_explicit(&cbar->pending[id / CBAR_BITS], 1UL << (id % CBAR_BITS),
+                             memory_order_acq_rel);
+    if (cbar->queue && !cbar_queue_push(cbar->queue, id))
+        atomic_store_explicit(&cbar->queue->overflowed, 1, memory_order_release);
+}
+
+static void cbar_raise(struct cbar *cbar, struct cbar_partition *part, int rank)
+{
+    int id = cbar->ops[rank].id;
+
+    if (!atomic_exchange_explicit(&cbar->values[id], 1, memory_order_release)) {
+        atomic_fetch_add_explicit(&cbar->lines[rank].version, 1, memory_order_relaxed);
+        cbar_mark_dependents(cbar, part, rank);
+        cbar_trace_transition(cbar, id, 0, 1);
+        cbar_signal(cbar, id);
+        part->raised = true;
+    }
+}
+
+/**
+ * Wake up threads sleeping in cbar_wait(). The lock is only taken if one
+ * might be, so posting stays lock-free while nobody waits: a waiter counts
+ * itself before it checks the event count, and we bump the count before
+ * we check for waiters, so one of us always sees the other.
+ */
+static void cbar_notify(struct cbar *cbar)
+{
+    atomic_fetch_add(&cbar->events, 1);
+    if (atomic_load(&cbar->waiters)) {
+        pthread_mutex_lock(&cbar->wait_mutex);
+        pthread_cond_broadcast(&cbar->wait_cond);
+        pthread_mutex_unlock(&cbar->wait_mutex);
+    }
+}
+
+/**
+ * Sort the lines so that every line is evaluated after the lines it reads.
+ *
+ * First, a depth-first search started from each line in declaration order
+ * puts every line after its inputs, leaving lines that are already sorted
+ * in their places. The not-yet-filled tail of the order doubles as the DFS
+ * stack, and ranks hold the search state: -1 for unvisited lines, -2-N for
+ * lines on the stack (N being the next input to visit).
+ *
+ * Then each line gets a dependency level: one above its highest input, and
+ * for calculated lines whose inputs we don't know, one above everything
+ * before them. Finally, the lines are sorted by level and type, so that
+ * lines of the same kind end up next to each other; two stable counting
+ * sorts do that, using the line state array as scratch space.
+ *
+ * @returns 0 on success, -1 if the lines form a cycle.
+ */
+static int cbar_schedule(struct cbar *cbar, struct cbar_op *ops, int *ranks)
+{
+    struct cbar_line *lines = cbar->lines;
+    int scheduled = 0;
+    int depth = 0;
+
+    for (int id=0; id<cbar->count; id++)
+        ranks[id] = -1;
+
+    for (int root=0; root<cbar->count; root++) {
+        if (ranks[root] != -1)
+            continue;
+
+        ranks[root] = -2;
+        ops[cbar->count - ++depth].id = root;
+
+        while (depth) {
+            int id = ops[cbar->count - depth].id;
+            int input = cbar_line_input(&cbar->configs[id], -2 - ranks[id]);
+
+            if (input == -1) {
+                /* All inputs are scheduled; now it's our turn. */
+                depth--;
+                ops[scheduled].id = id;
+                ranks[id] = scheduled++;
+                continue;
+            }
+
+            ranks[id]--;
+            if (ranks[input] == -1) {
+                ranks[input] = -2;
+                ops[cbar->count - ++depth].id = input;
+            } else if (ranks[input] < -1) {
+                /* Input is still on the stack, so it depends on us. */
+                return -1;
+            }
+        }
+    }
+
+    /* Assign dependency levels. */
+    int max_level = -1;
+    for (int pos=0; pos<cbar->count; pos++) {
+        int id = ops[pos].id;
         const struct cbar_line_config *config = &cbar->configs[id];
+        bool unknown = (config->type == CBAR_CALCULATED && !config->calculated.inputs);
+        int level = unknown ? max_level + 1 : 0;
+        int input;
+
+        for (int n=0; (input = cbar_line_input(config, n)) != -1; n++)
+            if (lines[input].schedule.level >= level)
+                level = lines[input].schedule.level + 1;
+
+        lines[id].schedule.level = level;
+        if (level > max_level)
+            max_level = level;
+    }
+
+    /* Sort by type... */
+    int starts[CBAR_TYPE_MAX+1] = { 0 };
+    for (int pos=0; pos<cbar->count; pos++)
+        starts[cbar->configs[ops[pos].id].type]++;
+    for (int type=0, start=0; type<=CBAR_TYPE_MAX; type++) {
+        int count = starts[type];
+        starts[type] = start;
+        start += count;
+    }
+    for (int pos=0; pos<cbar->count; pos++)
+        lines[starts[cbar->configs[ops[pos].id].type]++].schedule.order = ops[pos].id;
+
+    /* ...then by level, using ranks as level start positions. */
+    for (int level=0; level<=max_level; level++)
+        ranks[level] = 0;
+    for (int pos=0; pos<cbar->count; pos++)
+        ranks[lines[lines[pos].schedule.order].schedule.level]++;
+    for (int level=0, start=0; level<=max_level; level++) {
+        int count = ranks[level];
+        ranks[level] = start;
+        start += count;
+    }
+    for (int pos=0; pos<cbar->count; pos++) {
+        int id = lines[pos].schedule.order;
+        ops[ranks[lines[id].schedule.level]++].id = id;
+    }
+
+    for (int rank=0; rank<cbar->count; rank++) {
+        int id = ops[rank].id;
+        ranks[id] = rank;
+        ops[rank].level = lines[id].schedule.level;
+    }
+
+    return 0;
+}
+
+static int cbar_find(struct cbar_op *ops, int rank)
+{
+    while (ops[rank].up != rank) {
+        ops[rank].up = ops[ops[rank].up].up;
+        rank = ops[rank].up;
+    }
+    return rank;
+}
+
+static void cbar_union(struct cbar_op *ops, int a, int b)
+{
+    a = cbar_find(ops, a);
+    b = cbar_find(ops, b);
+    if (a == b)
+        return;
+    if (ops[a].down < ops[b].down) {
+        int tmp = a;
+        a = b;
+        b = tmp;
+    }
+    ops[b].up = a;
+    ops[a].down += ops[b].down;
+}
+
+/**
+ * Split the scheduled lines into partitions.
+ *
+ * Lines connected through their inputs must stay together; each group of
+ * them goes to the least loaded partition so far. Calculated lines that
+ * don't declare their inputs may read anything, so they're kept together in
+ * a partition of their own, which is evaluated last. A stable counting sort
+ * then groups the lines by partition without disturbing the order within
+ * each one.
+ *
+ * Component search is union-find over ranks, with parents in ops[].up and
+ * sizes in ops[].down; the partition of each line goes to ops[].dependents.
+ * All of those get overwritten when the configs are compiled.
+ */
+static void cbar_split(struct cbar *cbar, struct cbar_op *ops, int *ranks)
+{
+    struct cbar_line *lines = cbar->lines;
+    int calculated = -1;
+
+    for (int rank=0; rank<cbar->count; rank++) {
+        ops[rank].up = rank;
+        ops[rank].down = 1;
+    }
+    for (int rank=0; rank<cbar->count; rank++) {
+        const struct cbar_line_config *config = &cbar->configs[ops[rank].id];
+        int input;
+
+        for (int n=0; (input = cbar_line_input(config, n)) != -1; n++)
+            cbar_union(ops, rank, ranks[input]);
+        if (config->type == CBAR_CALCULATED && !config->calculated.inputs) {
+            if (calculated == -1)
+                calculated = rank;
+            cbar_union(ops, calculated, rank);
+        }
+    }
+
+    /* The last partition is reserved for those, if any. */
+    int parallel = CBAR_PARTITIONS - (calculated != -1);
+    int serial = (calculated != -1) ? cbar_find(ops, calculated) : -1;
+    int sizes[CBAR_PARTITIONS] = { 0 };
+    for (int rank=0; rank<cbar->count; rank++) {
+        if (cbar_find(ops, rank) != rank)
+            continue;
+        int slot = parallel;
+        if (rank != serial && parallel > 0) {
+            slot = 0;
+            for (int k=1; k<parallel; k++)
+                if (sizes[k] < sizes[slot])
+                    slot = k;
+        }
+        ops[rank].sibling = slot;
+        sizes[slot] += ops[rank].down;
+    }
+    for (int rank=0; rank<cbar->count; rank++)
+        ops[rank].dependents = ops[cbar_find(ops, rank)].sibling;
+
+    int starts[CBAR_PARTITIONS];
+    for (int slot=0, start=0; slot<CBAR_PARTITIONS; slot++) {
+        starts[slot] = start;
+        start += sizes[slot];
+    }
+    for (int rank=0; rank<cbar->count; rank++)
+        lines[starts[ops[rank].dependents]++].schedule.order = ops[rank].id;
+    for (int rank=0; rank<cbar->count; rank++) {
+        int id = lines[rank].schedule.order;
+        ops[rank].id = id;
+        ops[rank].level = lines[id].schedule.level;
+        ranks[id] = rank;
+    }
+
+    /* Give each partition its own bitmap words. */
+    cbar->n_partitions = 0;
+    cbar->words = 0;
+    for (int slot=0, start=0; slot<CBAR_PARTITIONS; slot++) {
+        if (!sizes[slot])
+            continue;
+        struct cbar_partition *part = &cbar->partitions[cbar->n_partitions++];
+        part->start = start;
+        part->end = start + sizes[slot];
+        part->word = cbar->words;
+        part->words = CBAR_BITMAP_WORDS(sizes[slot]);
+        part->offset = part->word * CBAR_BITS - start;
+        part->serial = (calculated != -1 && slot == parallel);
+        start = part->end;
+        cbar->words += part->words;
+    }
+}
+
+/**
+ * Set up the line state and locks, and run the initial calculation, once
+ * the configs are compiled.
+ */
+static void cbar_start(struct cbar *cbar)
+{
+    for (int i=0; i<cbar->words; i++) {
+        cbar->dirty[i] = 0;
+        cbar->active[i] = 0;
+        atomic_init(&cbar->touched[i], 0);
+    }
+    for (int i=0; i<(int) CBAR_BITMAP_WORDS(cbar->count); i++)
+        atomic_init(&cbar->pending[i], 0);
+    for (int p=0; p<cbar->n_partitions; p++) {
+        pthread_mutex_init(&cbar->partitions[p].mutex, NULL);
+        cbar->partitions[p].raised = false;
+    }
+
+    pthread_mutex_init(&cbar->mutex, NULL);
+    pthread_mutex_init(&cbar->wait_mutex, NULL);
+    pthread_mutex_init(&cbar->sample_mutex, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cbar->wait_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    cbar->pool = NULL;
+    cbar->queue = NULL;
+    atomic_init(&cbar->events, 0);
+    atomic_init(&cbar->waiters, 0);
+    cbar->profile = NULL;
+    atomic_init(&cbar->profiling, 0);
+    cbar->trace = NULL;
+    cbar->filters = NULL;
+    cbar->shared = NULL;
+    cbar->tracing = false;
+    cbar->simulating = false;
+    cbar->time = 0;
+    cbar->sampler = NULL;
+    cbar->sample_elapsed = 0;
+    cbar->sample_next = -1;
+
+    for (int rank=0; rank<cbar->count; rank++) {
+        struct cbar_line *line = &cbar->lines[rank];
+        const struct cbar_op *op = &cbar->ops[rank];
+        int bit = rank + cbar_partition(cbar, rank)->offset;
 
         /* All lines are initially at zero. */
-        line->value = 0;
+        atomic_init(&cbar->values[op->id], 0);
+        atomic_init(&line->version, 0);
 
-        switch (config->type) {
+        /* Every line gets evaluated on the first pass. */
+        cbar_mark(cbar->dirty, bit);
+
+        switch (op->type) {
             case CBAR_INPUT: {
-                line->input.input_value = line->value;
+                atomic_init(&line->input.input_value, 0);
             } break;
             case CBAR_EXTERNAL: {
+                atomic_init(&line->external.sample, 0);
+                if (op->up) {
+                    /* Sample on the first recalculation. */
+                    line->external.elapsed = op->up;
+                    cbar->sample_next = 0;
+                } else {
+                    cbar_mark(cbar->active, bit);
+                }
             } break;
             case CBAR_THRESHOLD: {
             } break;
@@ -41,6 +532,9 @@ void cbar_init(struct cbar *cbar, const struct cbar_line_config *configs, struct
             case CBAR_REQUEST: {
             } break;
             case CBAR_CALCULATED: {
+                /* Polled on every pass; see cbar_memoized(). */
+                line->calculated.seen = UINT_MAX;
+                cbar_mark(cbar->active, bit);
             } break;
             case CBAR_MONITOR: {
                 /* Make the monitor fire immediately on the initial state. */
@@ -48,6 +542,18 @@ void cbar_init(struct cbar *cbar, const struct cbar_line_config *configs, struct
             } break;
             case CBAR_PERIODIC: {
                 line->periodic.elapsed = 0;
+                cbar_mark(cbar->active, bit);
+            } break;
+            case CBAR_LOGIC: {
+                /* Polled if it has more than one input, as a line can only
+                 * be on one input's list of dependents. */
+                if (op->input == -1)
+                    cbar_mark(cbar->active, bit);
+            } break;
+            case CBAR_FILTER: {
+                /* Samples its input on every pass, changed or not. */
+                line->filter.offset = 0;
+                cbar_mark(cbar->active, bit);
             } break;
         }
     }
@@ -55,139 +561,2833 @@ void cbar_init(struct cbar *cbar, const struct cbar_line_config *configs, struct
     cbar_recalculate(cbar, 0);
 }
 
-void cbar_recalculate(struct cbar *cbar, int delay)
+/**
+ * Fill in the fields of a compiled config that come straight from the
+ * line config: all but the ID, level and links.
+ */
+static void cbar_compile(struct cbar_op *op, const struct cbar_line_config *config)
 {
-    pthread_mutex_lock(&cbar->mutex);
+    op->type = config->type;
+    /* Calculated lines, and logic lines with more than one input, are
+     * polled, not linked to their inputs. */
+    op->input = (config->type == CBAR_CALCULATED ||
+                 (config->type == CBAR_LOGIC && cbar_line_input(config, 1) != -1)) ?
+                -1 : cbar_line_input(config, 0);
+    op->up = 0;
+    op->down = 0;
 
-    for (int id=0; cbar->configs[id].type; id++) {
-        struct cbar_line *line = &cbar->lines[id];
+    switch (config->type) {
+        case CBAR_THRESHOLD: {
+            op->up = config->threshold.threshold_up;
+            op->down = config->threshold.threshold_down;
+        } break;
+        case CBAR_DEBOUNCE: {
+            op->up = config->debounce.timeout_up;
+            op->down = config->debounce.timeout_down;
+        } break;
+        case CBAR_EXTERNAL: {
+            op->up = config->external.period;
+        } break;
+        case CBAR_PERIODIC: {
+            op->up = config->periodic.period;
+        } break;
+        case CBAR_LOGIC: {
+            op->up = config->logic.op;
+        } break;
+        case CBAR_FILTER: {
+            op->up = config->filter.kind;
+            op->down = config->filter.window;
+        } break;
+        default:
+            break;
+    }
+}
+
+int cbar_init(struct cbar *cbar, const struct cbar_line_config *configs,
+              struct cbar_op *ops, struct cbar_line *lines, atomic_int *values, int *ranks,
+              unsigned long *dirty, unsigned long *active, atomic_ulong *touched,
+              atomic_ulong *pending, struct cbar_partition *partitions)
+{
+    cbar->configs = configs;
+    cbar->ops = ops;
+    cbar->lines = lines;
+    cbar->values = values;
+    cbar->ranks = ranks;
+    cbar->dirty = dirty;
+    cbar->active = active;
+    cbar->touched = touched;
+    cbar->pending = pending;
+    cbar->partitions = partitions;
+    cbar->index = (struct cbar_index) { NULL };
+
+    for (cbar->count=0; cbar->configs[cbar->count].type; cbar->count++)
+        assert(cbar->configs[cbar->count].type <= CBAR_TYPE_MAX);
+    /* Catch bad line references early; the scheduler would choke on them. */
+    for (int id=0; id<cbar->count; id++) {
         const struct cbar_line_config *config = &cbar->configs[id];
+        int n, input;
+        for (n=0; (input = cbar_line_input(config, n)) != -1; n++)
+            assert(input < cbar->count);
+        if (config->type == CBAR_LOGIC)
+            assert(config->logic.op == CBAR_SELECT ? n == 3 : n > 0);
+        if (config->type == CBAR_FILTER) {
+            assert(config->filter.kind >= CBAR_AVERAGE && config->filter.kind <= CBAR_MEDIAN);
+            assert(config->filter.window > 0);
+            assert(config->filter.kind != CBAR_EXPONENTIAL || config->filter.window < 16);
+        }
+    }
+
+    if (cbar_schedule(cbar, ops, ranks) == -1) {
+        errno = ELOOP;
+        return -1;
+    }
+    cbar_split(cbar, ops, ranks);
+
+    /* Compile the configs. */
+    for (int rank=0; rank<cbar->count; rank++) {
+        struct cbar_op *op = &ops[rank];
+        cbar_compile(op, &cbar->configs[op->id]);
+        op->dependents = -1;
+        op->sibling = -1;
+    }
+
+    /* Link lines into their inputs' lists of dependents. Going backwards
+     * keeps the lists in evaluation order. */
+    for (int rank=cbar->count-1; rank>=0; rank--) {
+        struct cbar_op *op = &ops[rank];
+        if (op->input != -1) {
+            struct cbar_op *input = &ops[ranks[op->input]];
+            op->sibling = input->dependents;
+            input->dependents = rank;
+        }
+    }
+
+    cbar_start(cbar);
+
+    return 0;
+}
+
+/* FNV-1a, a byte at a time. */
+static uint64_t cbar_fnv(uint64_t hash, const void *data, size_t size)
+{
+    for (const unsigned char *p=data; size--; p++) {
+        hash ^= *p;
+        hash *= UINT64_C(0x100000001b3);
+    }
+    return hash;
+}
+
+/**
+ * Hash everything the compiled configs are made from, to tell whether an
+ * image still matches. Callbacks and their arguments are left out; they're
+ * always taken from the configs.
+ */
+static uint64_t cbar_fingerprint(const struct cbar_line_config *configs, int count)
+{
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+
+    for (int id=0; id<count; id++) {
+        const struct cbar_line_config *config = &configs[id];
+        int fields[3] = { config->type };
 
         switch (config->type) {
-            case CBAR_INPUT: {
-                line->value = line->input.input_value;
-            } break;
             case CBAR_EXTERNAL: {
-                int input = config->external.get(config->external.priv);
-                line->value = config->external.invert ? !input : input;
+                fields[1] = config->external.period;
+                fields[2] = config->external.invert;
             } break;
             case CBAR_THRESHOLD: {
-                int input = cbar->lines[config->debounce.input].value;
-
-                if (line->value)
-                    line->value = (input >= config->threshold.threshold_down);
-                else
-                    line->value = (input >= config->threshold.threshold_up);
-
-                /* Swapping the up/down values inverts logic. */
-                if (config->threshold.threshold_up < config->threshold.threshold_down)
-                    line->value = !line->value;
+                fields[1] = config->threshold.threshold_up;
+                fields[2] = config->threshold.threshold_down;
             } break;
             case CBAR_DEBOUNCE: {
-                int input = cbar->lines[config->debounce.input].value;
-                int timeout = input ? config->debounce.timeout_up : config->debounce.timeout_down;
-
-                if (line->debounce.value != input) {
-                    // Line state just changed. Reset debounce timer.
-                    //printf("cbar: [debounce] %s going towards %d\r\n", config->name, input);
-                    line->debounce.value = input;
-                    line->debounce.timer = 0;
-                } else if (line->debounce.value != line->value) {
-                    // Line state is stabilizing. Bump debounce timer.
-                    //printf("cbar: [debounce] %s clocked %d vs %d\r\n", config->name, line->debounce.timer, timeout);
-                    line->debounce.timer += delay;
-                }
-
-                if (line->debounce.value != line->value && line->debounce.timer >= timeout) {
-                    // Line just stabilized. Register the change.
-                    //printf("cbar: [debounce] %s stable at %d\r\n", config->name, input);
-                    line->value = line->debounce.value;
-                }
-            } break;
-            case CBAR_REQUEST: {
+                fields[1] = config->debounce.timeout_up;
+                fields[2] = config->debounce.timeout_down;
             } break;
             case CBAR_CALCULATED: {
-                line->value = config->calculated.get(cbar);
-            } break;
-            case CBAR_MONITOR: {
-                int input = cbar->lines[config->monitor.input].value;
-                if (input != line->monitor.previous) {
-                    //printf("cbar: [monitor] %s changed to %d\r\n", config->name, input);
-                    line->value = true;
-                    line->monitor.previous = input;
-                }
+                fields[1] = config->calculated.inputs != NULL;
             } break;
             case CBAR_PERIODIC: {
-                line->periodic.elapsed += delay;
-                if (line->periodic.elapsed >= config->periodic.period) {
-                    line->periodic.elapsed = 0;
-                    line->value = 1;
-                }
+                fields[1] = config->periodic.period;
+            } break;
+            case CBAR_LOGIC: {
+                fields[1] = config->logic.op;
+            } break;
+            case CBAR_FILTER: {
+                fields[1] = config->filter.kind;
+                fields[2] = config->filter.window;
             } break;
+            default:
+                break;
         }
+        hash = cbar_fnv(hash, fields, sizeof(fields));
+        for (int n=0, input; (input = cbar_line_input(config, n)) != -1; n++)
+            hash = cbar_fnv(hash, &input, sizeof(input));
+        hash = cbar_fnv(hash, &(int) { -1 }, sizeof(int));
+        if (config->name)
+            hash = cbar_fnv(hash, config->name, strlen(config->name) + 1);
     }
 
-    pthread_mutex_unlock(&cbar->mutex);
+    return hash;
 }
 
-void cbar_input(struct cbar *cbar, int id, int value)
+/* Image sections start on 8-byte boundaries. */
+#define CBAR_IMAGE_ALIGN(X) (((X) + 7) & ~(size_t) 7)
+
+/**
+ * Image checksum: FNV-1a over native 64-bit words, so checking a whole
+ * image at boot is cheap, but fed any number of bytes at a time.
+ */
+struct cbar_image_sum {
+    uint64_t hash;
+    unsigned char word[8];
+    int fill;
+};
+
+static void cbar_image_sum(struct cbar_image_sum *sum, const void *data, size_t size)
 {
-    struct cbar_line *line = &cbar->lines[id];
-    const struct cbar_line_config *config = &cbar->configs[id];
+    const unsigned char *p = data;
+    uint64_t word;
 
-    assert(config->type == CBAR_INPUT);
-    //printf("cbar: [input] %s set to %d\r\n", config->name, value);
-    pthread_mutex_lock(&cbar->mutex);
-    line->input.input_value = value;
-    pthread_mutex_unlock(&cbar->mutex);
+    while (size) {
+        if (!sum->fill && size >= 8) {
+            memcpy(&word, p, 8);
+            p += 8;
+            size -= 8;
+        } else {
+            sum->word[sum->fill++] = *p++;
+            size--;
+            if (sum->fill < 8)
+                continue;
+            memcpy(&word, sum->word, 8);
+            sum->fill = 0;
+        }
+        sum->hash = (sum->hash ^ word) * UINT64_C(0x100000001b3);
+    }
 }
 
-void cbar_post(struct cbar *cbar, int id)
+/**
+ * Write a section of an image, padding up to its offset first, and add
+ * both to the checksum. Either the stream or the checksum may be NULL.
+ */
+static bool cbar_image_put(FILE *stream, struct cbar_image_sum *sum, size_t *pos, size_t offset,
+                           const void *data, size_t size)
 {
-    struct cbar_line *line = &cbar->lines[id];
-    const struct cbar_line_config *config = &cbar->configs[id];
+    for (; *pos < offset; (*pos)++) {
+        if (stream && fputc(0, stream) == EOF)
+            return false;
+        if (sum)
+            cbar_image_sum(sum, "", 1);
+    }
+    if (size && stream && fwrite(data, size, 1, stream) != 1)
+        return false;
+    if (sum)
+        cbar_image_sum(sum, data, size);
+    *pos += size;
+    return true;
+}
 
-    assert(config->type == CBAR_REQUEST);
-    //printf("cbar: [request] %s posted\r\n", config->name);
-    pthread_mutex_lock(&cbar->mutex);
-    line->value = 1;
-    pthread_mutex_unlock(&cbar->mutex);
+/**
+ * Write or checksum everything after the header.
+ */
+static bool cbar_image_body(FILE *stream, struct cbar_image_sum *sum, const struct cbar_image *header,
+                            struct cbar *cbar)
+{
+    size_t pos = header->ops;
+    bool ok = cbar_image_put(stream, sum, &pos, header->ops, cbar->ops, cbar->count * sizeof(struct cbar_op)) &&
+              cbar_image_put(stream, sum, &pos, header->ranks, cbar->ranks, cbar->count * sizeof(int));
+    for (int p=0; ok && p<cbar->n_partitions; p++) {
+        const struct cbar_partition *part = &cbar->partitions[p];
+        struct cbar_image_partition image = {
+            part->start, part->end, part->word, part->words, part->offset, part->serial,
+        };
+        ok = cbar_image_put(stream, sum, &pos, header->partitions + p * sizeof(image), &image, sizeof(image));
+    }
+    return ok &&
+           cbar_image_put(stream, sum, &pos, header->slots, cbar->index.slots, header->n_slots * sizeof(int)) &&
+           cbar_image_put(stream, sum, &pos, header->seeds, cbar->index.seeds, header->n_buckets * sizeof(unsigned)) &&
+           cbar_image_put(stream, sum, &pos, header->size, NULL, 0);
 }
 
-int cbar_value(struct cbar *cbar, int id)
+int cbar_image_write(FILE *stream, struct cbar *cbar)
 {
-    struct cbar_line *line = &cbar->lines[id];
+    struct cbar_image header = {
+        .magic = CBAR_IMAGE_MAGIC,
+        .layout = sizeof(struct cbar_op),
+        .fingerprint = cbar_fingerprint(cbar->configs, cbar->count),
+        .count = cbar->count,
+        .n_partitions = cbar->n_partitions,
+        .words = cbar->words,
+        .n_slots = cbar->index.slots ? cbar->index.n_slots : 0,
+        .n_buckets = cbar->index.slots ? cbar->index.n_buckets : 0,
+    };
+    header.ops = CBAR_IMAGE_ALIGN(sizeof(header));
+    header.ranks = CBAR_IMAGE_ALIGN(header.ops + cbar->count * sizeof(struct cbar_op));
+    header.partitions = CBAR_IMAGE_ALIGN(header.ranks + cbar->count * sizeof(int));
+    header.slots = CBAR_IMAGE_ALIGN(header.partitions +
+                                    cbar->n_partitions * sizeof(struct cbar_image_partition));
+    header.seeds = CBAR_IMAGE_ALIGN(header.slots + header.n_slots * sizeof(int));
+    header.size = CBAR_IMAGE_ALIGN(header.seeds + header.n_buckets * sizeof(unsigned));
 
-    // Don't acquire the mutex as we will get called in the calculate function.
-    return line->value;
+    /* Checksum the body first, so the stream needn't be seekable. */
+    struct cbar_image_sum sum = { .hash = UINT64_C(0xcbf29ce484222325) };
+    cbar_image_body(NULL, &sum, &header, cbar);
+    header.checksum = sum.hash;
+
+    size_t pos = 0;
+    bool ok = cbar_image_put(stream, NULL, &pos, 0, &header, sizeof(header)) &&
+              cbar_image_put(stream, NULL, &pos, header.ops, NULL, 0) &&
+              cbar_image_body(stream, NULL, &header, cbar);
+
+    return ok ? 0 : -1;
 }
 
-bool cbar_pending(struct cbar *cbar, int id)
+/**
+ * Check that an image section lies within the image.
+ */
+static bool cbar_image_holds(const struct cbar_image *header, uint32_t offset, size_t size)
 {
-    struct cbar_line *line = &cbar->lines[id];
-    const struct cbar_line_config *config = &cbar->configs[id];
+    return offset % 8 == 0 && offset <= header->size && size <= header->size - offset;
+}
 
-    assert(config->type == CBAR_REQUEST ||
-           config->type == CBAR_MONITOR ||
-           config->type == CBAR_PERIODIC);
-    pthread_mutex_lock(&cbar->mutex);
-    int value = line->value;
-    line->value = 0;
-    pthread_mutex_unlock(&cbar->mutex);
-    //if (value)
-    //    printf("cbar: [request] %s pended\r\n", config->name);
+/**
+ * Check that an image whose header is in bounds holds a schedule the
+ * evaluator can safely run: the body must match its checksum, and every
+ * rank, ID and bitmap position in it must agree with the configs and the
+ * rest of the image. Anything less and one flipped bit could send a write
+ * out of bounds.
+ */
+static bool cbar_image_valid(const struct cbar_image *header, const struct cbar_line_config *configs,
+                             int count)
+{
+    const char *base = (const char *) header;
+    const struct cbar_op *ops = (const struct cbar_op *) (base + header->ops);
+    const int *ranks = (const int *) (base + header->ranks);
+    const struct cbar_image_partition *parts =
+        (const struct cbar_image_partition *) (base + header->partitions);
 
-    return value;
+    if (header->ops < sizeof(*header))
+        return false;
+    struct cbar_image_sum sum = { .hash = UINT64_C(0xcbf29ce484222325) };
+    cbar_image_sum(&sum, base + header->ops, header->size - header->ops);
+    if (sum.fill || sum.hash != header->checksum)
+        return false;
+
+    /* Partitions must tile the ranks, and their bitmaps the words. */
+    int end = 0, words = 0;
+    for (int p=0; p<header->n_partitions; p++) {
+        const struct cbar_image_partition *part = &parts[p];
+        if (part->start != end || part->end <= part->start || part->end > count ||
+            part->word != words || part->words != (int) CBAR_BITMAP_WORDS(part->end - part->start) ||
+            part->offset != (int) (part->word * CBAR_BITS) - part->start ||
+            (part->serial != 0 && part->serial != 1))
+            return false;
+        end = part->end;
+        words += part->words;
+    }
+    if (end != count || words != header->words)
+        return false;
+
+    /* Ranks and ops must be inverses, and ops what their configs compile
+     * to, in dependency order within each partition. Inputs and links must
+     * stay inside their partition. */
+    for (int p=0, rank=0; p<header->n_partitions; p++) {
+        for (; rank<parts[p].end; rank++) {
+            const struct cbar_op *op = &ops[rank];
+            struct cbar_op compiled;
+            int input;
+            if (op->id < 0 || op->id >= count || ranks[op->id] != rank || op->level < 0 ||
+                (rank > parts[p].start && op->level < ops[rank-1].level))
+                return false;
+            cbar_compile(&compiled, &configs[op->id]);
+            if (op->type != compiled.type || op->input != compiled.input ||
+                op->up != compiled.up || op->down != compiled.down)
+                return false;
+            for (int n=0; (input = cbar_line_input(&configs[op->id], n)) != -1; n++) {
+                if (ranks[input] < parts[p].start || ranks[input] >= rank ||
+                    ops[ranks[input]].level >= op->level)
+                    return false;
+            }
+            if ((op->dependents != -1 && (op->dependents <= rank || op->dependents >= parts[p].end)) ||
+                (op->sibling != -1 && (op->sibling <= rank || op->sibling >= parts[p].end)))
+                return false;
+        }
+    }
+
+    /* Lookups compare names, so slots must point at named lines. */
+    const int *slots = (const int *) (base + header->slots);
+    for (int slot=0; slot<header->n_slots; slot++) {
+        if (slots[slot] != -1 &&
+            (slots[slot] < 0 || slots[slot] >= count || !configs[slots[slot]].name))
+            return false;
+    }
+
+    return true;
 }
 
-void cbar_dump(FILE *stream, struct cbar *cbar)
+int cbar_init_image(struct cbar *cbar, const struct cbar_line_config *configs,
+                    const void *image, size_t size,
+                    struct cbar_line *lines, atomic_int *values,
+                    unsigned long *dirty, unsigned long *active, atomic_ulong *touched,
+                    atomic_ulong *pending, struct cbar_partition *partitions)
 {
-    for (int id=0; cbar->configs[id].type; id++) {
-        struct cbar_line *line = &cbar->lines[id];
-        const struct cbar_line_config *config = &cbar->configs[id];
+    const struct cbar_image *header = image;
+    const char *base = image;
+
+    for (cbar->count=0; configs[cbar->count].type; cbar->count++)
+        assert(configs[cbar->count].type <= CBAR_TYPE_MAX);
+
+    if ((uintptr_t) image % 8 || size < sizeof(*header) || header->size > size ||
+        header->magic != CBAR_IMAGE_MAGIC || header->layout != sizeof(struct cbar_op) ||
+        header->count != cbar->count ||
+        header->n_partitions < 0 || header->n_partitions > CBAR_PARTITIONS ||
+        header->words < 0 || header->words > (int) CBAR_PARTITION_WORDS(cbar->count) ||
+        (header->n_slots && (header->n_slots != CBAR_INDEX_SLOTS(cbar->count) ||
+                             header->n_buckets != CBAR_INDEX_BUCKETS(cbar->count))) ||
+        !cbar_image_holds(header, header->ops, cbar->count * sizeof(struct cbar_op)) ||
+        !cbar_image_holds(header, header->ranks, cbar->count * sizeof(int)) ||
+        !cbar_image_holds(header, header->partitions,
+                          header->n_partitions * sizeof(struct cbar_image_partition)) ||
+        !cbar_image_holds(header, header->slots, header->n_slots * sizeof(int)) ||
+        !cbar_image_holds(header, header->seeds, header->n_buckets * sizeof(unsigned)) ||
+        header->fingerprint != cbar_fingerprint(configs, cbar->count) ||
+        !cbar_image_valid(header, configs, cbar->count)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    cbar->configs = configs;
+    cbar->ops = (const struct cbar_op *) (base + header->ops);
+    cbar->lines = lines;
+    cbar->values = values;
+    cbar->ranks = (const int *) (base + header->ranks);
+    cbar->dirty = dirty;
+    cbar->active = active;
+    cbar->touched = touched;
+    cbar->pending = pending;
+    cbar->partitions = partitions;
+    cbar->n_partitions = header->n_partitions;
+    cbar->words = header->words;
+    for (int p=0; p<cbar->n_partitions; p++) {
+        const struct cbar_image_partition *part =
+            (const struct cbar_image_partition *) (base + header->partitions) + p;
+        partitions[p].start = part->start;
+        partitions[p].end = part->end;
+        partitions[p].word = part->word;
+        partitions[p].words = part->words;
+        partitions[p].offset = part->offset;
+        partitions[p].serial = part->serial;
+    }
+    cbar->index = (struct cbar_index) { NULL };
+    if (header->n_slots) {
+        cbar->index = (struct cbar_index) {
+            .slots = (const int *) (base + header->slots),
+            .seeds = (const unsigned *) (base + header->seeds),
+            .n_slots = header->n_slots,
+            .n_buckets = header->n_buckets,
+        };
+    }
+
+    cbar_start(cbar);
+
+    return 0;
+}
+
+/**
+ * Store a new line value, scheduling its dependents if it has changed.
+ */
+static void cbar_update(struct cbar *cbar, struct cbar_partition *part, int rank, int previous, int value)
+{
+    if (value != previous) {
+        atomic_store_explicit(&cbar->values[cbar->ops[rank].id], value, memory_order_relaxed);
+        atomic_fetch_add_explicit(&cbar->lines[rank].version, 1, memory_order_relaxed);
+        cbar_mark_dependents(cbar, part, rank);
+        cbar_trace_transition(cbar, cbar->ops[rank].id, previous, value);
+    }
+}
+
+/**
+ * Threshold kernel: computes new line values from input and current values.
+ */
+static inline void cbar_threshold_kernel(int n, const int *input, const int *value,
+                                         const int *up, const int *down, int *result)
+{
+    int i = 0;
+
+#if !defined(CBAR_NO_SIMD) && defined(__AVX2__)
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(1);
+    for (; i+8<=n; i+=8) {
+        __m256i in = _mm256_loadu_si256((const __m256i *) &input[i]);
+        __m256i u = _mm256_loadu_si256((const __m256i *) &up[i]);
+        __m256i d = _mm256_loadu_si256((const __m256i *) &down[i]);
+        __m256i low = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *) &value[i]), zero);
+        __m256i below = _mm256_cmpgt_epi32(_mm256_blendv_epi8(d, u, low), in);
+        __m256i inverted = _mm256_cmpgt_epi32(d, u);
+        __m256i r = _mm256_andnot_si256(_mm256_xor_si256(below, inverted), one);
+        _mm256_storeu_si256((__m256i *) &result[i], r);
+    }
+#elif !defined(CBAR_NO_SIMD) && defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi32(1);
+    for (; i+4<=n; i+=4) {
+        __m128i in = _mm_loadu_si128((const __m128i *) &input[i]);
+        __m128i u = _mm_loadu_si128((const __m128i *) &up[i]);
+        __m128i d = _mm_loadu_si128((const __m128i *) &down[i]);
+        __m128i low = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) &value[i]), zero);
+        __m128i threshold = _mm_or_si128(_mm_and_si128(low, u), _mm_andnot_si128(low, d));
+        __m128i below = _mm_cmpgt_epi32(threshold, in);
+        __m128i inverted = _mm_cmpgt_epi32(d, u);
+        __m128i r = _mm_andnot_si128(_mm_xor_si128(below, inverted), one);
+        _mm_storeu_si128((__m128i *) &result[i], r);
+    }
+#endif
+
+    for (; i<n; i++) {
+        int r = input[i] >= (value[i] ? down[i] : up[i]);
 
-        fprintf(stream, "cbar: %s = %d\r\n", config->name, line->value);
+        /* Swapping the up/down values inverts logic. */
+        result[i] = (up[i] < down[i]) ? !r : r;
     }
 }
 
+/**
+ * Debounce kernel: advances the timers and updates line values in place.
+ *
+ * When the input differs from the value being debounced, the timer restarts
+ * towards the new value; otherwise, while the line is unstable, the timer
+ * counts, and the line takes the new value once the timeout passes.
+ */
+static inline void cbar_debounce_kernel(int n, int delay, const int *input, int *value, int *target,
+                                        int *timer, const int *up, const int *down)
+{
+    int i = 0;
+
+#if !defined(CBAR_NO_SIMD) && defined(__AVX2__)
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i step = _mm256_set1_epi32(delay);
+    for (; i+8<=n; i+=8) {
+        __m256i in = _mm256_loadu_si256((const __m256i *) &input[i]);
+        __m256i v = _mm256_loadu_si256((const __m256i *) &value[i]);
+        __m256i dv = _mm256_loadu_si256((const __m256i *) &target[i]);
+        __m256i t = _mm256_loadu_si256((const __m256i *) &timer[i]);
+        __m256i u = _mm256_loadu_si256((const __m256i *) &up[i]);
+        __m256i d = _mm256_loadu_si256((const __m256i *) &down[i]);
+        __m256i same = _mm256_cmpeq_epi32(dv, in);
+        __m256i stable = _mm256_cmpeq_epi32(in, v);
+        t = _mm256_and_si256(same, _mm256_add_epi32(t, _mm256_andnot_si256(stable, step)));
+        __m256i timeout = _mm256_blendv_epi8(u, d, _mm256_cmpeq_epi32(in, zero));
+        __m256i hold = _mm256_or_si256(stable, _mm256_cmpgt_epi32(timeout, t));
+        v = _mm256_blendv_epi8(in, v, hold);
+        _mm256_storeu_si256((__m256i *) &value[i], v);
+        _mm256_storeu_si256((__m256i *) &target[i], in);
+        _mm256_storeu_si256((__m256i *) &timer[i], t);
+    }
+#elif !defined(CBAR_NO_SIMD) && defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i step = _mm_set1_epi32(delay);
+    for (; i+4<=n; i+=4) {
+        __m128i in = _mm_loadu_si128((const __m128i *) &input[i]);
+        __m128i v = _mm_loadu_si128((const __m128i *) &value[i]);
+        __m128i dv = _mm_loadu_si128((const __m128i *) &target[i]);
+        __m128i t = _mm_loadu_si128((const __m128i *) &timer[i]);
+        __m128i u = _mm_loadu_si128((const __m128i *) &up[i]);
+        __m128i d = _mm_loadu_si128((const __m128i *) &down[i]);
+        __m128i same = _mm_cmpeq_epi32(dv, in);
+        __m128i stable = _mm_cmpeq_epi32(in, v);
+        t = _mm_and_si128(same, _mm_add_epi32(t, _mm_andnot_si128(stable, step)));
+        __m128i low = _mm_cmpeq_epi32(in, zero);
+        __m128i timeout = _mm_or_si128(_mm_and_si128(low, d), _mm_andnot_si128(low, u));
+        __m128i hold = _mm_or_si128(stable, _mm_cmpgt_epi32(timeout, t));
+        v = _mm_or_si128(_mm_and_si128(hold, v), _mm_andnot_si128(hold, in));
+        _mm_storeu_si128((__m128i *) &value[i], v);
+        _mm_storeu_si128((__m128i *) &target[i], in);
+        _mm_storeu_si128((__m128i *) &timer[i], t);
+    }
+#endif
+
+    for (; i<n; i++) {
+        int timeout = input[i] ? up[i] : down[i];
+
+        if (target[i] != input[i]) {
+            // Line state just changed. Reset debounce timer.
+            target[i] = input[i];
+            timer[i] = 0;
+        } else if (target[i] != value[i]) {
+            // Line state is stabilizing. Bump debounce timer.
+            timer[i] += delay;
+        }
+
+        if (target[i] != value[i] && timer[i] >= timeout) {
+            // Line just stabilized. Register the change.
+            value[i] = target[i];
+        }
+    }
+}
+
+/**
+ * Evaluate a run of threshold or debounce lines.
+ *
+ * The lines are all on the same dependency level, so none of them reads
+ * another, and they can be evaluated side by side: gather their inputs and
+ * state, run the kernel, scatter the results.
+ */
+static void cbar_evaluate_batch(struct cbar *cbar, struct cbar_partition *part,
+                                const int *batch, int n, int delay)
+{
+    int input[CBAR_BATCH], previous[CBAR_BATCH], value[CBAR_BATCH];
+    int up[CBAR_BATCH], down[CBAR_BATCH];
+    int target[CBAR_BATCH], timer[CBAR_BATCH];
+    enum cbar_line_type type = cbar->ops[batch[0]].type;
+
+    for (int i=0; i<n; i++) {
+        const struct cbar_op *op = &cbar->ops[batch[i]];
+        input[i] = atomic_load_explicit(&cbar->values[op->input], memory_order_relaxed);
+        previous[i] = atomic_load_explicit(&cbar->values[op->id], memory_order_relaxed);
+        value[i] = previous[i];
+        up[i] = op->up;
+        down[i] = op->down;
+    }
+
+    if (type == CBAR_THRESHOLD) {
+        cbar_threshold_kernel(n, input, previous, up, down, value);
+    } else {
+        for (int i=0; i<n; i++) {
+            target[i] = cbar->lines[batch[i]].debounce.value;
+            timer[i] = cbar->lines[batch[i]].debounce.timer;
+        }
+        cbar_debounce_kernel(n, delay, input, value, target, timer, up, down);
+        for (int i=0; i<n; i++) {
+            cbar->lines[batch[i]].debounce.value = target[i];
+            cbar->lines[batch[i]].debounce.timer = timer[i];
+
+            /* Keep clocking the timer until the line stabilizes. */
+            if (target[i] != value[i])
+                cbar_mark(cbar->active, batch[i] + part->offset);
+            else
+                cbar_unmark(cbar->active, batch[i] + part->offset);
+        }
+    }
+
+    for (int i=0; i<n; i++)
+        cbar_update(cbar, part, batch[i], previous[i], value[i]);
+}
+
+/**
+ * Evaluate a run of logic lines, right here: no callbacks, no function
+ * pointers, just loads of their inputs' values.
+ */
+static void cbar_evaluate_logic(struct cbar *cbar, struct cbar_partition *part,
+                                const int *batch, int n)
+{
+    for (int k=0; k<n; k++) {
+        const struct cbar_op *op = &cbar->ops[batch[k]];
+        const int *inputs = cbar->configs[op->id].logic.inputs;
+        int previous = atomic_load_explicit(&cbar->values[op->id], memory_order_relaxed);
+        int value;
+
+        if (op->up == CBAR_SELECT) {
+            int select = atomic_load_explicit(&cbar->values[inputs[0]], memory_order_relaxed);
+            value = atomic_load_explicit(&cbar->values[inputs[select ? 1 : 2]], memory_order_relaxed);
+        } else {
+            int all = 1, any = 0;
+            for (; *inputs != -1; inputs++) {
+                int high = atomic_load_explicit(&cbar->values[*inputs], memory_order_relaxed) != 0;
+                all &= high;
+                any |= high;
+            }
+            value = (op->up == CBAR_AND) ? all : (op->up == CBAR_OR) ? any : !any;
+        }
+
+        cbar_update(cbar, part, batch[k], previous, value);
+    }
+}
+
+/**
+ * Divide, rounding halves away from zero.
+ */
+static int cbar_divide(int sum, int count)
+{
+    return sum >= 0 ? (sum + count/2) / count : -((-sum + count/2) / count);
+}
+
+/**
+ * Take one sample into a filter and return its output. The state starts
+ * with the number of samples taken, up to the window, the ring position
+ * of the next one and the running sum or accumulator; then come the
+ * samples in arrival order, and for medians, the same sorted.
+ */
+static int cbar_filter(int *state, int kind, int window, int sample)
+{
+    int *ring = &state[3];
+
+    switch (kind) {
+        case CBAR_AVERAGE: {
+            /* Swap the oldest sample for the newest in the sum. */
+            if (state[0] == window)
+                state[2] -= ring[state[1]];
+            else
+                state[0]++;
+            state[2] += sample;
+            ring[state[1]] = sample;
+            state[1] = (state[1] + 1) % window;
+            return cbar_divide(state[2], state[0]);
+        }
+        case CBAR_EXPONENTIAL: {
+            /* The accumulator holds the output scaled by 2^window. */
+            int scale = 1 << window;
+            if (!state[0]) {
+                state[0] = 1;
+                state[2] = sample * scale;
+            } else {
+                state[2] += sample - cbar_divide(state[2], scale);
+            }
+            return cbar_divide(state[2], scale);
+        }
+        case CBAR_MEDIAN: {
+            int *sorted = &state[3 + window];
+            int n = state[0];
+            /* Take out the oldest sample, then insert the newest in order. */
+            if (n == window) {
+                int i = 0;
+                while (sorted[i] != ring[state[1]])
+                    i++;
+                for (n--; i<n; i++)
+                    sorted[i] = sorted[i+1];
+            }
+            int i = n;
+            for (; i>0 && sorted[i-1] > sample; i--)
+                sorted[i] = sorted[i-1];
+            sorted[i] = sample;
+            state[0] = n + 1;
+            ring[state[1]] = sample;
+            state[1] = (state[1] + 1) % window;
+            return sorted[n/2];
+        }
+    }
+
+    return sample;
+}
+
+/**
+ * Check whether a calculated line can skip its callback: it declares its
+ * inputs and none of them has changed since the last call. Otherwise,
+ * remember the input versions for next time.
+ */
+static bool cbar_memoized(struct cbar *cbar, int rank)
+{
+    const int *inputs = cbar->configs[cbar->ops[rank].id].calculated.inputs;
+    if (!inputs)
+        return false;
+
+    /* Versions only go up, so the sum only stays put if none changed. */
+    unsigned sum = 0;
+    for (; *inputs != -1; inputs++)
+        sum += atomic_load_explicit(&cbar->lines[cbar->ranks[*inputs]].version, memory_order_relaxed);
+
+    struct cbar_line *line = &cbar->lines[rank];
+    if (sum == line->calculated.seen)
+        return true;
+    line->calculated.seen = sum;
+    return false;
+}
+
+static int cbar_external_get(const struct cbar_line_config *config)
+{
+    int input = config->external.get(config->external.priv);
+    return config->external.invert ? !input : input;
+}
+
+/**
+ * Call the callback of an external or calculated line. Sampled external
+ * lines, and all of them while simulating, read the latest sample instead.
+ */
+static int cbar_callback(struct cbar *cbar, int rank)
+{
+    const struct cbar_op *op = &cbar->ops[rank];
+    const struct cbar_line_config *config = &cbar->configs[op->id];
+
+    if (op->type == CBAR_CALCULATED)
+        return config->calculated.get(cbar);
+    if (op->up || cbar->simulating)
+        return atomic_load_explicit(&cbar->lines[rank].external.sample, memory_order_relaxed);
+
+    return cbar_external_get(config);
+}
+
+/**
+ * Evaluate a single line.
+ */
+static void cbar_evaluate(struct cbar *cbar, struct cbar_partition *part, int rank, int delay)
+{
+    const struct cbar_op *op = &cbar->ops[rank];
+    struct cbar_line *line = &cbar->lines[rank];
+    int previous = atomic_load_explicit(&cbar->values[op->id], memory_order_relaxed);
+    int value = previous;
+
+    switch (op->type) {
+        case CBAR_INPUT: {
+            value = atomic_load_explicit(&line->input.input_value, memory_order_relaxed);
+        } break;
+        case CBAR_EXTERNAL: {
+            value = cbar_callback(cbar, rank);
+        } break;
+        case CBAR_THRESHOLD:
+        case CBAR_DEBOUNCE: {
+            /* Same as a batch of one. */
+            cbar_evaluate_batch(cbar, part, &rank, 1, delay);
+            return;
+        }
+        case CBAR_LOGIC: {
+            cbar_evaluate_logic(cbar, part, &rank, 1);
+            return;
+        }
+        case CBAR_FILTER: {
+            /* Held at its initial value until cbar_filter_start(). */
+            if (cbar->filters) {
+                value = atomic_load_explicit(&cbar->values[op->input], memory_order_relaxed);
+                value = cbar_filter(&cbar->filters[line->filter.offset], op->up, op->down, value);
+            }
+        } break;
+        case CBAR_REQUEST: {
+        } break;
+        case CBAR_CALCULATED: {
+            if (!cbar_memoized(cbar, rank))
+                value = cbar_callback(cbar, rank);
+        } break;
+        case CBAR_MONITOR: {
+            int input = atomic_load_explicit(&cbar->values[op->input], memory_order_relaxed);
+            if (input != line->monitor.previous) {
+                //printf("cbar: [monitor] %s changed to %d\r\n", cbar->configs[op->id].name, input);
+                cbar_raise(cbar, part, rank);
+                line->monitor.previous = input;
+            }
+        } break;
+        case CBAR_PERIODIC: {
+            line->periodic.elapsed += delay;
+            if (line->periodic.elapsed >= op->up) {
+                line->periodic.elapsed = 0;
+                cbar_raise(cbar, part, rank);
+            }
+        } break;
+    }
+
+    /* Pending lines are raised above; they can be cleared concurrently,
+     * so storing a stale value here could lose or duplicate an event. */
+    cbar_update(cbar, part, rank, previous, value);
+}
+
+/**
+ * Apply a batch of input values. Must be called with the mutex held.
+ */
+static void cbar_apply(struct cbar *cbar, const int *ids, const int *values, size_t n)
+{
+    for (size_t i=0; i<n; i++) {
+        int rank = cbar->ranks[ids[i]];
+
+        assert(cbar->configs[ids[i]].type == CBAR_INPUT);
+        atomic_store_explicit(&cbar->lines[rank].input.input_value, values[i], memory_order_relaxed);
+        cbar_mark(cbar->dirty, rank + cbar_partition(cbar, rank)->offset);
+    }
+}
+
+#ifndef CBAR_NO_PROFILE
+static uint64_t cbar_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Returns the current time if profiling is on, 0 otherwise.
+ */
+static uint64_t cbar_profile_clock(struct cbar *cbar)
+{
+    return atomic_load_explicit(&cbar->profiling, memory_order_relaxed) ? cbar_clock() : 0;
+}
+
+static void cbar_profile_record(struct cbar_profile_stat *stat, uint64_t ns)
+{
+    int bucket = ns < 128 ? 0 : 63 - __builtin_clzll(ns) - 6;
+    if (bucket >= CBAR_PROFILE_BUCKETS)
+        bucket = CBAR_PROFILE_BUCKETS - 1;
+
+    stat->count++;
+    stat->total += ns;
+    if (ns > stat->max)
+        stat->max = ns;
+    stat->histogram[bucket]++;
+}
+
+/**
+ * Record the evaluation of lines started at a given time, splitting the
+ * time evenly between them.
+ */
+static void cbar_profile_lines(struct cbar *cbar, const int *batch, int n, uint64_t start)
+{
+    if (!start)
+        return;
+
+    uint64_t share = (cbar_clock() - start) / n;
+    for (int i=0; i<n; i++)
+        cbar_profile_record(&cbar->profile->lines[cbar->ops[batch[i]].id], share);
+}
+
+/**
+ * Record a tick that started at a given time and took the mutex at another.
+ * Must be called with the mutex held.
+ */
+static void cbar_profile_tick(struct cbar *cbar, uint64_t start, uint64_t locked)
+{
+    /* Profiling may have been switched on or off while we were waiting. */
+    if (!locked)
+        return;
+
+    uint64_t end = cbar_clock();
+    cbar_profile_record(&cbar->profile->tick, end - (start ? start : locked));
+    cbar_profile_record(&cbar->profile->locked, end - locked);
+}
+#else
+static uint64_t cbar_profile_clock(struct cbar *cbar)
+{
+    return 0;
+}
+
+static void cbar_profile_lines(struct cbar *cbar, const int *batch, int n, uint64_t start)
+{
+}
+
+static void cbar_profile_tick(struct cbar *cbar, uint64_t start, uint64_t locked)
+{
+}
+#endif
+
+/*
+ * A job range packs the tag, job owner, end and start of the items left into
+ * one word, so that taking and stealing items is a single compare-and-swap.
+ * The tag changes whenever a thread publishes a new range, so a stale steal
+ * can't succeed.
+ */
+static unsigned long long cbar_range(unsigned tag, int owner, int end, int start)
+{
+    return (unsigned long long) tag << 32 | (unsigned long long) owner << 16 | end << 8 | start;
+}
+
+#define CBAR_RANGE_TAG(R) ((unsigned) ((R) >> 32))
+#define CBAR_RANGE_OWNER(R) ((int) ((R) >> 16) & 0xffff)
+#define CBAR_RANGE_END(R) ((int) ((R) >> 8) & 0xff)
+#define CBAR_RANGE_START(R) ((int) (R) & 0xff)
+
+/**
+ * Wake up threads waiting for work or for work to finish.
+ */
+static void cbar_pool_notify(struct cbar_pool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->events++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * Take one item from our own range and run it.
+ */
+static bool cbar_pool_take(struct cbar_worker *self)
+{
+    unsigned long long range = atomic_load_explicit(&self->range, memory_order_acquire);
+
+    do {
+        if (CBAR_RANGE_START(range) >= CBAR_RANGE_END(range))
+            return false;
+    } while (!atomic_compare_exchange_weak_explicit(&self->range, &range, range + 1,
+                                                    memory_order_acq_rel, memory_order_acquire));
+
+    struct cbar_pool *pool = self->pool;
+    struct cbar_worker *owner = &pool->workers[CBAR_RANGE_OWNER(range)];
+    int item = CBAR_RANGE_START(range);
+    owner->values[item] = cbar_callback(pool->cbar, owner->ranks[item]);
+    /* The owner only sleeps if someone else holds the last items. */
+    if (atomic_fetch_sub_explicit(&owner->remaining, 1, memory_order_acq_rel) == 1 && owner != self)
+        cbar_pool_notify(pool);
+
+    return true;
+}
+
+/**
+ * Steal the back half of another thread's range into our own, which must
+ * be empty. Others may in turn steal from us.
+ */
+static bool cbar_pool_steal(struct cbar_worker *self)
+{
+    struct cbar_pool *pool = self->pool;
+    int index = self - pool->workers;
+
+    for (int k=1; k<=pool->count; k++) {
+        struct cbar_worker *victim = &pool->workers[(index + k) % (pool->count + 1)];
+        unsigned long long range = atomic_load_explicit(&victim->range, memory_order_acquire);
+        int start, end, middle;
+
+        do {
+            start = CBAR_RANGE_START(range);
+            end = CBAR_RANGE_END(range);
+            if (start >= end)
+                break;
+            middle = end - (end - start + 1) / 2;
+        } while (!atomic_compare_exchange_weak_explicit(&victim->range, &range,
+                     cbar_range(CBAR_RANGE_TAG(range), CBAR_RANGE_OWNER(range), middle, start),
+                     memory_order_acq_rel, memory_order_acquire));
+        if (start >= end)
+            continue;
+
+        unsigned tag = CBAR_RANGE_TAG(atomic_load_explicit(&self->range, memory_order_relaxed)) + 1;
+        atomic_store_explicit(&self->range, cbar_range(tag, CBAR_RANGE_OWNER(range), end, middle),
+                              memory_order_release);
+        return true;
+    }
+
+    return false;
+}
+
+static bool cbar_pool_work(struct cbar_worker *self)
+{
+    return cbar_pool_take(self) || cbar_pool_steal(self);
+}
+
+/**
+ * Run whatever callbacks are left until the counter drops to zero.
+ */
+static void cbar_pool_help(struct cbar_worker *self, atomic_int *counter)
+{
+    struct cbar_pool *pool = self->pool;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->mutex);
+        unsigned events = pool->events;
+        pthread_mutex_unlock(&pool->mutex);
+
+        while (cbar_pool_work(self))
+            ;
+        if (!atomic_load_explicit(counter, memory_order_acquire))
+            return;
+
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->events == events && atomic_load_explicit(counter, memory_order_acquire))
+            pthread_cond_wait(&pool->wake, &pool->mutex);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+/**
+ * Call a run of callbacks on the pool and wait for their results.
+ */
+static void cbar_pool_job(struct cbar_worker *self, const int *ranks, int *values, int n)
+{
+    struct cbar_pool *pool = self->pool;
+
+    self->ranks = ranks;
+    self->values = values;
+    atomic_store_explicit(&self->remaining, n, memory_order_relaxed);
+    unsigned tag = CBAR_RANGE_TAG(atomic_load_explicit(&self->range, memory_order_relaxed)) + 1;
+    atomic_store_explicit(&self->range, cbar_range(tag, self - pool->workers, n, 0),
+                          memory_order_release);
+    cbar_pool_notify(pool);
+
+    cbar_pool_help(self, &self->remaining);
+}
+
+/**
+ * Evaluate a run of external or calculated lines at the same level. None of
+ * them reads another, so the callbacks can run in any order; the results
+ * are applied in the usual one.
+ */
+static void cbar_evaluate_callbacks(struct cbar *cbar, struct cbar_partition *part,
+                                    struct cbar_worker *self, const int *batch, int n)
+{
+    int values[CBAR_JOB];
+
+    if (n > 1)
+        cbar_pool_job(self, batch, values, n);
+    else if (n == 1)
+        values[0] = cbar_callback(cbar, batch[0]);
+    for (int i=0; i<n; i++) {
+        int id = cbar->ops[batch[i]].id;
+        int previous = atomic_load_explicit(&cbar->values[id], memory_order_relaxed);
+        cbar_update(cbar, part, batch[i], previous, values[i]);
+    }
+}
+
+/**
+ * Take a run of dirty lines of the same type and level, starting at a given
+ * rank in bitmap word i. Lines are sorted by level and type, so the run is
+ * contiguous.
+ */
+static int cbar_take_run(struct cbar *cbar, struct cbar_partition *part, int i, int rank,
+                         int *batch, int max)
+{
+    const struct cbar_op *op = &cbar->ops[rank];
+    int n = 0;
+    int next = rank;
+
+    do {
+        batch[n++] = next;
+        cbar->dirty[i] &= cbar->dirty[i] - 1;
+        if (!cbar->dirty[i])
+            break;
+        next = i * CBAR_BITS + __builtin_ctzl(cbar->dirty[i]) - part->offset;
+    } while (n < max &&
+             cbar->ops[next].type == op->type &&
+             cbar->ops[next].level == op->level);
+
+    return n;
+}
+
+/**
+ * Perform a recalculation pass over one partition. Partitions evaluated in
+ * parallel only share the values array; each has its own bitmap words.
+ *
+ * @param self Pool state of the calling thread, or NULL to call all
+ *             callbacks right here.
+ */
+static void cbar_pass(struct cbar *cbar, struct cbar_partition *part, struct cbar_worker *self,
+                      int delay)
+{
+    pthread_mutex_lock(&part->mutex);
+
+    for (int i=part->word; i<part->word+part->words; i++) {
+        cbar->dirty[i] |= cbar->active[i];
+        /* Collect lines touched by other threads since the last pass. */
+        if (atomic_load_explicit(&cbar->touched[i], memory_order_relaxed))
+            cbar->dirty[i] |= atomic_exchange_explicit(&cbar->touched[i], 0, memory_order_acquire);
+    }
+
+    /* Dependents always come later in the order, so changes propagate
+     * all the way through in a single pass. */
+    for (int i=part->word; i<part->word+part->words; i++) {
+        while (cbar->dirty[i]) {
+            int rank = i * CBAR_BITS + __builtin_ctzl(cbar->dirty[i]) - part->offset;
+            const struct cbar_op *op = &cbar->ops[rank];
+            uint64_t start = cbar_profile_clock(cbar);
+
+            if (op->type == CBAR_THRESHOLD || op->type == CBAR_DEBOUNCE) {
+                int batch[CBAR_BATCH];
+                int n = cbar_take_run(cbar, part, i, rank, batch, CBAR_BATCH);
+                cbar_evaluate_batch(cbar, part, batch, n, delay);
+                cbar_profile_lines(cbar, batch, n, start);
+            } else if (op->type == CBAR_LOGIC) {
+                int batch[CBAR_BATCH];
+                int n = cbar_take_run(cbar, part, i, rank, batch, CBAR_BATCH);
+                cbar_evaluate_logic(cbar, part, batch, n);
+                cbar_profile_lines(cbar, batch, n, start);
+            } else if (self && (op->type == CBAR_CALCULATED ||
+                                (op->type == CBAR_EXTERNAL && !cbar->simulating))) {
+                int batch[CBAR_JOB];
+                int n = cbar_take_run(cbar, part, i, rank, batch, CBAR_JOB);
+                if (op->type == CBAR_CALCULATED) {
+                    int called = 0;
+                    for (int k=0; k<n; k++)
+                        if (!cbar_memoized(cbar, batch[k]))
+                            batch[called++] = batch[k];
+                    n = called;
+                }
+                cbar_evaluate_callbacks(cbar, part, self, batch, n);
+                if (n)
+                    cbar_profile_lines(cbar, batch, n, start);
+            } else {
+                cbar->dirty[i] &= cbar->dirty[i] - 1;
+                cbar_evaluate(cbar, part, rank, delay);
+                cbar_profile_lines(cbar, &rank, 1, start);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&part->mutex);
+}
+
+/**
+ * Returns the number of partitions that can be evaluated in parallel.
+ */
+static int cbar_parallel(struct cbar *cbar)
+{
+    int count = cbar->n_partitions;
+    return (count && cbar->partitions[count-1].serial) ? count - 1 : count;
+}
+
+/**
+ * Take partitions of the current tick and evaluate them until none are left.
+ */
+static void cbar_pool_run(struct cbar_worker *self)
+{
+    struct cbar_pool *pool = self->pool;
+    struct cbar *cbar = pool->cbar;
+    int parallel = cbar_parallel(cbar);
+    int p;
+
+    while ((p = atomic_fetch_add_explicit(&pool->next, 1, memory_order_acq_rel)) < parallel) {
+        cbar_pass(cbar, &cbar->partitions[p], self, pool->delay);
+        if (atomic_fetch_sub_explicit(&pool->pending, 1, memory_order_acq_rel) == 1)
+            cbar_pool_notify(pool);
+    }
+}
+
+static void *cbar_pool_worker(void *arg)
+{
+    struct cbar_worker *self = arg;
+    struct cbar_pool *pool = self->pool;
+
+    /* Work may have been posted before this thread started; look if so. */
+    unsigned events = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        while (pool->events == events && !pool->stopping)
+            pthread_cond_wait(&pool->wake, &pool->mutex);
+        if (pool->stopping)
+            break;
+        events = pool->events;
+
+        pthread_mutex_unlock(&pool->mutex);
+        cbar_pool_run(self);
+        while (cbar_pool_work(self))
+            ;
+        pthread_mutex_lock(&pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+static atomic_int *cbar_shared_values(const struct cbar_shared *shared)
+{
+    return (atomic_int *) (shared + 1);
+}
+
+static size_t cbar_shared_size(int count)
+{
+    return sizeof(struct cbar_shared) + count * sizeof(atomic_int);
+}
+
+/**
+ * Copy line values out to shared memory, if exported. Must be called with
+ * the mutex held.
+ */
+static void cbar_publish(struct cbar *cbar)
+{
+    struct cbar_shared *shared = cbar->shared;
+    if (!shared)
+        return;
+
+    atomic_int *exported = cbar_shared_values(shared);
+    unsigned sequence = atomic_load_explicit(&shared->sequence, memory_order_relaxed);
+    atomic_store_explicit(&shared->sequence, sequence + 1, memory_order_relaxed);
+
+    /* Release stores keep the odd sequence ahead of them; a reader that sees
+     * any of them with an acquire load sees it too. */
+    atomic_store_explicit(&shared->time, cbar->time, memory_order_release);
+    /* Only write what changed, so idle pages stay clean. */
+    for (int id=0; id<cbar->count; id++) {
+        int value = atomic_load_explicit(&cbar->values[id], memory_order_relaxed);
+        if (atomic_load_explicit(&exported[id], memory_order_relaxed) != value)
+            atomic_store_explicit(&exported[id], value, memory_order_release);
+    }
+
+    atomic_store_explicit(&shared->sequence, sequence + 2, memory_order_release);
+}
+
+/**
+ * Evaluate all partitions. Must be called with the mutex held.
+ *
+ * @returns true if any pending lines were raised.
+ */
+static bool cbar_tick(struct cbar *cbar, int delay)
+{
+    struct cbar_pool *pool = cbar->pool;
+    struct cbar_worker *self = pool ? &pool->workers[pool->count] : NULL;
+    int parallel = cbar_parallel(cbar);
+    int first = 0;
+
+    cbar->time += delay;
+
+    /* The trace has room for only one writer. */
+    if (pool && !cbar->tracing && parallel > 1) {
+        pthread_mutex_lock(&pool->mutex);
+        pool->delay = delay;
+        atomic_store_explicit(&pool->pending, parallel, memory_order_relaxed);
+        atomic_store_explicit(&pool->next, 0, memory_order_release);
+        pool->events++;
+        pthread_cond_broadcast(&pool->wake);
+        pthread_mutex_unlock(&pool->mutex);
+
+        cbar_pool_run(self);
+        cbar_pool_help(self, &pool->pending);
+
+        first = parallel;
+    }
+
+    for (int p=first; p<cbar->n_partitions; p++)
+        cbar_pass(cbar, &cbar->partitions[p], self, delay);
+
+    bool raised = false;
+    for (int p=0; p<cbar->n_partitions; p++) {
+        raised |= cbar->partitions[p].raised;
+        cbar->partitions[p].raised = false;
+    }
+
+    cbar_publish(cbar);
+
+    return raised;
+}
+
+/**
+ * Sample the external lines that are due, marking those whose sample has
+ * changed. Does nothing while simulating, or if the sampler thread is
+ * running and this isn't it.
+ *
+ * @param elapsed Time since the last call, in miliseconds.
+ * @returns Time until the next line is due, or -1 if there are none.
+ */
+static int cbar_sample(struct cbar *cbar, int elapsed, struct cbar_sampler *sampler)
+{
+    pthread_mutex_lock(&cbar->sample_mutex);
+    if (cbar->sampler != sampler || cbar->simulating || cbar->sample_next == -1) {
+        pthread_mutex_unlock(&cbar->sample_mutex);
+        return -1;
+    }
+
+    /* Nothing is due before sample_next, so don't bother looking. */
+    cbar->sample_elapsed += elapsed;
+    if (cbar->sample_elapsed < cbar->sample_next) {
+        int next = cbar->sample_next - cbar->sample_elapsed;
+        pthread_mutex_unlock(&cbar->sample_mutex);
+        return next;
+    }
+
+    int next = -1;
+    for (int rank=0; rank<cbar->count; rank++) {
+        const struct cbar_op *op = &cbar->ops[rank];
+        struct cbar_line *line = &cbar->lines[rank];
+        if (op->type != CBAR_EXTERNAL || !op->up)
+            continue;
+
+        line->external.elapsed += cbar->sample_elapsed;
+        if (line->external.elapsed >= op->up) {
+            line->external.elapsed = 0;
+            int value = cbar_external_get(&cbar->configs[op->id]);
+            if (atomic_exchange_explicit(&line->external.sample, value, memory_order_relaxed) != value)
+                cbar_touch(cbar->touched, rank + cbar_partition(cbar, rank)->offset);
+        }
+        if (next == -1 || op->up - line->external.elapsed < next)
+            next = op->up - line->external.elapsed;
+    }
+    cbar->sample_elapsed = 0;
+    cbar->sample_next = next;
+
+    pthread_mutex_unlock(&cbar->sample_mutex);
+    return next;
+}
+
+void cbar_recalculate(struct cbar *cbar, int delay)
+{
+    cbar_sample(cbar, delay, NULL);
+
+    uint64_t start = cbar_profile_clock(cbar);
+    pthread_mutex_lock(&cbar->mutex);
+    uint64_t locked = cbar_profile_clock(cbar);
+    bool raised = cbar_tick(cbar, delay);
+    cbar_profile_tick(cbar, start, locked);
+    pthread_mutex_unlock(&cbar->mutex);
+
+    if (raised)
+        cbar_notify(cbar);
+}
+
+void cbar_recalculate_batch(struct cbar *cbar, const int *ids, const int *values, size_t n, int delay)
+{
+    cbar_sample(cbar, delay, NULL);
+
+    uint64_t start = cbar_profile_clock(cbar);
+    pthread_mutex_lock(&cbar->mutex);
+    uint64_t locked = cbar_profile_clock(cbar);
+    cbar_apply(cbar, ids, values, n);
+    bool raised = cbar_tick(cbar, delay);
+    cbar_profile_tick(cbar, start, locked);
+    pthread_mutex_unlock(&cbar->mutex);
+
+    if (raised)
+        cbar_notify(cbar);
+}
+
+int cbar_next_deadline(struct cbar *cbar)
+{
+    int deadline = -1;
+
+    pthread_mutex_lock(&cbar->mutex);
+
+    /* Running timers are always in the active set. */
+    for (int i=0; i<cbar->words; i++) {
+        for (unsigned long bits=cbar->active[i]; bits; bits&=bits-1) {
+            int rank = i * CBAR_BITS + __builtin_ctzl(bits);
+            rank -= cbar_partition_at(cbar, i)->offset;
+            const struct cbar_op *op = &cbar->ops[rank];
+            struct cbar_line *line = &cbar->lines[rank];
+            int remaining;
+
+            switch (op->type) {
+                case CBAR_DEBOUNCE: {
+                    int timeout = line->debounce.value ? op->up : op->down;
+                    remaining = timeout - line->debounce.timer;
+                } break;
+                case CBAR_PERIODIC: {
+                    remaining = op->up - line->periodic.elapsed;
+                } break;
+                default:
+                    continue;
+            }
+
+            if (remaining < 0)
+                remaining = 0;
+            if (deadline == -1 || remaining < deadline)
+                deadline = remaining;
+        }
+    }
+
+    pthread_mutex_unlock(&cbar->mutex);
+
+    /* Without the sampler thread, sampled lines are read by recalculation. */
+    pthread_mutex_lock(&cbar->sample_mutex);
+    if (!cbar->sampler && !cbar->simulating && cbar->sample_next != -1) {
+        int remaining = cbar->sample_next - cbar->sample_elapsed;
+        if (remaining < 0)
+            remaining = 0;
+        if (deadline == -1 || remaining < deadline)
+            deadline = remaining;
+    }
+    pthread_mutex_unlock(&cbar->sample_mutex);
+
+    return deadline;
+}
+
+void cbar_input(struct cbar *cbar, int id, int value)
+{
+    int rank = cbar->ranks[id];
+    const struct cbar_line_config *config = &cbar->configs[id];
+
+    assert(config->type == CBAR_INPUT);
+    //printf("cbar: [input] %s set to %d\r\n", config->name, value);
+    atomic_store_explicit(&cbar->lines[rank].input.input_value, value, memory_order_relaxed);
+    cbar_touch(cbar->touched, rank + cbar_partition(cbar, rank)->offset);
+}
+
+void cbar_input_batch(struct cbar *cbar, const int *ids, const int *values, size_t n)
+{
+    pthread_mutex_lock(&cbar->mutex);
+    cbar_apply(cbar, ids, values, n);
+    pthread_mutex_unlock(&cbar->mutex);
+}
+
+void cbar_post(struct cbar *cbar, int id)
+{
+    const struct cbar_line_config *config = &cbar->configs[id];
+
+    assert(config->type == CBAR_REQUEST);
+    //printf("cbar: [request] %s posted\r\n", config->name);
+    if (!atomic_exchange_explicit(&cbar->values[id], 1, memory_order_release)) {
+        cbar_touch_dependents(cbar, cbar->ranks[id]);
+        cbar_signal(cbar, id);
+        cbar_notify(cbar);
+    }
+}
+
+/**
+ * Lines read by a callback under cbar_record_inputs(), on this thread.
+ */
+struct cbar_recording {
+    int *ids;
+    int max;
+    int stored;                     /**< Line IDs stored in ids. */
+    int first;                      /**< First line ID in the counting window. */
+    int count;                      /**< Lines counted in the windows so far. */
+    unsigned long seen[CBAR_BITMAP_WORDS(CBAR_RECORD_WINDOW)];
+};
+
+static _Thread_local struct cbar_recording *cbar_recording;
+
+static void cbar_record(struct cbar_recording *recording, int id)
+{
+    /* Until ids is full, it holds every line read so far. */
+    if (recording->stored < recording->max) {
+        int i = 0;
+        while (i < recording->stored && recording->ids[i] != id)
+            i++;
+        if (i == recording->stored)
+            recording->ids[recording->stored++] = id;
+    }
+
+    int bit = id - recording->first;
+    if (bit >= 0 && bit < CBAR_RECORD_WINDOW &&
+        !(recording->seen[bit / CBAR_BITS] & 1UL << (bit % CBAR_BITS))) {
+        cbar_mark(recording->seen, bit);
+        recording->count++;
+    }
+}
+
+int cbar_value(struct cbar *cbar, int id)
+{
+    struct cbar_recording *recording = cbar_recording;
+    if (recording)
+        cbar_record(recording, id);
+
+    // Don't acquire the mutex as we will get called in the calculate function.
+    return atomic_load_explicit(&cbar->values[id], memory_order_relaxed);
+}
+
+int cbar_record_inputs(struct cbar *cbar, int id, int *ids, int max)
+{
+    const struct cbar_line_config *config = &cbar->configs[id];
+    struct cbar_recording recording = { ids, max };
+
+    assert(config->type == CBAR_CALCULATED);
+    cbar_recording = &recording;
+    do {
+        memset(recording.seen, 0, sizeof(recording.seen));
+        config->calculated.get(cbar);
+        recording.first += CBAR_RECORD_WINDOW;
+        /* Lines can only have been missed once ids filled up; count them a
+         * window of IDs at a time. */
+    } while (recording.stored == max && recording.first < cbar->count);
+    cbar_recording = NULL;
+
+    return recording.stored < max ? recording.stored : recording.count;
+}
+
+bool cbar_pending(struct cbar *cbar, int id)
+{
+    const struct cbar_line_config *config = &cbar->configs[id];
+
+    assert(config->type == CBAR_REQUEST ||
+           config->type == CBAR_MONITOR ||
+           config->type == CBAR_PERIODIC);
+    int value = atomic_exchange_explicit(&cbar->values[id], 0, memory_order_acquire);
+    if (value)
+        cbar_touch_dependents(cbar, cbar->ranks[id]);
+    //if (value)
+    //    printf("cbar: [request] %s pended\r\n", config->name);
+
+    return value;
+}
+
+/**
+ * Clear a line taken off the queue or the bitmap.
+ * @returns true if it was pending.
+ */
+static bool cbar_take(struct cbar *cbar, int id)
+{
+    return atomic_load_explicit(&cbar->values[id], memory_order_relaxed) && cbar_pending(cbar, id);
+}
+
+int cbar_pending_drain(struct cbar *cbar, int *ids, int max)
+{
+    struct cbar_queue *queue = cbar->queue;
+    int count = 0;
+
+    if (queue) {
+        int id;
+        while (count < max && (id = cbar_queue_pop(queue)) != -1) {
+            atomic_fetch_and_explicit(&cbar->pending[id / CBAR_BITS], ~(1UL << (id % CBAR_BITS)),
+                                      memory_order_acq_rel);
+            if (cbar_take(cbar, id))
+                ids[count++] = id;
+        }
+        /* Lines raised while the queue was full are only in the bitmap. */
+        if (count == max || !atomic_exchange_explicit(&queue->overflowed, 0, memory_order_acquire))
+            return count;
+    }
+
+    bool full = false;
+    for (int i=0; i<(int) CBAR_BITMAP_WORDS(cbar->count) && !full; i++) {
+        if (!atomic_load_explicit(&cbar->pending[i], memory_order_relaxed))
+            continue;
+        if (count == max) {
+            full = true;
+            break;
+        }
+        unsigned long bits = atomic_exchange_explicit(&cbar->pending[i], 0, memory_order_acq_rel);
+        for (; bits && count < max; bits &= bits - 1) {
+            int id = i * CBAR_BITS + __builtin_ctzl(bits);
+            if (cbar_take(cbar, id))
+                ids[count++] = id;
+        }
+        if (bits) {
+            atomic_fetch_or_explicit(&cbar->pending[i], bits, memory_order_relaxed);
+            full = true;
+        }
+    }
+    /* Come back to the bitmap for the rest. */
+    if (full && queue)
+        atomic_store_explicit(&queue->overflowed, 1, memory_order_relaxed);
+
+    return count;
+}
+
+int cbar_wait_timeout(struct cbar *cbar, int *ids, int max, int timeout)
+{
+    struct timespec deadline;
+
+    if (timeout >= 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (timeout % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    for (;;) {
+        /* Remember the event count before looking, so that anything raised
+         * after we've looked is guaranteed to wake us up. */
+        unsigned events = atomic_load(&cbar->events);
+
+        int count = cbar_pending_drain(cbar, ids, max);
+        if (count)
+            return count;
+
+        /* Count ourselves in before checking again; see cbar_notify(). */
+        pthread_mutex_lock(&cbar->wait_mutex);
+        atomic_fetch_add(&cbar->waiters, 1);
+        bool expired = false;
+        while (!expired && atomic_load(&cbar->events) == events) {
+            if (timeout < 0)
+                pthread_cond_wait(&cbar->wait_cond, &cbar->wait_mutex);
+            else
+                expired = pthread_cond_timedwait(&cbar->wait_cond, &cbar->wait_mutex, &deadline) == ETIMEDOUT;
+        }
+        atomic_fetch_sub(&cbar->waiters, 1);
+        pthread_mutex_unlock(&cbar->wait_mutex);
+        if (expired)
+            return 0;
+    }
+}
+
+int cbar_wait(struct cbar *cbar, int *ids, int max)
+{
+    return cbar_wait_timeout(cbar, ids, max, -1);
+}
+
+/* splitmix64 finalizer. */
+static uint64_t cbar_mix(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
+    return x ^ (x >> 31);
+}
+
+static uint64_t cbar_hash(const char *name)
+{
+    /* FNV-1a; its top bits are poorly spread on their own. */
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+    while (*name) {
+        hash ^= (unsigned char) *name++;
+        hash *= UINT64_C(0x100000001b3);
+    }
+    return cbar_mix(hash);
+}
+
+/* Map a 32-bit value onto [0, n) without dividing. */
+static int cbar_reduce(uint32_t x, int n)
+{
+    return (int) (((uint64_t) x * (unsigned) n) >> 32);
+}
+
+static int cbar_index_bucket(const struct cbar_index *index, uint64_t hash)
+{
+    return cbar_reduce(hash >> 32, index->n_buckets);
+}
+
+static int cbar_index_slot(const struct cbar_index *index, uint64_t hash, unsigned seed)
+{
+    uint64_t x = cbar_mix(hash + seed * UINT64_C(0x9e3779b97f4a7c15));
+    return cbar_reduce(x >> 32, index->n_slots);
+}
+
+/**
+ * Find a seed that sends every name in a bucket to a free slot, and take
+ * the slots.
+ */
+static int cbar_index_place(struct cbar *cbar, const struct cbar_index *index, int *slots,
+                            int head, const int *next, unsigned *seed)
+{
+    const struct cbar_line_config *configs = cbar->configs;
+
+    for (int a=head; a!=-1; a=next[a]) {
+        for (int b=next[a]; b!=-1; b=next[b]) {
+            if (!strcmp(configs[a].name, configs[b].name)) {
+                errno = EEXIST;
+                return -1;
+            }
+        }
+    }
+
+    for (unsigned try=0; try<CBAR_INDEX_TRIES; try++) {
+        int id;
+        for (id=head; id!=-1; id=next[id]) {
+            int slot = cbar_index_slot(index, cbar_hash(configs[id].name), try);
+            if (slots[slot] != -1)
+                break;
+            slots[slot] = id;
+        }
+        if (id == -1) {
+            *seed = try;
+            return 0;
+        }
+        /* Give back the slots taken with this seed. */
+        for (int undo=head; undo!=id; undo=next[undo])
+            slots[cbar_index_slot(index, cbar_hash(configs[undo].name), try)] = -1;
+    }
+
+    errno = ENOSPC;
+    return -1;
+}
+
+int cbar_index_build(struct cbar *cbar, int *slots, unsigned *seeds, int *scratch)
+{
+    int *next = scratch;                /* Next name in the bucket, by ID. */
+    int *heads = scratch + cbar->count; /* First name, by bucket. */
+    int largest = 0;
+
+    struct cbar_index index = {
+        .slots = slots,
+        .seeds = seeds,
+        .n_slots = CBAR_INDEX_SLOTS(cbar->count),
+        .n_buckets = CBAR_INDEX_BUCKETS(cbar->count),
+    };
+    for (int slot=0; slot<index.n_slots; slot++)
+        slots[slot] = -1;
+    for (int bucket=0; bucket<index.n_buckets; bucket++) {
+        seeds[bucket] = 0;
+        heads[bucket] = -1;
+    }
+
+    for (int id=cbar->count-1; id>=0; id--) {
+        if (!cbar->configs[id].name)
+            continue;
+        int bucket = cbar_index_bucket(&index, cbar_hash(cbar->configs[id].name));
+        next[id] = heads[bucket];
+        heads[bucket] = id;
+    }
+
+    /* Place the largest buckets first, while there's plenty of room. */
+    for (int bucket=0; bucket<index.n_buckets; bucket++) {
+        int size = 0;
+        for (int id=heads[bucket]; id!=-1; id=next[id])
+            size++;
+        if (size > largest)
+            largest = size;
+    }
+    for (int size=largest; size>0; size--) {
+        for (int bucket=0; bucket<index.n_buckets; bucket++) {
+            int n = 0;
+            for (int id=heads[bucket]; id!=-1 && n<=size; id=next[id])
+                n++;
+            if (n != size)
+                continue;
+            if (cbar_index_place(cbar, &index, slots, heads[bucket], next, &seeds[bucket]) == -1)
+                return -1;
+        }
+    }
+
+    cbar->index = index;
+    return 0;
+}
+
+int cbar_lookup(struct cbar *cbar, const char *name)
+{
+    const struct cbar_index *index = &cbar->index;
+
+    assert(index->slots);
+    uint64_t hash = cbar_hash(name);
+    int id = index->slots[cbar_index_slot(index, hash, index->seeds[cbar_index_bucket(index, hash)])];
+    if (id == -1 || strcmp(cbar->configs[id].name, name))
+        return -1;
+    return id;
+}
+
+int cbar_input_named(struct cbar *cbar, const char *name, int value)
+{
+    int id = cbar_lookup(cbar, name);
+
+    if (id == -1 || cbar->configs[id].type != CBAR_INPUT) {
+        errno = ENOENT;
+        return -1;
+    }
+    cbar_input(cbar, id, value);
+    return 0;
+}
+
+int cbar_value_named(struct cbar *cbar, const char *name, int *value)
+{
+    int id = cbar_lookup(cbar, name);
+
+    if (id == -1) {
+        errno = ENOENT;
+        return -1;
+    }
+    *value = cbar_value(cbar, id);
+    return 0;
+}
+
+void cbar_dump(FILE *stream, struct cbar *cbar)
+{
+    for (int id=0; cbar->configs[id].type; id++) {
+        const struct cbar_line_config *config = &cbar->configs[id];
+
+        fprintf(stream, "cbar: %s = %d\r\n", config->name, cbar_value(cbar, id));
+    }
+}
+
+void cbar_snapshot_init(struct cbar_snapshot *snapshot, int *values, int count)
+{
+    *snapshot = (struct cbar_snapshot) { .values = values, .count = count };
+    for (int id=0; id<count; id++)
+        values[id] = 0;
+}
+
+/**
+ * Append a varint: seven bits per byte, least significant first, with the
+ * top bit set on all bytes but the last.
+ * @returns false if there's no room.
+ */
+static bool cbar_put_varint(uint8_t **p, const uint8_t *end, unsigned long long x)
+{
+    do {
+        if (*p == end)
+            return false;
+        uint8_t byte = x & 0x7f;
+        x >>= 7;
+        *(*p)++ = byte | (x ? 0x80 : 0);
+    } while (x);
+    return true;
+}
+
+/**
+ * Take a varint.
+ * @returns 1 on success, 0 if it's cut short, -1 if it's too long.
+ */
+static int cbar_get_varint(const uint8_t **p, const uint8_t *end, unsigned long long *x)
+{
+    *x = 0;
+    for (int shift=0; shift<64; shift+=7) {
+        if (*p == end)
+            return 0;
+        uint8_t byte = *(*p)++;
+        *x |= (unsigned long long) (byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return 1;
+    }
+    return -1;
+}
+
+/* Map small negative values to small varints too. */
+static unsigned cbar_zigzag(int value)
+{
+    return ((unsigned) value << 1) ^ (unsigned) -(value < 0);
+}
+
+static int cbar_unzigzag(unsigned zigzag)
+{
+    return (int) (zigzag >> 1) ^ -(int) (zigzag & 1);
+}
+
+int cbar_snapshot_encode(struct cbar *cbar, struct cbar_snapshot *snapshot,
+                         uint8_t *buf, size_t size, bool keyframe)
+{
+    uint8_t *p = buf;
+    const uint8_t *end = buf + size;
+
+    assert(snapshot->count == cbar->count);
+    keyframe |= !snapshot->synced;
+
+    /* Keep the values consistent; this holds off recalculation. */
+    pthread_mutex_lock(&cbar->mutex);
+    unsigned long time = cbar->time;
+    bool fits = cbar_put_varint(&p, end, keyframe);
+    if (keyframe)
+        fits = fits && cbar_put_varint(&p, end, cbar->count) && cbar_put_varint(&p, end, time);
+    else
+        fits = fits && cbar_put_varint(&p, end, time - snapshot->time);
+    for (int id=0, previous=-1; fits && id<cbar->count; id++) {
+        int value = atomic_load_explicit(&cbar->values[id], memory_order_relaxed);
+        if (!keyframe && value == snapshot->values[id])
+            continue;
+        fits = cbar_put_varint(&p, end, id - previous) && cbar_put_varint(&p, end, cbar_zigzag(value));
+        snapshot->values[id] = value;
+        previous = id;
+    }
+    fits = fits && cbar_put_varint(&p, end, 0);
+    pthread_mutex_unlock(&cbar->mutex);
+
+    /* Some values were taken in already; start over with a keyframe. */
+    snapshot->synced = fits;
+    if (!fits) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    snapshot->time = time;
+    return p - buf;
+}
+
+/**
+ * Walk a frame, applying it to the snapshot if asked to.
+ * @returns As cbar_snapshot_decode().
+ */
+static int cbar_snapshot_parse(struct cbar_snapshot *snapshot, const uint8_t *buf, size_t size,
+                               bool apply)
+{
+    const uint8_t *p = buf, *end = buf + size;
+    unsigned long long flags, count, time, gap, zigzag;
+    int status;
+
+    if ((status = cbar_get_varint(&p, end, &flags)) != 1)
+        return status;
+    if (flags > 1)
+        return -1;
+    if (flags) {
+        if ((status = cbar_get_varint(&p, end, &count)) != 1)
+            return status;
+        if (count != (unsigned long long) snapshot->count)
+            return -1;
+    } else if (!snapshot->synced) {
+        return -1;
+    }
+    if ((status = cbar_get_varint(&p, end, &time)) != 1)
+        return status;
+
+    for (int id=-1;;) {
+        if ((status = cbar_get_varint(&p, end, &gap)) != 1)
+            return status;
+        if (!gap)
+            break;
+        if (gap > (unsigned long long) (snapshot->count - 1 - id))
+            return -1;
+        id += gap;
+        if ((status = cbar_get_varint(&p, end, &zigzag)) != 1)
+            return status;
+        if (zigzag > UINT_MAX)
+            return -1;
+        if (apply)
+            snapshot->values[id] = cbar_unzigzag(zigzag);
+    }
+
+    if (apply) {
+        snapshot->time = flags ? time : snapshot->time + time;
+        snapshot->synced = true;
+    }
+    return p - buf;
+}
+
+int cbar_snapshot_decode(struct cbar_snapshot *snapshot, const uint8_t *buf, size_t size)
+{
+    int status = cbar_snapshot_parse(snapshot, buf, size, false);
+    if (status == -1)
+        errno = EINVAL;
+    if (status <= 0)
+        return status;
+
+    return cbar_snapshot_parse(snapshot, buf, size, true);
+}
+
+/**
+ * Returns the filter storage a filter line takes, in ints: exponential
+ * filters keep no samples, and averages don't need them sorted.
+ */
+static size_t cbar_filter_size(const struct cbar_op *op)
+{
+    switch (op->up) {
+        case CBAR_AVERAGE: return CBAR_FILTER_SIZE(op->down) - op->down;
+        case CBAR_MEDIAN: return CBAR_FILTER_SIZE(op->down);
+        default: return CBAR_FILTER_SIZE(0);
+    }
+}
+
+int cbar_filter_start(struct cbar *cbar, int *filters, size_t size)
+{
+    size_t used = 0;
+
+    for (int rank=0; rank<cbar->count; rank++) {
+        const struct cbar_op *op = &cbar->ops[rank];
+        if (op->type != CBAR_FILTER)
+            continue;
+        used += cbar_filter_size(op);
+        if (used > size) {
+            errno = ENOSPC;
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&cbar->mutex);
+    used = 0;
+    for (int rank=0; rank<cbar->count; rank++) {
+        const struct cbar_op *op = &cbar->ops[rank];
+        if (op->type != CBAR_FILTER)
+            continue;
+        cbar->lines[rank].filter.offset = used;
+        /* Empty: no samples, nothing summed. */
+        filters[used] = filters[used+1] = filters[used+2] = 0;
+        used += cbar_filter_size(op);
+    }
+    cbar->filters = filters;
+    pthread_mutex_unlock(&cbar->mutex);
+
+    return 0;
+}
+
+void cbar_queue_start(struct cbar *cbar, struct cbar_queue *queue, struct cbar_queue_cell *cells,
+                      unsigned long size)
+{
+    queue->cells = cells;
+    queue->size = size;
+    for (unsigned long i=0; i<size; i++)
+        atomic_init(&cells[i].sequence, i);
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->overflowed, 0);
+
+    /* Lines raised before now are only in the bitmap. */
+    pthread_mutex_lock(&cbar->mutex);
+    atomic_store_explicit(&queue->overflowed, 1, memory_order_relaxed);
+    cbar->queue = queue;
+    pthread_mutex_unlock(&cbar->mutex);
+}
+
+int cbar_pool_start(struct cbar *cbar, struct cbar_pool *pool, pthread_t *threads,
+                    struct cbar_worker *workers, int count)
+{
+    pool->cbar = cbar;
+    pool->threads = threads;
+    pool->count = count;
+    pool->workers = workers;
+    pool->events = 0;
+    pool->stopping = false;
+    pool->delay = 0;
+    /* Nothing to claim until the first tick. */
+    atomic_init(&pool->next, cbar_parallel(cbar));
+    atomic_init(&pool->pending, 0);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    /* The last slot belongs to whoever calls cbar_recalculate(). */
+    for (int i=0; i<=count; i++) {
+        workers[i].pool = pool;
+        atomic_init(&workers[i].range, 0);
+        atomic_init(&workers[i].remaining, 0);
+    }
+
+    for (int i=0; i<count; i++) {
+        int error = pthread_create(&threads[i], NULL, cbar_pool_worker, &workers[i]);
+        if (error) {
+            pool->count = i;
+            pthread_mutex_lock(&cbar->mutex);
+            cbar->pool = pool;
+            pthread_mutex_unlock(&cbar->mutex);
+            cbar_pool_stop(cbar);
+            errno = error;
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&cbar->mutex);
+    cbar->pool = pool;
+    pthread_mutex_unlock(&cbar->mutex);
+
+    return 0;
+}
+
+void cbar_pool_stop(struct cbar *cbar)
+{
+    pthread_mutex_lock(&cbar->mutex);
+    struct cbar_pool *pool = cbar->pool;
+    cbar->pool = NULL;
+    pthread_mutex_unlock(&cbar->mutex);
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int i=0; i<pool->count; i++)
+        pthread_join(pool->threads[i], NULL);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->mutex);
+}
+
+static void *cbar_sampler_run(void *arg)
+{
+    struct cbar_sampler *sampler = arg;
+    struct timespec last, now;
+    clock_gettime(CLOCK_MONOTONIC, &last);
+
+    pthread_mutex_lock(&sampler->mutex);
+    while (!sampler->stopping) {
+        pthread_mutex_unlock(&sampler->mutex);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long elapsed = (now.tv_sec - last.tv_sec) * 1000 + (now.tv_nsec - last.tv_nsec) / 1000000;
+        /* Carry the fraction of a milisecond over to the next round. */
+        last.tv_sec += elapsed / 1000;
+        last.tv_nsec += elapsed % 1000 * 1000000;
+        if (last.tv_nsec >= 1000000000) {
+            last.tv_sec++;
+            last.tv_nsec -= 1000000000;
+        }
+        int next = cbar_sample(sampler->cbar, elapsed, sampler);
+        pthread_mutex_lock(&sampler->mutex);
+
+        if (sampler->stopping)
+            break;
+        if (next == -1) {
+            pthread_cond_wait(&sampler->cond, &sampler->mutex);
+        } else {
+            struct timespec until = last;
+            until.tv_sec += next / 1000;
+            until.tv_nsec += next % 1000 * 1000000;
+            if (until.tv_nsec >= 1000000000) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&sampler->cond, &sampler->mutex, &until);
+        }
+    }
+    pthread_mutex_unlock(&sampler->mutex);
+
+    return NULL;
+}
+
+int cbar_sampler_start(struct cbar *cbar, struct cbar_sampler *sampler)
+{
+    sampler->cbar = cbar;
+    sampler->stopping = false;
+    pthread_mutex_init(&sampler->mutex, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sampler->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pthread_mutex_lock(&cbar->sample_mutex);
+    cbar->sampler = sampler;
+    pthread_mutex_unlock(&cbar->sample_mutex);
+
+    int error = pthread_create(&sampler->thread, NULL, cbar_sampler_run, sampler);
+    if (error) {
+        pthread_mutex_lock(&cbar->sample_mutex);
+        cbar->sampler = NULL;
+        pthread_mutex_unlock(&cbar->sample_mutex);
+        pthread_cond_destroy(&sampler->cond);
+        pthread_mutex_destroy(&sampler->mutex);
+        errno = error;
+        return -1;
+    }
+
+    return 0;
+}
+
+void cbar_sampler_stop(struct cbar *cbar)
+{
+    pthread_mutex_lock(&cbar->sample_mutex);
+    struct cbar_sampler *sampler = cbar->sampler;
+    cbar->sampler = NULL;
+    pthread_mutex_unlock(&cbar->sample_mutex);
+    if (!sampler)
+        return;
+
+    pthread_mutex_lock(&sampler->mutex);
+    sampler->stopping = true;
+    pthread_cond_signal(&sampler->cond);
+    pthread_mutex_unlock(&sampler->mutex);
+
+    pthread_join(sampler->thread, NULL);
+    pthread_cond_destroy(&sampler->cond);
+    pthread_mutex_destroy(&sampler->mutex);
+}
+
+void cbar_profile_start(struct cbar *cbar, struct cbar_profile *profile,
+                        struct cbar_profile_stat *lines)
+{
+    pthread_mutex_lock(&cbar->mutex);
+    *profile = (struct cbar_profile) { .lines = lines };
+    for (int id=0; id<cbar->count; id++)
+        lines[id] = (struct cbar_profile_stat) { 0 };
+    cbar->profile = profile;
+#ifndef CBAR_NO_PROFILE
+    atomic_store_explicit(&cbar->profiling, 1, memory_order_relaxed);
+#endif
+    pthread_mutex_unlock(&cbar->mutex);
+}
+
+void cbar_profile_stop(struct cbar *cbar)
+{
+    pthread_mutex_lock(&cbar->mutex);
+    atomic_store_explicit(&cbar->profiling, 0, memory_order_relaxed);
+    pthread_mutex_unlock(&cbar->mutex);
+}
+
+static void cbar_profile_print(FILE *stream, const char *name, const struct cbar_profile_stat *stat)
+{
+    fprintf(stream, "cbar: %s count=%lu total=%lluus mean=%lluns max=%lluns", name, stat->count,
+            (unsigned long long) stat->total / 1000,
+            (unsigned long long) (stat->count ? stat->total / stat->count : 0),
+            (unsigned long long) stat->max);
+    for (int bucket=0; bucket<CBAR_PROFILE_BUCKETS; bucket++) {
+        if (!stat->histogram[bucket])
+            continue;
+        if (bucket == 0)
+            fprintf(stream, " <128ns:%lu", stat->histogram[bucket]);
+        else
+            fprintf(stream, " %lluns:%lu", 64ULL << bucket, stat->histogram[bucket]);
+    }
+    fprintf(stream, "\r\n");
+}
+
+void cbar_profile_dump(FILE *stream, struct cbar *cbar)
+{
+    /* Keep the numbers consistent; this holds off recalculation. */
+    pthread_mutex_lock(&cbar->mutex);
+    if (cbar->profile) {
+        cbar_profile_print(stream, "[tick]", &cbar->profile->tick);
+        cbar_profile_print(stream, "[locked]", &cbar->profile->locked);
+        for (int id=0; id<cbar->count; id++)
+            if (cbar->profile->lines[id].count)
+                cbar_profile_print(stream, cbar->configs[id].name, &cbar->profile->lines[id]);
+    }
+    pthread_mutex_unlock(&cbar->mutex);
+}
+
+int cbar_export_start(struct cbar *cbar, const char *name)
+{
+    size_t size = cbar_shared_size(cbar->count);
+
+    pthread_mutex_lock(&cbar->mutex);
+    bool exporting = cbar->shared != NULL;
+    pthread_mutex_unlock(&cbar->mutex);
+    if (exporting) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    /* Start afresh; readers of the old object keep their mapping. */
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd == -1)
+        return -1;
+    if (ftruncate(fd, size) == -1) {
+        int error = errno;
+        close(fd);
+        shm_unlink(name);
+        errno = error;
+        return -1;
+    }
+    struct cbar_shared *shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED) {
+        int error = errno;
+        shm_unlink(name);
+        errno = error;
+        return -1;
+    }
+
+    /* The object comes zero-filled. */
+    shared->count = cbar->count;
+
+    pthread_mutex_lock(&cbar->mutex);
+    cbar->shared = shared;
+    cbar->shared_name = name;
+    cbar_publish(cbar);
+    pthread_mutex_unlock(&cbar->mutex);
+
+    return 0;
+}
+
+void cbar_export_stop(struct cbar *cbar)
+{
+    pthread_mutex_lock(&cbar->mutex);
+    struct cbar_shared *shared = cbar->shared;
+    cbar->shared = NULL;
+    pthread_mutex_unlock(&cbar->mutex);
+
+    if (shared) {
+        munmap(shared, cbar_shared_size(cbar->count));
+        shm_unlink(cbar->shared_name);
+    }
+}
+
+int cbar_shared_open(struct cbar_shared_reader *reader, const char *name)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    if ((size_t) st.st_size < sizeof(struct cbar_shared)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    size_t size = st.st_size;
+    struct cbar_shared *shared = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED)
+        return -1;
+
+    /* The exporter sizes the object for its lines before anything else, and
+     * never changes either; anything else isn't ours, or isn't ready yet. */
+    int count = shared->count;
+    if (count < 0 || cbar_shared_size(count) != size) {
+        munmap(shared, size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    reader->shared = shared;
+    reader->size = size;
+    reader->count = count;
+    return 0;
+}
+
+void cbar_shared_close(struct cbar_shared_reader *reader)
+{
+    munmap((void *) reader->shared, reader->size);
+    reader->shared = NULL;
+}
+
+unsigned cbar_shared_begin(const struct cbar_shared_reader *reader)
+{
+    unsigned sequence;
+    while ((sequence = atomic_load_explicit(&reader->shared->sequence, memory_order_acquire)) & 1)
+        sched_yield();
+    return sequence;
+}
+
+bool cbar_shared_retry(const struct cbar_shared_reader *reader, unsigned sequence)
+{
+    /* Values are read with acquire loads, so this can't move ahead of them. */
+    return atomic_load_explicit(&reader->shared->sequence, memory_order_relaxed) != sequence;
+}
+
+int cbar_shared_value(const struct cbar_shared_reader *reader, int id)
+{
+    assert(id >= 0 && id < reader->count);
+    return atomic_load_explicit(&cbar_shared_values(reader->shared)[id], memory_order_acquire);
+}
+
+int cbar_shared_read(const struct cbar_shared_reader *reader, int *values, int max,
+                     unsigned long *time)
+{
+    int n = reader->count < max ? reader->count : max;
+    unsigned sequence;
+
+    do {
+        sequence = cbar_shared_begin(reader);
+        for (int id=0; id<n; id++)
+            values[id] = cbar_shared_value(reader, id);
+        if (time)
+            *time = atomic_load_explicit(&reader->shared->time, memory_order_acquire);
+    } while (cbar_shared_retry(reader, sequence));
+
+    return n;
+}
+
+void cbar_trace_start(struct cbar *cbar, struct cbar_trace *trace,
+                      struct cbar_trace_event *events, size_t size)
+{
+    assert(size && !(size & (size - 1)));
+
+    pthread_mutex_lock(&cbar->mutex);
+    trace->events = events;
+    trace->mask = size - 1;
+    atomic_store_explicit(&trace->head, 0, memory_order_relaxed);
+    atomic_store_explicit(&trace->tail, 0, memory_order_relaxed);
+    atomic_store_explicit(&trace->dropped, 0, memory_order_relaxed);
+    cbar->trace = trace;
+    cbar->tracing = true;
+    pthread_mutex_unlock(&cbar->mutex);
+}
+
+void cbar_trace_stop(struct cbar *cbar)
+{
+    pthread_mutex_lock(&cbar->mutex);
+    cbar->tracing = false;
+    pthread_mutex_unlock(&cbar->mutex);
+}
+
+size_t cbar_trace_read(struct cbar *cbar, struct cbar_trace_event *events, size_t max)
+{
+    struct cbar_trace *trace = cbar->trace;
+    unsigned long tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+    unsigned long head = atomic_load_explicit(&trace->head, memory_order_acquire);
+    size_t count = head - tail < max ? head - tail : max;
+
+    for (size_t i=0; i<count; i++)
+        events[i] = trace->events[(tail + i) & trace->mask];
+    /* Hand the slots back to the writer. */
+    atomic_store_explicit(&trace->tail, tail + count, memory_order_release);
+
+    return count;
+}
+
+unsigned long cbar_trace_dropped(struct cbar *cbar)
+{
+    return atomic_load_explicit(&cbar->trace->dropped, memory_order_relaxed);
+}
+
+int cbar_trace_write(FILE *stream, const struct cbar_trace_event *events, size_t n)
+{
+    for (size_t i=0; i<n; i++)
+        fprintf(stream, "%lu %d %d %d\n", events[i].time, events[i].id, events[i].previous, events[i].value);
+
+    return ferror(stream) ? -1 : 0;
+}
+
+int cbar_trace_scan(FILE *stream, struct cbar_trace_event *event)
+{
+    char line[128];
+
+    while (fgets(line, sizeof(line), stream)) {
+        size_t length = strlen(line);
+        bool whole = (length && line[length-1] == '\n') || feof(stream);
+        if (line[0] == '#') {
+            /* Comments can be any length: skip the rest of a long one. */
+            int c;
+            while (!whole && (c = getc(stream)) != EOF && c != '\n')
+                ;
+            continue;
+        }
+        /* Blank, maybe with a CRLF ending; a long one just takes a few reads. */
+        if (!line[strspn(line, " \t\r\n")])
+            continue;
+        if (!whole ||
+            sscanf(line, "%lu %d %d %d", &event->time, &event->id, &event->previous, &event->value) != 4) {
+            /* Even the last line, cut short by the end of the file. */
+            errno = EINVAL;
+            return -1;
+        }
+        return 1;
+    }
+
+    return ferror(stream) ? -1 : 0;
+}
+
+/**
+ * Feed a replayed transition into the graph.
+ */
+static int cbar_replay(struct cbar *cbar, const struct cbar_trace_event *event)
+{
+    if (event->id < 0 || event->id >= cbar->count) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    switch (cbar->configs[event->id].type) {
+        case CBAR_INPUT: {
+            cbar_input(cbar, event->id, event->value);
+        } break;
+        case CBAR_EXTERNAL: {
+            /* Sampled lines aren't polled, so mark the line. */
+            int rank = cbar->ranks[event->id];
+            atomic_store_explicit(&cbar->lines[rank].external.sample, event->value, memory_order_relaxed);
+            cbar_touch(cbar->touched, rank + cbar_partition(cbar, rank)->offset);
+        } break;
+        default:
+            break;
+    }
+
+    return 0;
+}
+
+/**
+ * Write out the transitions recorded since the last call.
+ */
+static int cbar_drain(struct cbar *cbar, FILE *output)
+{
+    struct cbar_trace_event events[64];
+    size_t count;
+
+    while ((count = cbar_trace_read(cbar, events, 64))) {
+        if (cbar_trace_write(output, events, count) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+static bool cbar_touched(struct cbar *cbar)
+{
+    for (int i=0; i<cbar->words; i++)
+        if (atomic_load_explicit(&cbar->touched[i], memory_order_relaxed))
+            return true;
+
+    return false;
+}
+
+int cbar_simulate(struct cbar *cbar, FILE *input, FILE *output, unsigned long until)
+{
+    if (output && !(cbar->trace && cbar->tracing)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* External lines keep their current values until told otherwise. */
+    for (int rank=0; rank<cbar->count; rank++)
+        if (cbar->ops[rank].type == CBAR_EXTERNAL)
+            atomic_store_explicit(&cbar->lines[rank].external.sample,
+                                  cbar_value(cbar, cbar->ops[rank].id), memory_order_relaxed);
+    cbar->simulating = true;
+
+    unsigned long dropped = output ? cbar_trace_dropped(cbar) : 0;
+    struct cbar_trace_event event;
+    int status = cbar_trace_scan(input, &event);
+    int result = 0;
+
+    while (status != -1 && cbar->time < until) {
+        unsigned long now = cbar->time;
+        unsigned long next = until;
+
+        /* Nothing can change before the next event or timer expiry, unless
+         * clearing pending lines left something to do. */
+        if (status == 1 && event.time < next)
+            next = event.time > now ? event.time : now + 1;
+        int deadline = cbar_next_deadline(cbar);
+        if (deadline != -1 && now + (deadline ? deadline : 1) < next)
+            next = now + (deadline ? deadline : 1);
+        if (cbar_touched(cbar))
+            next = now + 1;
+
+        for (; status == 1 && event.time <= next; status = cbar_trace_scan(input, &event)) {
+            if (cbar_replay(cbar, &event) == -1) {
+                status = -1;
+                break;
+            }
+        }
+        if (status == -1)
+            break;
+
+        cbar_recalculate(cbar, next - now);
+
+        int ids[64];
+        while (cbar_pending_drain(cbar, ids, 64) == 64)
+            ;
+
+        if (output && cbar_drain(cbar, output) == -1) {
+            result = -1;
+            break;
+        }
+    }
+
+    cbar->simulating = false;
+
+    if (status == -1)
+        return -1;
+    if (output && cbar_trace_dropped(cbar) != dropped) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    return result;
+}
+
+static int *cbar_fleet_row(const struct cbar_fleet *fleet, int id)
+{
+    return &fleet->values[(size_t) id * fleet->stride];
+}
+
+/**
+ * Fill in what a calculated line of one instance reads, for cbar_value().
+ */
+static void cbar_fleet_gather(struct cbar_fleet *fleet, struct cbar_fleet_worker *worker,
+                              const int *inputs, int instance)
+{
+    atomic_int *values = worker->view.values;
+
+    if (inputs) {
+        for (; *inputs != -1; inputs++)
+            atomic_store_explicit(&values[*inputs], cbar_fleet_row(fleet, *inputs)[instance],
+                                  memory_order_relaxed);
+    } else {
+        for (int id=0; id<fleet->count; id++)
+            atomic_store_explicit(&values[id], cbar_fleet_row(fleet, id)[instance],
+                                  memory_order_relaxed);
+    }
+}
+
+/**
+ * Evaluate every line of a worker's shard, one line at a time.
+ */
+static void cbar_fleet_pass(struct cbar_fleet *fleet, struct cbar_fleet_worker *worker, int delay)
+{
+    int first = worker->first, n = worker->end - worker->first;
+    int up[CBAR_BATCH], down[CBAR_BATCH];
+
+    for (int rank=0; rank<fleet->count; rank++) {
+        const struct cbar_op *op = &fleet->cbar->ops[rank];
+        const struct cbar_line_config *config = &fleet->cbar->configs[op->id];
+        int *value = cbar_fleet_row(fleet, op->id) + first;
+        const int *input = op->input >= 0 ? cbar_fleet_row(fleet, op->input) + first : NULL;
+        int *a = &fleet->state[(size_t) (2*rank) * fleet->stride + first];
+        int *b = &fleet->state[(size_t) (2*rank+1) * fleet->stride + first];
+
+        switch (op->type) {
+            case CBAR_INPUT:
+            case CBAR_EXTERNAL: {
+                memcpy(value, a, n * sizeof(int));
+            } break;
+            case CBAR_THRESHOLD:
+            case CBAR_DEBOUNCE: {
+                /* Same kernels as a batch of lines, only across instances. */
+                for (int i=0; i<CBAR_BATCH; i++) {
+                    up[i] = op->up;
+                    down[i] = op->down;
+                }
+                for (int i=0; i<n; i+=CBAR_BATCH) {
+                    int m = n - i < CBAR_BATCH ? n - i : CBAR_BATCH;
+                    if (op->type == CBAR_THRESHOLD)
+                        cbar_threshold_kernel(m, &input[i], &value[i], up, down, &value[i]);
+                    else
+                        cbar_debounce_kernel(m, delay, &input[i], &value[i], &a[i], &b[i], up, down);
+                }
+            } break;
+            case CBAR_REQUEST: {
+            } break;
+            case CBAR_CALCULATED: {
+                for (int i=0; i<n; i++) {
+                    cbar_fleet_gather(fleet, worker, config->calculated.inputs, first + i);
+                    value[i] = config->calculated.get(&worker->view);
+                }
+            } break;
+            case CBAR_MONITOR: {
+                for (int i=0; i<n; i++) {
+                    if (input[i] != a[i]) {
+                        value[i] = 1;
+                        a[i] = input[i];
+                    }
+                }
+            } break;
+            case CBAR_PERIODIC: {
+                for (int i=0; i<n; i++) {
+                    a[i] += delay;
+                    if (a[i] >= op->up) {
+                        a[i] = 0;
+                        value[i] = 1;
+                    }
+                }
+            } break;
+            case CBAR_LOGIC: {
+                const int *operands = config->logic.inputs;
+                if (op->up == CBAR_SELECT) {
+                    const int *select = cbar_fleet_row(fleet, operands[0]) + first;
+                    const int *high = cbar_fleet_row(fleet, operands[1]) + first;
+                    const int *low = cbar_fleet_row(fleet, operands[2]) + first;
+                    for (int i=0; i<n; i++)
+                        value[i] = select[i] ? high[i] : low[i];
+                    break;
+                }
+                int all = op->up == CBAR_AND;
+                for (int i=0; i<n; i++)
+                    value[i] = all;
+                for (; *operands != -1; operands++) {
+                    const int *row = cbar_fleet_row(fleet, *operands) + first;
+                    if (all) {
+                        for (int i=0; i<n; i++)
+                            value[i] &= row[i] != 0;
+                    } else {
+                        for (int i=0; i<n; i++)
+                            value[i] |= row[i] != 0;
+                    }
+                }
+                if (op->up == CBAR_NOT)
+                    for (int i=0; i<n; i++)
+                        value[i] = !value[i];
+            } break;
+            case CBAR_FILTER: {
+                /* Rejected by cbar_fleet_init(). */
+            } break;
+        }
+    }
+}
+
+static void *cbar_fleet_worker(void *arg)
+{
+    struct cbar_fleet_worker *self = arg;
+    struct cbar_fleet *fleet = self->fleet;
+    unsigned generation = 0;
+
+    pthread_mutex_lock(&fleet->mutex);
+    for (;;) {
+        while (fleet->generation == generation && !fleet->stopping)
+            pthread_cond_wait(&fleet->wake, &fleet->mutex);
+        if (fleet->stopping)
+            break;
+        generation = fleet->generation;
+
+        pthread_mutex_unlock(&fleet->mutex);
+        cbar_fleet_pass(fleet, self, fleet->delay);
+        pthread_mutex_lock(&fleet->mutex);
+
+        if (--fleet->remaining == 0)
+            pthread_cond_signal(&fleet->done);
+    }
+    pthread_mutex_unlock(&fleet->mutex);
+
+    return NULL;
+}
+
+int cbar_fleet_init(struct cbar_fleet *fleet, const struct cbar *cbar, int instances, size_t size,
+                    int *values, int *state, atomic_int *scratch,
+                    struct cbar_fleet_worker *workers, pthread_t *threads, int n_threads)
+{
+    for (int rank=0; rank<cbar->count; rank++) {
+        if (cbar->ops[rank].type == CBAR_FILTER) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    fleet->cbar = cbar;
+    fleet->count = cbar->count;
+    fleet->instances = instances;
+    fleet->stride = CBAR_FLEET_STRIDE(instances);
+    fleet->values = values;
+    fleet->state = state;
+    fleet->workers = workers;
+    fleet->threads = threads;
+    fleet->n_threads = 1;
+    fleet->generation = 0;
+    fleet->remaining = 0;
+    fleet->delay = 0;
+    fleet->stopping = false;
+    pthread_mutex_init(&fleet->mutex, NULL);
+    pthread_cond_init(&fleet->wake, NULL);
+    pthread_cond_init(&fleet->done, NULL);
+
+    assert(instances > 0);
+    assert((size_t) fleet->count * fleet->stride <= size);
+
+    for (int rank=0; rank<fleet->count; rank++) {
+        const struct cbar_op *op = &cbar->ops[rank];
+        int *a = &state[(size_t) (2*rank) * fleet->stride];
+        int *b = &state[(size_t) (2*rank+1) * fleet->stride];
+
+        for (int i=0; i<fleet->stride; i++) {
+            /* Same initial state as cbar_init(); see there. */
+            cbar_fleet_row(fleet, op->id)[i] = 0;
+            a[i] = (op->type == CBAR_DEBOUNCE || op->type == CBAR_MONITOR) ? INT_MIN : 0;
+            b[i] = 0;
+        }
+    }
+
+    /* Shards are whole cache lines, so threads never write the same one. */
+    int blocks = fleet->stride / 16;
+    for (int w=0; w<n_threads; w++) {
+        struct cbar_fleet_worker *worker = &workers[w];
+        worker->fleet = fleet;
+        worker->first = 16 * (int) ((long) blocks * w / n_threads);
+        worker->end = 16 * (int) ((long) blocks * (w+1) / n_threads);
+        if (worker->end > instances)
+            worker->end = instances;
+        if (worker->first > worker->end)
+            worker->first = worker->end;
+        worker->view = (struct cbar) {
+            .configs = cbar->configs,
+            .count = cbar->count,
+            .values = &scratch[(size_t) w * cbar->count],
+        };
+        for (int id=0; id<cbar->count; id++)
+            atomic_init(&worker->view.values[id], 0);
+    }
+
+    for (; fleet->n_threads<n_threads; fleet->n_threads++) {
+        int error = pthread_create(&threads[fleet->n_threads], NULL, cbar_fleet_worker,
+                                   &workers[fleet->n_threads]);
+        if (error) {
+            cbar_fleet_stop(fleet);
+            errno = error;
+            return -1;
+        }
+    }
+
+    cbar_fleet_recalculate(fleet, 0);
+
+    return 0;
+}
+
+void cbar_fleet_stop(struct cbar_fleet *fleet)
+{
+    pthread_mutex_lock(&fleet->mutex);
+    fleet->stopping = true;
+    pthread_cond_broadcast(&fleet->wake);
+    pthread_mutex_unlock(&fleet->mutex);
+
+    for (int w=1; w<fleet->n_threads; w++)
+        pthread_join(fleet->threads[w], NULL);
+    fleet->n_threads = 1;
+}
+
+void cbar_fleet_recalculate(struct cbar_fleet *fleet, int delay)
+{
+    if (fleet->n_threads > 1) {
+        pthread_mutex_lock(&fleet->mutex);
+        fleet->delay = delay;
+        fleet->remaining = fleet->n_threads - 1;
+        fleet->generation++;
+        pthread_cond_broadcast(&fleet->wake);
+        pthread_mutex_unlock(&fleet->mutex);
+    }
+
+    cbar_fleet_pass(fleet, &fleet->workers[0], delay);
+
+    if (fleet->n_threads > 1) {
+        pthread_mutex_lock(&fleet->mutex);
+        while (fleet->remaining)
+            pthread_cond_wait(&fleet->done, &fleet->mutex);
+        pthread_mutex_unlock(&fleet->mutex);
+    }
+}
+
+void cbar_fleet_input(struct cbar_fleet *fleet, int instance, int id, int value)
+{
+    int rank = fleet->cbar->ranks[id];
+
+    assert(fleet->cbar->configs[id].type == CBAR_INPUT ||
+           fleet->cbar->configs[id].type == CBAR_EXTERNAL);
+    assert(instance >= 0 && instance < fleet->instances);
+    fleet->state[(size_t) (2*rank) * fleet->stride + instance] = value;
+}
+
+void cbar_fleet_post(struct cbar_fleet *fleet, int instance, int id)
+{
+    assert(fleet->cbar->configs[id].type == CBAR_REQUEST);
+    assert(instance >= 0 && instance < fleet->instances);
+    cbar_fleet_row(fleet, id)[instance] = 1;
+}
+
+bool cbar_fleet_pending(struct cbar_fleet *fleet, int instance, int id)
+{
+    enum cbar_line_type type = fleet->cbar->configs[id].type;
+    int *value = &cbar_fleet_row(fleet, id)[instance];
+
+    assert(type == CBAR_REQUEST || type == CBAR_MONITOR || type == CBAR_PERIODIC);
+    assert(instance >= 0 && instance < fleet->instances);
+    bool pending = *value;
+    *value = 0;
+    return pending;
+}
+
+int cbar_fleet_value(const struct cbar_fleet *fleet, int instance, int id)
+{
+    assert(instance >= 0 && instance < fleet->instances);
+    return cbar_fleet_row(fleet, id)[instance];
+}
+
 /* vim: set ts=4 sw=4 et: */
@@ -11,9 +11,25 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <limits.h>
 
+#ifdef __cplusplus
+#include <atomic>
+typedef std::atomic<int> cbar_atomic_int;
+typedef std::atomic<unsigned> cbar_atomic_uint;
+typedef std::atomic<unsigned long> cbar_atomic_ulong;
+typedef std::atomic<unsigned long long> cbar_atomic_ullong;
+extern "C" {
+#else
+#include <stdatomic.h>
+typedef atomic_int cbar_atomic_int;
+typedef atomic_uint cbar_atomic_uint;
+typedef atomic_ulong cbar_atomic_ulong;
+typedef atomic_ullong cbar_atomic_ullong;
+#endif
 
 enum cbar_line_type {
     CBAR_INPUT = 1,
@@ -24,6 +40,30 @@ enum cbar_line_type {
     CBAR_CALCULATED,
     CBAR_MONITOR,
     CBAR_PERIODIC,
+    CBAR_LOGIC,
+    CBAR_FILTER,
+};
+
+/**
+ * Operations of logic lines. Inputs count as high when nonzero; the result
+ * is 0 or 1, except for CBAR_SELECT.
+ */
+enum cbar_logic_op {
+    CBAR_AND = 1,                   /**< High if all inputs are high. */
+    CBAR_OR,                        /**< High if any input is high. */
+    CBAR_NOT,                       /**< High if no input is high. */
+    CBAR_SELECT,                    /**< Value of the second input if the first is high, else of the third. */
+};
+
+/**
+ * Kinds of filter lines. A filter takes one sample of its input on every
+ * recalculation, so the window is counted in ticks, not miliseconds; each
+ * jump of cbar_simulate() takes one sample as well.
+ */
+enum cbar_filter_kind {
+    CBAR_AVERAGE = 1,               /**< Mean of the last window samples, rounded; their sum must fit in an int. */
+    CBAR_EXPONENTIAL,               /**< Each sample moves the output 1/2^window of the way to it; window is below 16, and samples times 2^window must fit in an int. */
+    CBAR_MEDIAN,                    /**< Median of the last window samples; meant for small windows. */
 };
 
 struct cbar;
@@ -39,6 +79,7 @@ struct cbar_line_config {
             int (*get)(intptr_t);   /**< Callback for retrieving input state. */
             intptr_t priv;          /**< Callback argument. */
             bool invert;            /**< True if the input is active-low. */
+            int period;             /**< Sampling period in miliseconds, or 0 to call get() on every recalculation. */
         } external;
         struct {
             int input;              /**< Input line ID. */
@@ -54,6 +95,7 @@ struct cbar_line_config {
         } request;
         struct {
             int (*get)(struct cbar *cbar);  /**< Callback for calculating line state. */
+            const int *inputs;      /**< Lines the callback reads, terminated with -1, or NULL if unknown. */
         } calculated;
         struct {
             int input;              /**< Input line ID. */
@@ -61,76 +103,806 @@ struct cbar_line_config {
         struct {
             int period;             /**< Timer period in miliseconds. */
         } periodic;
+        struct {
+            enum cbar_logic_op op;  /**< Operation. */
+            const int *inputs;      /**< Input line IDs, terminated with -1. */
+        } logic;
+        struct {
+            int input;              /**< Input line ID. */
+            enum cbar_filter_kind kind;  /**< Filter kind. */
+            int window;             /**< Window in samples, or the smoothing shift of CBAR_EXPONENTIAL. */
+        } filter;
     };
 };
 
+/**
+ * List of lines read by a calculated or logic line, for use in a config
+ * block at file scope (C only; elsewhere, point to a -1 terminated array
+ * instead):
+ *
+ *     { "led_color", CBAR_CALCULATED, .calculated = { calculate_led_color,
+ *           CBAR_INPUTS(LINE_POWER_AVAILABLE, LINE_ENGINE_RUNNING, IN_GPS_FIX) } },
+ *     { "ready",     CBAR_LOGIC, .logic = { CBAR_AND,
+ *           CBAR_INPUTS(LINE_POWER_AVAILABLE, LINE_ENGINE_RUNNING) } },
+ *
+ * A calculated line with declared inputs is scheduled like any other line,
+ * and its callback is only called when one of the inputs has changed since
+ * the last call. See cbar_record_inputs() for finding out what to declare.
+ *
+ * Logic lines need no callback at all: they're evaluated right in the
+ * recalculation loop, one line at a time. A logic line with one input is
+ * linked to it and only evaluated when it changes, but one with more is
+ * polled: every recalculation evaluates it and loads all of its inputs,
+ * changed or not, as each line can only be linked to one input.
+ */
+#define CBAR_INPUTS(...) ((const int []) { __VA_ARGS__, -1 })
+
+/**
+ * @internal
+ *
+ * Compiled form of a line config, stored in evaluation order.
+ */
+struct cbar_op {
+    int id;                         /**< Line ID. */
+    enum cbar_line_type type;       /**< Line type. */
+    int level;                      /**< Dependency level; lines only read lower levels. */
+    int input;                      /**< Input line ID, or -1. */
+    int up;                         /**< Threshold/timeout for low->high transition, timer period, logic operation or filter kind. */
+    int down;                       /**< Threshold/timeout for high->low transition, or filter window. */
+    int dependents;                 /**< Rank of the first line reading this one, or -1. */
+    int sibling;                    /**< Rank of the next line reading the same input, or -1. */
+};
+
 /**
  * @internal
+ *
+ * Per-type line state, stored in evaluation order.
  */
 struct cbar_line {
-    int value;
+    cbar_atomic_uint version;       /**< Bumped whenever the value changes. */
     union {
         struct {
-            int input_value;
+            cbar_atomic_int input_value;
         } input;
+        struct {
+            cbar_atomic_int sample; /**< Latest sample of a sampled line; also used while simulating. */
+            int elapsed;            /**< Time since the last sample, in miliseconds. */
+        } external;
         struct {
             int value;
             int timer;
         } debounce;
+        struct {
+            unsigned seen;          /**< Sum of the input versions at the last call. */
+        } calculated;
         struct {
             int previous;
         } monitor;
         struct {
             int elapsed;
         } periodic;
+        struct {
+            int offset;             /**< Position of the filter state in the filter storage. */
+        } filter;
+        struct {
+            int level;              /**< Dependency level, by line ID. */
+            int order;              /**< Line ID, by position. */
+        } schedule;                 /**< Scratch space used while sorting. */
     };
 };
 
+/**
+ * Number of latency histogram buckets. Bucket 0 counts samples under 128 ns;
+ * bucket N covers [64 << N, 128 << N) ns, and the last one everything above.
+ */
+#define CBAR_PROFILE_BUCKETS 20
+
+/**
+ * Timing statistics for one kind of event.
+ */
+struct cbar_profile_stat {
+    unsigned long count;            /**< Number of samples. */
+    uint64_t total;                 /**< Sum of all samples, in nanoseconds. */
+    uint64_t max;                   /**< Longest sample, in nanoseconds. */
+    unsigned long histogram[CBAR_PROFILE_BUCKETS];
+};
+
+/**
+ * Profiling results.
+ */
+struct cbar_profile {
+    struct cbar_profile_stat tick;      /**< Whole cbar_recalculate() calls. */
+    struct cbar_profile_stat locked;    /**< Time spent holding the mutex. */
+    struct cbar_profile_stat *lines;    /**< Line evaluations, by ID. */
+};
+
+/**
+ * A line changing its value during recalculation.
+ */
+struct cbar_trace_event {
+    int id;                         /**< Line ID. */
+    int previous;                   /**< Value before the change. */
+    int value;                      /**< Value after the change. */
+    unsigned long time;             /**< Sum of all delays up to the change, in miliseconds. */
+};
+
+/**
+ * Ring buffer of line transitions: written by recalculation, drained by one
+ * reader thread.
+ */
+struct cbar_trace {
+    struct cbar_trace_event *events;
+    unsigned long mask;             /**< Number of events minus one. */
+    cbar_atomic_ulong head;         /**< Events written so far. */
+    cbar_atomic_ulong tail;         /**< Events read so far. */
+    cbar_atomic_ulong dropped;      /**< Events lost because the buffer was full. */
+};
+
+/**
+ * @internal
+ */
+struct cbar_queue_cell {
+    cbar_atomic_ulong sequence;     /**< Position the cell is ready to be written or read at. */
+    int id;
+};
+
+/**
+ * Bounded lock-free queue of raised pending lines, filled by recalculation
+ * and cbar_post(), emptied by cbar_pending_drain().
+ */
+struct cbar_queue {
+    struct cbar_queue_cell *cells;
+    unsigned long size;
+    cbar_atomic_ulong head;         /**< Lines queued so far. */
+    cbar_atomic_ulong tail;         /**< Lines taken so far. */
+    cbar_atomic_int overflowed;     /**< Lines were raised while the queue was full. */
+};
+
+/**
+ * Line values exported to shared memory, followed by the values themselves,
+ * by ID. Written under a seqlock; see cbar_export_start().
+ */
+struct cbar_shared {
+    cbar_atomic_uint sequence;      /**< Bumped before and after every update; odd meanwhile. */
+    int count;                      /**< Number of lines. */
+    cbar_atomic_ulong time;         /**< Sum of all delays as of the values, in miliseconds. */
+};
+
+/**
+ * A reader's mapping of exported line values. The size and line count are
+ * checked once, when opening, and never taken from shared memory again.
+ */
+struct cbar_shared_reader {
+    const struct cbar_shared *shared;
+    size_t size;                    /**< Bytes mapped. */
+    int count;                      /**< Number of lines. */
+};
+
+/**
+ * One end of a stream of binary snapshots: the line values as of the last
+ * frame encoded or decoded.
+ */
+struct cbar_snapshot {
+    int *values;                    /**< Line values, by ID. */
+    int count;                      /**< Number of lines. */
+    unsigned long time;             /**< Time of the last frame, in miliseconds. */
+    bool synced;                    /**< A keyframe has gone through. */
+};
+
+/**
+ * Perfect hash of line names to IDs. Names are hashed into buckets; each
+ * bucket has a seed that sends its names to distinct slots, so a lookup
+ * costs one hash, one probe and one string compare.
+ */
+struct cbar_index {
+    const int *slots;               /**< Line IDs, by slot, or -1; NULL if there's no index. */
+    const unsigned *seeds;          /**< Slot seeds, by bucket. */
+    int n_slots;
+    int n_buckets;
+};
+
+/**
+ * @internal
+ *
+ * Header of a config image; see cbar_image_write(). Sections are found by
+ * their offsets from the start of the image, so it works wherever it's
+ * loaded.
+ */
+struct cbar_image {
+    uint32_t magic;                 /**< CBAR_IMAGE_MAGIC, in native byte order. */
+    uint32_t layout;                /**< Size of struct cbar_op, to catch ABI mismatches. */
+    uint64_t fingerprint;           /**< Hash of the configs the image was made from. */
+    uint64_t checksum;              /**< Hash of everything from the compiled configs on. */
+    int32_t count;                  /**< Number of lines. */
+    int32_t n_partitions;
+    int32_t words;                  /**< Number of bitmap words in use. */
+    int32_t n_slots;                /**< Name index slots, or 0 if there's no index. */
+    int32_t n_buckets;
+    uint32_t ops;                   /**< Offset of the compiled configs. */
+    uint32_t ranks;                 /**< Offset of the ranks. */
+    uint32_t partitions;            /**< Offset of the partitions. */
+    uint32_t slots;                 /**< Offset of the name index slots. */
+    uint32_t seeds;                 /**< Offset of the name index seeds. */
+    uint32_t size;                  /**< Size of the whole image. */
+};
+
+/**
+ * @internal
+ */
+struct cbar_image_partition {
+    int32_t start;
+    int32_t end;
+    int32_t word;
+    int32_t words;
+    int32_t offset;
+    int32_t serial;
+};
+
+#define CBAR_IMAGE_MAGIC 0x72616263     /* "cbar" on little endian machines. */
+
+/**
+ * Maximum number of partitions a cbar instance is split into. Lines that
+ * don't read each other, directly or indirectly, end up in different
+ * partitions when possible; see cbar_pool_start().
+ */
+#ifndef CBAR_PARTITIONS
+#define CBAR_PARTITIONS 8
+#endif
+
+/**
+ * @internal
+ *
+ * A group of lines that can be evaluated independently of the others.
+ * Each partition has its own slice of the bitmaps, starting on a word
+ * boundary, so partitions can be evaluated in parallel.
+ */
+struct cbar_partition {
+    pthread_mutex_t mutex;          /**< Held while the partition is evaluated. */
+    int start;                      /**< First rank. */
+    int end;                        /**< Last rank plus one. */
+    int word;                       /**< First bitmap word. */
+    int words;                      /**< Number of bitmap words. */
+    int offset;                     /**< Bitmap bit minus rank. */
+    bool serial;                    /**< Holds calculated lines with unknown inputs; evaluated after the rest. */
+    bool raised;                    /**< A pending line was raised during this pass. */
+};
+
+/**
+ * @internal
+ *
+ * Per-thread state of a worker pool. A thread evaluating a partition hands
+ * a run of callbacks at the same level to the pool as a job: the items not
+ * yet taken are kept in the range word, from which other threads steal.
+ */
+struct cbar_worker {
+    struct cbar_pool *pool;
+    cbar_atomic_ullong range;       /**< Items left: tag, job owner, end and start. */
+    const int *ranks;               /**< Lines of the job this thread owns. */
+    int *values;                    /**< Callback results, by job item. */
+    cbar_atomic_int remaining;      /**< Items of the job not yet done. */
+};
+
+/**
+ * Worker threads evaluating partitions and callbacks in parallel.
+ */
+struct cbar_pool {
+    struct cbar *cbar;
+    pthread_t *threads;
+    int count;                      /**< Number of threads. */
+    struct cbar_worker *workers;    /**< One per thread, plus one for the caller. */
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;            /**< Signalled whenever events is bumped. */
+    unsigned events;                /**< Bumped when work is posted or finished. */
+    bool stopping;
+    int delay;                      /**< Delay of the current tick. */
+    cbar_atomic_int next;           /**< Next partition to claim. */
+    cbar_atomic_int pending;        /**< Partitions not yet done. */
+};
+
+/**
+ * Background thread sampling external lines.
+ */
+struct cbar_sampler {
+    struct cbar *cbar;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;            /**< Signalled when the sampler is asked to stop. */
+    bool stopping;
+};
+
 /**
  * @internal
  */
 struct cbar {
     pthread_mutex_t mutex;
-    struct cbar_line *lines;
     const struct cbar_line_config *configs;
+    int count;
+    const struct cbar_op *ops;      /**< Compiled configs, by rank. */
+    struct cbar_line *lines;        /**< Line state, by rank. */
+    cbar_atomic_int *values;        /**< Line values, by ID. */
+    const int *ranks;               /**< Positions in the evaluation order, by ID. */
+    unsigned long *dirty;           /**< Lines to evaluate on the next pass, by bit. */
+    unsigned long *active;          /**< Lines evaluated on every pass (sources, timers), by bit. */
+    cbar_atomic_ulong *touched;     /**< Lines changed by other threads, by bit. */
+    cbar_atomic_ulong *pending;     /**< Pending lines that may have been raised, by ID. */
+    struct cbar_queue *queue;       /**< Raised pending lines in order, or NULL. */
+    int words;                      /**< Number of bitmap words in use. */
+    struct cbar_partition *partitions;  /**< Partitions, in evaluation order. */
+    int n_partitions;
+    struct cbar_pool *pool;         /**< Worker pool, or NULL. */
+    pthread_mutex_t sample_mutex;   /**< Held while sampling external lines. */
+    struct cbar_sampler *sampler;   /**< Sampler thread, or NULL. */
+    int sample_elapsed;             /**< Time since external lines were last sampled. */
+    int sample_next;                /**< Time from then until the next sample is due, or -1. */
+    pthread_mutex_t wait_mutex;
+    pthread_cond_t wait_cond;
+    cbar_atomic_uint events;        /**< Bumped whenever a pending line is raised. */
+    cbar_atomic_int waiters;        /**< Threads about to sleep in cbar_wait(). */
+    struct cbar_profile *profile;   /**< Profiling results, or NULL. */
+    cbar_atomic_int profiling;      /**< Profiling is switched on. */
+    struct cbar_trace *trace;       /**< Transition trace, or NULL. */
+    struct cbar_index index;        /**< Name index. */
+    int *filters;                   /**< Filter state and windows, or NULL to hold filter lines at zero. */
+    struct cbar_shared *shared;     /**< Exported values, or NULL. */
+    const char *shared_name;        /**< Name of the shared memory object. */
+    bool tracing;                   /**< Tracing is switched on. */
+    bool simulating;                /**< External lines read samples instead of calling get(). */
+    unsigned long time;             /**< Sum of all delays so far, in miliseconds. */
+};
+
+/**
+ * @internal
+ *
+ * A thread evaluating its share of a fleet.
+ */
+struct cbar_fleet_worker {
+    struct cbar_fleet *fleet;
+    int first;                      /**< First instance of the shard. */
+    int end;                        /**< One past the last instance of the shard. */
+    struct cbar view;               /**< What calculated lines are passed. */
+};
+
+/**
+ * @internal
+ *
+ * Many instances of one set of lines, evaluated together.
+ */
+struct cbar_fleet {
+    const struct cbar *cbar;        /**< Instance the schedule is taken from. */
+    int count;                      /**< Number of lines. */
+    int instances;                  /**< Number of instances. */
+    int stride;                     /**< Distance between rows, in instances. */
+    int *values;                    /**< Line values, one row per line ID. */
+    int *state;                     /**< Line state, two rows per rank. */
+    struct cbar_fleet_worker *workers;  /**< One per thread, the caller's first. */
+    pthread_t *threads;             /**< By worker; the caller's is unused. */
+    int n_threads;                  /**< Number of workers, the caller included. */
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;            /**< Signalled when generation is bumped. */
+    pthread_cond_t done;            /**< Signalled when remaining drops to zero. */
+    unsigned generation;            /**< Bumped for every recalculation. */
+    int remaining;                  /**< Workers still evaluating. */
+    int delay;                      /**< Delay of the current recalculation. */
+    bool stopping;
 };
 
+/**
+ * @internal
+ */
+#define CBAR_BITS (sizeof(unsigned long) * CHAR_BIT)
+#define CBAR_BITMAP_WORDS(N) (((N) + CBAR_BITS - 1) / CBAR_BITS)
+#define CBAR_PARTITION_WORDS(N) (CBAR_BITMAP_WORDS(N) + CBAR_PARTITIONS - 1)
+#define CBAR_COUNT(CONFIGS) (sizeof(CONFIGS)/sizeof(CONFIGS[0])-1)
+
 /**
  * Declare a cbar instance. Allocates memory for state storage as well.
+ *
+ * Line values are kept in one dense array, apart from the rest of the line
+ * state; configs are compiled into a compact table sorted by partition,
+ * dependency level and line type, so a recalculation walks memory front to
+ * back.
  */
 #define CBAR_DECLARE(VAR, CONFIGS) \
     struct cbar VAR; \
-    struct cbar_line VAR ## _lines[sizeof(CONFIGS)/sizeof(CONFIGS[0])-1];
+    struct cbar_op VAR ## _ops[CBAR_COUNT(CONFIGS)]; \
+    struct cbar_line VAR ## _lines[CBAR_COUNT(CONFIGS)]; \
+    cbar_atomic_int VAR ## _values[CBAR_COUNT(CONFIGS)]; \
+    int VAR ## _ranks[CBAR_COUNT(CONFIGS)]; \
+    unsigned long VAR ## _dirty[CBAR_PARTITION_WORDS(CBAR_COUNT(CONFIGS))]; \
+    unsigned long VAR ## _active[CBAR_PARTITION_WORDS(CBAR_COUNT(CONFIGS))]; \
+    cbar_atomic_ulong VAR ## _touched[CBAR_PARTITION_WORDS(CBAR_COUNT(CONFIGS))]; \
+    cbar_atomic_ulong VAR ## _raised[CBAR_BITMAP_WORDS(CBAR_COUNT(CONFIGS))]; \
+    struct cbar_partition VAR ## _partitions[CBAR_PARTITIONS];
+
+/**
+ * Bytes of state storage declared by CBAR_DECLARE for N lines, not counting
+ * the configs themselves.
+ */
+#define CBAR_STORAGE_SIZE(N) \
+    (sizeof(struct cbar) + \
+     (N) * (sizeof(struct cbar_op) + sizeof(struct cbar_line) + sizeof(cbar_atomic_int) + sizeof(int)) + \
+     CBAR_PARTITION_WORDS(N) * (2 * sizeof(unsigned long) + sizeof(cbar_atomic_ulong)) + \
+     CBAR_BITMAP_WORDS(N) * sizeof(cbar_atomic_ulong) + \
+     CBAR_PARTITIONS * sizeof(struct cbar_partition))
+
+/**
+ * Declare profiling storage for a cbar instance.
+ *
+ * Profiling times every tick and every line evaluation, which costs two
+ * clock reads per line. Threshold and debounce lines evaluated together
+ * share the batch time evenly. Build with CBAR_NO_PROFILE to compile it
+ * out altogether.
+ */
+#define CBAR_PROFILE_DECLARE(VAR, CONFIGS) \
+    struct cbar_profile VAR ## _profile; \
+    struct cbar_profile_stat VAR ## _profile_lines[CBAR_COUNT(CONFIGS)];
+
+/**
+ * Clear the profiling results and start profiling.
+ * @param VAR Variable name (NOTE: not a pointer).
+ */
+#define CBAR_PROFILE_START(VAR) \
+    cbar_profile_start(&VAR, &VAR ## _profile, VAR ## _profile_lines)
+
+/**
+ * Declare a transition trace for a cbar instance.
+ *
+ * Recording a transition costs a few stores and never blocks; when the
+ * reader falls behind, new transitions are dropped and counted.
+ *
+ * @param VAR Variable name (NOTE: not a pointer).
+ * @param SIZE Number of events to hold; must be a power of two.
+ */
+#define CBAR_TRACE_DECLARE(VAR, SIZE) \
+    struct cbar_trace VAR ## _trace; \
+    struct cbar_trace_event VAR ## _trace_events[SIZE];
+
+/**
+ * Clear the trace and start recording transitions.
+ * @param VAR Variable name (NOTE: not a pointer).
+ */
+#define CBAR_TRACE_START(VAR) \
+    cbar_trace_start(&VAR, &VAR ## _trace, VAR ## _trace_events, \
+                     sizeof(VAR ## _trace_events) / sizeof(VAR ## _trace_events[0]))
+
+/**
+ * @internal
+ */
+#define CBAR_INDEX_SLOTS(N) ((N) + (N)/4 + 1)
+#define CBAR_INDEX_BUCKETS(N) ((N)/4 + 1)
+
+/**
+ * Declare a name index for a cbar instance.
+ *
+ * Takes about 1.5 ints per line, plus as much again as scratch space while
+ * the index is built.
+ */
+#define CBAR_INDEX_DECLARE(VAR, CONFIGS) \
+    int VAR ## _index_slots[CBAR_INDEX_SLOTS(CBAR_COUNT(CONFIGS))]; \
+    unsigned VAR ## _index_seeds[CBAR_INDEX_BUCKETS(CBAR_COUNT(CONFIGS))]; \
+    int VAR ## _index_scratch[CBAR_COUNT(CONFIGS) + CBAR_INDEX_BUCKETS(CBAR_COUNT(CONFIGS))];
+
+/**
+ * Build the name index, so lines can be looked up with cbar_lookup().
+ * Lines without a name are left out.
+ * @param VAR Variable name (NOTE: not a pointer).
+ * @returns 0 on success, -1 on error: EEXIST if two lines share a name,
+ *          ENOSPC if no perfect hash was found.
+ */
+#define CBAR_INDEX_BUILD(VAR) \
+    cbar_index_build(&VAR, VAR ## _index_slots, VAR ## _index_seeds, VAR ## _index_scratch)
+
+/**
+ * Filter storage taken by a filter line with a given window, in ints: a
+ * small header, and room for CBAR_AVERAGE and CBAR_MEDIAN samples.
+ */
+#define CBAR_FILTER_SIZE(WINDOW) (3 + 2*(WINDOW))
+
+/**
+ * Declare storage for the filter lines of a cbar instance.
+ * @param SIZE Room in ints; the sum of CBAR_FILTER_SIZE() over all filter
+ *             lines is always enough.
+ */
+#define CBAR_FILTER_DECLARE(VAR, SIZE) \
+    int VAR ## _filters[SIZE];
+
+/**
+ * Attach filter storage and start filtering. Until then, and for good if
+ * this fails, filter lines hold their initial value of zero rather than
+ * pass their input through unfiltered. Filters start out empty: averages
+ * and medians cover the samples taken so far, and exponential filters
+ * start at the first sample.
+ * @param VAR Variable name (NOTE: not a pointer).
+ * @returns 0 on success, -1 on error: ENOSPC if the windows don't fit.
+ */
+#define CBAR_FILTER_START(VAR) \
+    cbar_filter_start(&VAR, VAR ## _filters, sizeof(VAR ## _filters) / sizeof(VAR ## _filters[0]))
+
+/**
+ * Declare a snapshot encoder or decoder.
+ * @param VAR Variable name.
+ * @param COUNT Number of lines, e.g. CBAR_COUNT(configs).
+ */
+#define CBAR_SNAPSHOT_DECLARE(VAR, COUNT) \
+    struct cbar_snapshot VAR; \
+    int VAR ## _values[COUNT];
+
+/**
+ * Initialize a snapshot encoder or decoder. The first frame is a keyframe.
+ * @param VAR Variable name (NOTE: not a pointer).
+ */
+#define CBAR_SNAPSHOT_INIT(VAR) \
+    cbar_snapshot_init(&VAR, VAR ## _values, sizeof(VAR ## _values) / sizeof(VAR ## _values[0]))
+
+/**
+ * Declare an event queue for a cbar instance.
+ *
+ * Without a queue, cbar_pending_drain() finds raised lines by scanning a
+ * bitmap of all lines, a word at a time. With one, they're handed over in
+ * the order they were raised, at a cost proportional to their number. When
+ * the queue fills up, the bitmap takes over until it's drained.
+ *
+ * @param VAR Variable name (NOTE: not a pointer).
+ * @param SIZE Number of lines to hold.
+ */
+#define CBAR_QUEUE_DECLARE(VAR, SIZE) \
+    struct cbar_queue VAR ## _queue; \
+    struct cbar_queue_cell VAR ## _queue_cells[SIZE];
+
+/**
+ * Start queueing raised lines. Must be called before other threads use the
+ * instance.
+ * @param VAR Variable name (NOTE: not a pointer).
+ */
+#define CBAR_QUEUE_START(VAR) \
+    cbar_queue_start(&VAR, &VAR ## _queue, VAR ## _queue_cells, \
+                     sizeof(VAR ## _queue_cells) / sizeof(VAR ## _queue_cells[0]))
+
+/**
+ * Declare a worker pool for a cbar instance.
+ *
+ * With a pool running, cbar_recalculate() evaluates partitions in parallel:
+ * the calling thread and the workers each take whole partitions, under the
+ * partition's own lock, so a slow external line only holds up the lines
+ * that depend on it. Lines in a partition with calculated lines that don't
+ * declare their inputs are evaluated afterwards, by the calling thread,
+ * since there's no telling what the callbacks read. While tracing,
+ * partitions are evaluated one at a time.
+ *
+ * Within a partition, callbacks of external and calculated lines at the
+ * same dependency level don't read each other, so they're called
+ * concurrently too; idle threads steal them from busy ones. Results are
+ * applied in the usual order, so values, transitions and pending lines come
+ * out exactly as without the pool. The callbacks must be thread-safe.
+ *
+ * @param VAR Variable name (NOTE: not a pointer).
+ * @param THREADS Number of worker threads.
+ */
+#define CBAR_POOL_DECLARE(VAR, THREADS) \
+    struct cbar_pool VAR ## _pool; \
+    pthread_t VAR ## _pool_threads[THREADS]; \
+    struct cbar_worker VAR ## _pool_workers[(THREADS)+1];
+
+/**
+ * Start the worker pool.
+ * @param VAR Variable name (NOTE: not a pointer).
+ * @returns 0 on success, -1 if a thread couldn't be created (errno is set).
+ */
+#define CBAR_POOL_START(VAR) \
+    cbar_pool_start(&VAR, &VAR ## _pool, VAR ## _pool_threads, VAR ## _pool_workers, \
+                    sizeof(VAR ## _pool_threads) / sizeof(VAR ## _pool_threads[0]))
+
+/**
+ * Declare a sampler thread for a cbar instance.
+ *
+ * External lines with a sampling period are never read under the
+ * recalculation lock: their get() callbacks are called when due, and the
+ * result is kept until the next sample. A recalculation only evaluates such
+ * a line when its sample has changed. Without a sampler thread, lines that
+ * are due get sampled by cbar_recalculate() before it takes the lock; with
+ * one, they're sampled in real time in the background, and recalculation
+ * never waits on I/O at all.
+ *
+ * @param VAR Variable name (NOTE: not a pointer).
+ */
+#define CBAR_SAMPLER_DECLARE(VAR) \
+    struct cbar_sampler VAR ## _sampler;
+
+/**
+ * Start the sampler thread.
+ * @param VAR Variable name (NOTE: not a pointer).
+ * @returns 0 on success, -1 if the thread couldn't be created (errno is set).
+ */
+#define CBAR_SAMPLER_START(VAR) \
+    cbar_sampler_start(&VAR, &VAR ## _sampler)
 
 /**
  * Initialize a cbar instance.
+ *
+ * Lines can be declared in any order; they are evaluated so that each line
+ * sees the current state of the lines it reads.
+ *
  * @param VAR Variable name (NOTE: not a pointer).
  * @param CONFIGS Configs variable name.
+ * @returns 0 on success, -1 if the lines form a cycle (errno is set to ELOOP).
  */
 #define CBAR_INIT(VAR, CONFIGS) \
-    cbar_init(&VAR, CONFIGS, VAR ## _lines)
+    cbar_init(&VAR, CONFIGS, VAR ## _ops, VAR ## _lines, VAR ## _values, VAR ## _ranks, \
+              VAR ## _dirty, VAR ## _active, VAR ## _touched, VAR ## _raised, \
+              VAR ## _partitions)
+
+/**
+ * Initialize a cbar instance from a config image, skipping the scheduling
+ * altogether; see cbar_image_write(). The image is used in place: map it or
+ * put it in flash, aligned to 8 bytes, and keep it there for as long as the
+ * instance lives. If the image has a name index, cbar_lookup() works right
+ * away.
+ *
+ * The image is checked before it's used: its checksum must match, and
+ * every rank, link and bitmap position in it must agree with the configs.
+ * That about doubles the time it takes, but a bad image is never run.
+ *
+ * @param VAR Variable name (NOTE: not a pointer).
+ * @param CONFIGS Configs variable name; must match the image.
+ * @param IMAGE Image data.
+ * @param SIZE Image size.
+ * @returns 0 on success, -1 if the image is damaged or doesn't match the
+ *          configs or this build (errno is set to EINVAL); use CBAR_INIT
+ *          instead then.
+ */
+#define CBAR_INIT_IMAGE(VAR, CONFIGS, IMAGE, SIZE) \
+    cbar_init_image(&VAR, CONFIGS, IMAGE, SIZE, VAR ## _lines, VAR ## _values, \
+                    VAR ## _dirty, VAR ## _active, VAR ## _touched, VAR ## _raised, \
+                    VAR ## _partitions)
+
+/**
+ * Round a number of fleet instances up to a whole number of cache lines.
+ */
+#define CBAR_FLEET_STRIDE(INSTANCES) (((INSTANCES) + 15) & ~15)
+
+/**
+ * Declare a fleet: many instances of the same lines, with one shared
+ * schedule and their state side by side.
+ *
+ * Every line is evaluated for all instances before moving on to the next
+ * one, so threshold and debounce lines run through the same kernels as
+ * batches of a single instance do, and the rest are simple loops over
+ * adjacent values. The instances are split into shards of whole cache
+ * lines, one per thread. Nothing is tracked between recalculations: each
+ * one evaluates every line of every instance. Filter lines aren't
+ * supported, as there's no room for their windows.
+ *
+ * @param VAR Variable name (NOTE: not a pointer).
+ * @param CONFIGS Configs variable name.
+ * @param INSTANCES Maximum number of instances.
+ * @param THREADS Number of threads evaluating them, the caller included.
+ */
+#define CBAR_FLEET_DECLARE(VAR, CONFIGS, INSTANCES, THREADS) \
+    struct cbar_fleet VAR; \
+    int VAR ## _values[CBAR_COUNT(CONFIGS) * CBAR_FLEET_STRIDE(INSTANCES)]; \
+    int VAR ## _state[2 * CBAR_COUNT(CONFIGS) * CBAR_FLEET_STRIDE(INSTANCES)]; \
+    cbar_atomic_int VAR ## _scratch[(THREADS) * CBAR_COUNT(CONFIGS)]; \
+    struct cbar_fleet_worker VAR ## _workers[THREADS]; \
+    pthread_t VAR ## _threads[THREADS];
+
+/**
+ * Initialize a fleet and start its threads.
+ *
+ * All instances start out like a freshly initialized cbar instance, and are
+ * recalculated once.
+ *
+ * @param VAR Variable name (NOTE: not a pointer).
+ * @param CBAR Initialized cbar instance with the same configs; the fleet
+ *             uses its schedule, so it must outlive the fleet.
+ * @param INSTANCES Number of instances, up to the number declared.
+ * @returns 0 on success, -1 on error: EINVAL if there are filter lines,
+ *          or the error from creating a thread.
+ */
+#define CBAR_FLEET_INIT(VAR, CBAR, INSTANCES) \
+    cbar_fleet_init(&VAR, &CBAR, INSTANCES, \
+                    sizeof(VAR ## _values) / sizeof(VAR ## _values[0]), \
+                    VAR ## _values, VAR ## _state, VAR ## _scratch, \
+                    VAR ## _workers, VAR ## _threads, \
+                    sizeof(VAR ## _workers) / sizeof(VAR ## _workers[0]))
 
 /**
  * @internal
  */
-void cbar_init(struct cbar *cbar, const struct cbar_line_config *configs, struct cbar_line *lines);
+int cbar_init(struct cbar *cbar, const struct cbar_line_config *configs,
+              struct cbar_op *ops, struct cbar_line *lines, cbar_atomic_int *values, int *ranks,
+              unsigned long *dirty, unsigned long *active, cbar_atomic_ulong *touched,
+              cbar_atomic_ulong *pending, struct cbar_partition *partitions);
+
+/**
+ * @internal
+ */
+int cbar_init_image(struct cbar *cbar, const struct cbar_line_config *configs,
+                    const void *image, size_t size,
+                    struct cbar_line *lines, cbar_atomic_int *values,
+                    unsigned long *dirty, unsigned long *active, cbar_atomic_ulong *touched,
+                    cbar_atomic_ulong *pending, struct cbar_partition *partitions);
+
+/**
+ * Write a config image for CBAR_INIT_IMAGE: the evaluation order,
+ * dependency links, partitions and name index (if built), as computed for
+ * this instance.
+ *
+ * Meant for a build step: link the configs into a small host program that
+ * runs CBAR_INIT, which rejects cycles and bad references, then
+ * CBAR_INDEX_BUILD if wanted, then this. The host must share the target's
+ * ABI (int size, byte order, struct layout); CBAR_INIT_IMAGE refuses images
+ * that don't match.
+ *
+ * @param stream Stream to write the image to.
+ * @param cbar Instance initialized with CBAR_INIT.
+ * @returns 0 on success, -1 on write error.
+ */
+int cbar_image_write(FILE *stream, struct cbar *cbar);
 
 /**
  * Perform one round of debouncing/calculation of states.
  *
+ * Only lines whose inputs changed since the last round are evaluated, plus
+ * the ones that have to be polled: external and calculated lines, periodic
+ * timers and debouncers that haven't settled yet. External lines with a
+ * sampling period are sampled before taking the lock, and only when due;
+ * see CBAR_SAMPLER_DECLARE.
+ *
  * @param delay Delay since last call, in miliseconds.
  */
 void cbar_recalculate(struct cbar *cbar, int delay);
 
+/**
+ * Set a batch of input line values and recalculate, all in one go.
+ *
+ * Same as cbar_input_batch() followed by cbar_recalculate(), except that no
+ * other recalculation can sneak in between.
+ *
+ * @param delay Delay since last call, in miliseconds.
+ */
+void cbar_recalculate_batch(struct cbar *cbar, const int *ids, const int *values, size_t n, int delay);
+
+/**
+ * Get the time until the next debounce or periodic timer expires, or the
+ * next external line with a sampling period is due, unless the sampler
+ * thread takes care of those.
+ *
+ * Calling cbar_recalculate() with this delay lands exactly on the expiry,
+ * so there's no need to tick in between unless an input changes. Note that
+ * other external lines, and calculated lines, are only read on
+ * recalculation.
+ *
+ * @param cbar Initialized cbar instance.
+ * @returns Time in miliseconds, or -1 if no timers are running.
+ */
+int cbar_next_deadline(struct cbar *cbar);
+
 /**
  * Set cbar input line value.
  *
+ * Never blocks; this and cbar_post(), cbar_value() and cbar_pending() can
+ * be called from any thread, even while a recalculation is in progress.
+ * (cbar_post() only waits, briefly, to wake a thread in cbar_wait().)
+ *
  * @param cbar Initialized cbar instance.
  * @param id Line ID.
  * @param value New value.
  */
 void cbar_input(struct cbar *cbar, int id, int value);
 
+/**
+ * Set multiple cbar input line values at once.
+ *
+ * The whole batch is applied under the recalculation lock, so a concurrent
+ * recalculation sees either all of the new values or none of them.
+ *
+ * @param cbar Initialized cbar instance.
+ * @param ids Line IDs.
+ * @param values New values, one for each line ID.
+ * @param n Number of lines.
+ */
+void cbar_input_batch(struct cbar *cbar, const int *ids, const int *values, size_t n);
+
 /**
  * Read cbar line value.
  * @param cbar Initialized cbar instance.
@@ -141,6 +913,11 @@ int cbar_value(struct cbar *cbar, int id);
 
 /**
  * Post a request.
+ *
+ * Lock-free unless a thread is asleep in cbar_wait(); then it briefly takes
+ * the wait lock to wake it, which the waiter only holds while going to
+ * sleep or waking up.
+ *
  * @param cbar Initialized cbar instance.
  * @param id Line ID.
  */
@@ -154,12 +931,391 @@ void cbar_post(struct cbar *cbar, int id);
  */
 bool cbar_pending(struct cbar *cbar, int id);
 
+/**
+ * Check and clear all request, monitor and periodic lines at once. Never
+ * blocks.
+ *
+ * Only lines that were raised are looked at; see CBAR_QUEUE_DECLARE. A line
+ * is returned once per raise, whether it's cleared here or by
+ * cbar_pending(). Lines that don't fit are left for the next call.
+ *
+ * @param cbar Initialized cbar instance.
+ * @param ids Array to store the IDs of pending lines in.
+ * @param max Size of the ids array.
+ * @returns Number of IDs stored.
+ */
+int cbar_pending_drain(struct cbar *cbar, int *ids, int max);
+
+/**
+ * Wait until one or more request, monitor or periodic lines are pending.
+ *
+ * Wakes up as soon as cbar_recalculate() or cbar_post() raises a line. The
+ * lines returned are cleared, just like with cbar_pending(); if more than
+ * max lines are pending, the rest are left for the next call.
+ *
+ * @param cbar Initialized cbar instance.
+ * @param ids Array to store the pending line IDs in.
+ * @param max Size of the ids array.
+ * @returns Number of line IDs stored.
+ */
+int cbar_wait(struct cbar *cbar, int *ids, int max);
+
+/**
+ * Same as cbar_wait(), but gives up after a timeout.
+ *
+ * @param timeout Timeout in miliseconds; negative means no timeout.
+ * @returns Number of line IDs stored, or 0 if the timeout expired.
+ */
+int cbar_wait_timeout(struct cbar *cbar, int *ids, int max, int timeout);
+
+/**
+ * Find out which lines a calculated line reads.
+ *
+ * Calls the line's callback once, recording every line it reads through
+ * cbar_value() on this thread, in order of first use. The result is what to
+ * put in CBAR_INPUTS, provided the callback reads the same lines every
+ * time; a callback that skips some reads depending on the values needs its
+ * inputs declared by hand. The callback's result is discarded. If the lines
+ * don't fit in the array, it's called once more for each further 1024
+ * lines of the instance, to count them all.
+ *
+ * @param cbar Initialized cbar instance.
+ * @param id Calculated line ID.
+ * @param ids Array to store the line IDs in.
+ * @param max Size of the array.
+ * @returns Number of distinct lines read; if more than max, only the first
+ *          max are stored.
+ */
+int cbar_record_inputs(struct cbar *cbar, int id, int *ids, int max);
+
+/**
+ * Find a line by name. Never blocks.
+ * @param cbar Initialized cbar instance, with CBAR_INDEX_BUILD done.
+ * @returns Line ID, or -1 if there's no such line.
+ */
+int cbar_lookup(struct cbar *cbar, const char *name);
+
+/**
+ * Set an input line by name; see cbar_input().
+ * @returns 0 on success, -1 if there's no such input line (errno is set to
+ *          ENOENT).
+ */
+int cbar_input_named(struct cbar *cbar, const char *name, int value);
+
+/**
+ * Get line value by name; see cbar_value().
+ * @returns 0 on success, -1 if there's no such line (errno is set to ENOENT).
+ */
+int cbar_value_named(struct cbar *cbar, const char *name, int *value);
+
 /**
  * Dump the cbar state.
  * @param cbar Initialized cbar instance.
  */
 void cbar_dump(FILE *stream, struct cbar *cbar);
 
+/**
+ * @internal
+ */
+void cbar_snapshot_init(struct cbar_snapshot *snapshot, int *values, int count);
+
+/**
+ * Encode the lines that changed since the last frame, as a compact binary
+ * frame for telemetry. Holds off recalculation while reading the values.
+ *
+ * A frame is a flags byte (bit 0: keyframe), then varints: for keyframes,
+ * the number of lines and the time; for deltas, the time since the last
+ * frame. Then come the changed lines, each as the gap since the previous
+ * one plus one and the zigzag-encoded value, and a zero. Keyframes carry
+ * every line.
+ *
+ * @param cbar Initialized cbar instance.
+ * @param snapshot Encoder, declared for as many lines as cbar.
+ * @param buf Buffer to write the frame to.
+ * @param size Size of the buffer.
+ * @param keyframe Encode every line, not just changed ones.
+ * @returns Frame size, or -1 if it didn't fit (errno is set to ENOBUFS);
+ *          the next frame is then a keyframe.
+ */
+int cbar_snapshot_encode(struct cbar *cbar, struct cbar_snapshot *snapshot,
+                         uint8_t *buf, size_t size, bool keyframe);
+
+/**
+ * Decode a frame made by cbar_snapshot_encode() into snapshot->values.
+ * Frames can be fed straight from a stream; nothing is applied unless the
+ * whole frame is there.
+ *
+ * @param snapshot Decoder, declared for as many lines as the encoder.
+ * @param buf Buffer holding the frame.
+ * @param size Number of bytes in the buffer.
+ * @returns Number of bytes taken, 0 if the buffer holds only part of a
+ *          frame, or -1 if the frame is malformed, has the wrong number of
+ *          lines or is a delta before any keyframe (errno is set to EINVAL).
+ */
+int cbar_snapshot_decode(struct cbar_snapshot *snapshot, const uint8_t *buf, size_t size);
+
+/**
+ * @internal
+ */
+void cbar_queue_start(struct cbar *cbar, struct cbar_queue *queue, struct cbar_queue_cell *cells,
+                      unsigned long size);
+
+/**
+ * @internal
+ */
+int cbar_pool_start(struct cbar *cbar, struct cbar_pool *pool, pthread_t *threads,
+                    struct cbar_worker *workers, int count);
+
+/**
+ * Stop the worker pool and wait for its threads to exit.
+ * @param cbar Initialized cbar instance.
+ */
+void cbar_pool_stop(struct cbar *cbar);
+
+/**
+ * @internal
+ */
+int cbar_sampler_start(struct cbar *cbar, struct cbar_sampler *sampler);
+
+/**
+ * Stop the sampler thread and wait for it to exit. Sampled lines are then
+ * sampled by cbar_recalculate() again.
+ * @param cbar Initialized cbar instance.
+ */
+void cbar_sampler_stop(struct cbar *cbar);
+
+/**
+ * @internal
+ */
+void cbar_profile_start(struct cbar *cbar, struct cbar_profile *profile,
+                        struct cbar_profile_stat *lines);
+
+/**
+ * Stop profiling. The results are kept until the next CBAR_PROFILE_START.
+ * @param cbar Initialized cbar instance.
+ */
+void cbar_profile_stop(struct cbar *cbar);
+
+/**
+ * Dump the profiling results: tick and mutex hold times, then every line
+ * evaluated at least once.
+ * @param cbar Initialized cbar instance.
+ */
+void cbar_profile_dump(FILE *stream, struct cbar *cbar);
+
+/**
+ * @internal
+ */
+int cbar_filter_start(struct cbar *cbar, int *filters, size_t size);
+
+/**
+ * @internal
+ */
+int cbar_index_build(struct cbar *cbar, int *slots, unsigned *seeds, int *scratch);
+
+/**
+ * @internal
+ */
+void cbar_trace_start(struct cbar *cbar, struct cbar_trace *trace,
+                      struct cbar_trace_event *events, size_t size);
+
+/**
+ * Stop recording transitions. Events already recorded can still be read.
+ * @param cbar Initialized cbar instance.
+ */
+void cbar_trace_stop(struct cbar *cbar);
+
+/**
+ * Take the oldest recorded transitions out of the trace. Never blocks.
+ *
+ * Only one thread may read a given trace at a time, and only after
+ * CBAR_TRACE_START has returned.
+ *
+ * @param cbar Initialized cbar instance.
+ * @param events Array to store the events in.
+ * @param max Size of the events array.
+ * @returns Number of events stored.
+ */
+size_t cbar_trace_read(struct cbar *cbar, struct cbar_trace_event *events, size_t max);
+
+/**
+ * Get the number of transitions dropped because the trace was full.
+ * @param cbar Initialized cbar instance.
+ */
+unsigned long cbar_trace_dropped(struct cbar *cbar);
+
+/**
+ * Write transitions to a trace file.
+ *
+ * Trace files are plain text, one transition per line: time, line ID,
+ * previous value and value, separated by spaces. Blank lines, even with
+ * CRLF endings, and lines starting with '#', however long, are ignored.
+ *
+ * @returns 0 on success, -1 on write error.
+ */
+int cbar_trace_write(FILE *stream, const struct cbar_trace_event *events, size_t n);
+
+/**
+ * Read the next transition from a trace file.
+ * @returns 1 if a transition was read, 0 at end of file, -1 on read error
+ *          or if the file is malformed (errno is set to EINVAL).
+ */
+int cbar_trace_scan(FILE *stream, struct cbar_trace_event *event);
+
+/**
+ * Replay a trace file in simulated time, as fast as possible.
+ *
+ * Transitions of input lines are fed through cbar_input(); transitions of
+ * external lines become the value the line reads from then on, instead of
+ * calling get(). Transitions of other lines are ignored, so a trace taken
+ * in the field can be replayed as is. Events must be sorted by time.
+ *
+ * Instead of ticking every milisecond, the simulation jumps from one event
+ * or timer expiry (see cbar_next_deadline()) to the next; the transitions
+ * are the same as with cbar_recalculate(cbar, 1) called every milisecond.
+ * Pending lines are cleared after every step, like a consumer would.
+ *
+ * The transitions are read from the cbar trace (see CBAR_TRACE_START) after
+ * every step; the trace must be able to hold all transitions of one step.
+ * No other thread may use the instance during simulation.
+ *
+ * @param cbar Initialized cbar instance.
+ * @param input Trace file to replay.
+ * @param output Trace file to write transitions to, or NULL.
+ * @param until Time to simulate up to, in miliseconds (see cbar_trace_event).
+ * @returns 0 on success, -1 on error: EINVAL if the input is malformed or
+ *          there's output but no trace, ENOBUFS if transitions were dropped,
+ *          or whatever writing the output failed with.
+ */
+int cbar_simulate(struct cbar *cbar, FILE *input, FILE *output, unsigned long until);
+
+/**
+ * Export line values to a POSIX shared memory object.
+ *
+ * From then on, the values are copied out at the end of every recalculation
+ * under a seqlock, so other processes can read a consistent snapshot of all
+ * lines without ever taking the cbar mutex; see cbar_shared_open(). Any
+ * existing object of that name is replaced. An instance exports to one
+ * object at a time: call cbar_export_stop() before exporting elsewhere.
+ *
+ * @param cbar Initialized cbar instance.
+ * @param name Object name, as for shm_open(); must stay valid until
+ *             cbar_export_stop().
+ * @returns 0 on success, -1 on error: EBUSY if already exporting, or the
+ *          error from creating or mapping the object.
+ */
+int cbar_export_start(struct cbar *cbar, const char *name);
+
+/**
+ * Stop exporting and remove the shared memory object. Readers that still
+ * have it open keep the last values.
+ * @param cbar Initialized cbar instance.
+ */
+void cbar_export_stop(struct cbar *cbar);
+
+/**
+ * Map exported line values, read only. Works from any process.
+ * @param reader Reader to set up.
+ * @param name Object name passed to cbar_export_start().
+ * @returns 0 on success, -1 on error (errno is set): EINVAL if the object
+ *          isn't a complete export of line values.
+ */
+int cbar_shared_open(struct cbar_shared_reader *reader, const char *name);
+
+/**
+ * Unmap exported line values.
+ */
+void cbar_shared_close(struct cbar_shared_reader *reader);
+
+/**
+ * Start reading exported values, waiting out an update in progress.
+ *
+ * Values read with cbar_shared_value() belong to one snapshot if
+ * cbar_shared_retry() returns false afterwards; otherwise, start over:
+ *
+ *     unsigned sequence;
+ *     do {
+ *         sequence = cbar_shared_begin(&reader);
+ *         speed = cbar_shared_value(&reader, LINE_SPEED);
+ *         rpm = cbar_shared_value(&reader, LINE_RPM);
+ *     } while (cbar_shared_retry(&reader, sequence));
+ *
+ * @returns Sequence number to pass to cbar_shared_retry().
+ */
+unsigned cbar_shared_begin(const struct cbar_shared_reader *reader);
+
+/**
+ * Check whether the values read since cbar_shared_begin() may be torn.
+ */
+bool cbar_shared_retry(const struct cbar_shared_reader *reader, unsigned sequence);
+
+/**
+ * Read one exported value, straight from shared memory; see
+ * cbar_shared_begin().
+ */
+int cbar_shared_value(const struct cbar_shared_reader *reader, int id);
+
+/**
+ * Copy a consistent snapshot of exported values.
+ * @param values Array to store the values in, by ID.
+ * @param max Size of the values array.
+ * @param time Where to store the snapshot time, or NULL.
+ * @returns Number of values stored.
+ */
+int cbar_shared_read(const struct cbar_shared_reader *reader, int *values, int max,
+                     unsigned long *time);
+
+/**
+ * @internal
+ */
+int cbar_fleet_init(struct cbar_fleet *fleet, const struct cbar *cbar, int instances, size_t size,
+                    int *values, int *state, cbar_atomic_int *scratch,
+                    struct cbar_fleet_worker *workers, pthread_t *threads, int n_threads);
+
+/**
+ * Stop the fleet's threads and wait for them to exit.
+ */
+void cbar_fleet_stop(struct cbar_fleet *fleet);
+
+/**
+ * Perform one round of debouncing/calculation of states, for all instances.
+ *
+ * The other fleet functions must not be called while this runs; feed the
+ * inputs and consume the pending lines in between. Calculated lines are
+ * passed a view of one instance, good for cbar_value() only, with the lines
+ * they declare as inputs, or all lines if they don't declare any.
+ *
+ * @param fleet Initialized fleet.
+ * @param delay Time elapsed since last call, in miliseconds.
+ */
+void cbar_fleet_recalculate(struct cbar_fleet *fleet, int delay);
+
+/**
+ * Set an input line of one instance. External lines are set this way too:
+ * their callbacks aren't called, and they hold the value they were last set
+ * to, like while simulating.
+ */
+void cbar_fleet_input(struct cbar_fleet *fleet, int instance, int id, int value);
+
+/**
+ * Post a request line of one instance.
+ */
+void cbar_fleet_post(struct cbar_fleet *fleet, int instance, int id);
+
+/**
+ * Check and clear a request, monitor or periodic line of one instance.
+ */
+bool cbar_fleet_pending(struct cbar_fleet *fleet, int instance, int id);
+
+/**
+ * Get line value of one instance.
+ */
+int cbar_fleet_value(const struct cbar_fleet *fleet, int instance, int id);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
 
 /* vim: set ts=4 sw=4 et: */
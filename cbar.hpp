@@ -0,0 +1,367 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef CBAR_HPP
+#define CBAR_HPP
+
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "cbar.h"
+
+/**
+ * Compile-time cbar graphs (C++17).
+ *
+ * Lines are declared as types instead of a config table:
+ *
+ *     enum { IN_VOLTAGE, LINE_POWER_AVAILABLE, MONITOR_POWER };
+ *
+ *     cbar_static::graph<
+ *         cbar_static::external<adc_measure, ADC_CHANNEL_VCAR>,
+ *         cbar_static::threshold<IN_VOLTAGE, 11000, 10000>,
+ *         cbar_static::monitor<LINE_POWER_AVAILABLE>
+ *     > logic;
+ *
+ * The compiler sees the whole graph, so recalculate() boils down to one
+ * inlined evaluation per line in declaration order: no schedule, no type
+ * dispatch, no config lookups. A line may only read lines declared before
+ * it; this is checked at compile time, so a single pass always settles.
+ *
+ * Line semantics match the C API. The value(), input(), post() and
+ * pending() accessors are lock-free; recalculate() must not be called
+ * from two threads at once.
+ *
+ * Only the original line types are covered, in their original form:
+ * external lines are read on every recalculation, and calculated lines
+ * can't declare their inputs. Logic and filter lines, sampling periods
+ * and declared inputs need the C API.
+ */
+namespace cbar_static {
+
+struct input {};
+template <int (*Get)(intptr_t), intptr_t Priv, bool Invert = false> struct external {};
+template <int Input, int Up, int Down> struct threshold {};
+template <int Input, int Up, int Down> struct debounce {};
+struct request {};
+template <int (*Get)(struct cbar *)> struct calculated {};
+template <int Input> struct monitor {};
+template <int Period> struct periodic {};
+
+namespace detail {
+
+/* State of any line; each type only uses what it needs. */
+struct state {
+    cbar_atomic_int input_value{0};     /* Input lines. */
+    int held = INT_MIN;                 /* Debounced value, or a monitor's previous input. */
+    int timer = 0;                      /* Debounce timer, or time since the last period. */
+};
+
+/* Per-type C line type, input line and config. */
+template <class Line> struct traits;
+
+template <> struct traits<input> {
+    static constexpr enum cbar_line_type type = CBAR_INPUT;
+    static constexpr int input = -1;
+    static void configure(struct cbar_line_config &) {}
+};
+
+template <int (*Get)(intptr_t), intptr_t Priv, bool Invert>
+struct traits<external<Get, Priv, Invert>> {
+    static constexpr enum cbar_line_type type = CBAR_EXTERNAL;
+    static constexpr int input = -1;
+    static void configure(struct cbar_line_config &config)
+    {
+        config.external.get = Get;
+        config.external.priv = Priv;
+        config.external.invert = Invert;
+    }
+};
+
+template <int Input, int Up, int Down>
+struct traits<threshold<Input, Up, Down>> {
+    static constexpr enum cbar_line_type type = CBAR_THRESHOLD;
+    static constexpr int input = Input;
+    static void configure(struct cbar_line_config &config)
+    {
+        config.threshold.input = Input;
+        config.threshold.threshold_up = Up;
+        config.threshold.threshold_down = Down;
+    }
+};
+
+template <int Input, int Up, int Down>
+struct traits<debounce<Input, Up, Down>> {
+    static constexpr enum cbar_line_type type = CBAR_DEBOUNCE;
+    static constexpr int input = Input;
+    static void configure(struct cbar_line_config &config)
+    {
+        config.debounce.input = Input;
+        config.debounce.timeout_up = Up;
+        config.debounce.timeout_down = Down;
+    }
+};
+
+template <> struct traits<request> {
+    static constexpr enum cbar_line_type type = CBAR_REQUEST;
+    static constexpr int input = -1;
+    static void configure(struct cbar_line_config &) {}
+};
+
+template <int (*Get)(struct cbar *)>
+struct traits<calculated<Get>> {
+    static constexpr enum cbar_line_type type = CBAR_CALCULATED;
+    static constexpr int input = -1;
+    static void configure(struct cbar_line_config &config)
+    {
+        config.calculated.get = Get;
+    }
+};
+
+template <int Input>
+struct traits<monitor<Input>> {
+    static constexpr enum cbar_line_type type = CBAR_MONITOR;
+    static constexpr int input = Input;
+    static void configure(struct cbar_line_config &config)
+    {
+        config.monitor.input = Input;
+    }
+};
+
+template <int Period>
+struct traits<periodic<Period>> {
+    static_assert(Period > 0, "periodic lines need a positive period");
+    static constexpr enum cbar_line_type type = CBAR_PERIODIC;
+    static constexpr int input = -1;
+    static void configure(struct cbar_line_config &config)
+    {
+        config.periodic.period = Period;
+    }
+};
+
+} // namespace detail
+
+template <class... Lines>
+class graph {
+public:
+    static constexpr int count = sizeof...(Lines);
+    static_assert(count > 0, "empty graph");
+
+    /**
+     * Initialize the graph and run the initial calculation.
+     * @param names Line names for cbar_dump() and configs(), or NULL.
+     */
+    explicit graph(const char *const *names = nullptr)
+    {
+        configure(names, std::index_sequence_for<Lines...>{});
+        cbar_.configs = configs_;
+        cbar_.count = count;
+        cbar_.values = values_;
+        recalculate(0);
+    }
+
+    graph(const graph &) = delete;
+    graph &operator=(const graph &) = delete;
+
+    /**
+     * Perform one round of debouncing/calculation of states.
+     * @param delay Time elapsed since last call, in miliseconds.
+     */
+    void recalculate(int delay)
+    {
+        evaluate_all(delay, std::index_sequence_for<Lines...>{});
+    }
+
+    /**
+     * Set an input line.
+     */
+    template <int Id>
+    void input(int value)
+    {
+        static_assert(std::is_same<line<Id>, cbar_static::input>::value, "not an input line");
+        states_[Id].input_value.store(value, std::memory_order_relaxed);
+    }
+
+    /**
+     * Post a request line.
+     */
+    template <int Id>
+    void post()
+    {
+        static_assert(std::is_same<line<Id>, request>::value, "not a request line");
+        values_[Id].store(1, std::memory_order_release);
+    }
+
+    /**
+     * Check and clear a request, monitor or periodic line.
+     */
+    template <int Id>
+    bool pending()
+    {
+        constexpr enum cbar_line_type type = detail::traits<line<Id>>::type;
+        static_assert(type == CBAR_REQUEST || type == CBAR_MONITOR || type == CBAR_PERIODIC,
+                      "not a pending line");
+        return values_[Id].exchange(0, std::memory_order_acquire);
+    }
+
+    /**
+     * Get line value.
+     */
+    template <int Id>
+    int value() const
+    {
+        static_assert(Id >= 0 && Id < count, "no such line");
+        return values_[Id].load(std::memory_order_relaxed);
+    }
+
+    int value(int id) const
+    {
+        return values_[id].load(std::memory_order_relaxed);
+    }
+
+    /**
+     * C view of the graph, as passed to calculated lines. Works with
+     * cbar_value() and cbar_dump(); not with the rest of the C API.
+     */
+    struct cbar *c_cbar()
+    {
+        return &cbar_;
+    }
+
+    /**
+     * Equivalent config block, terminated as usual, for use with CBAR_INIT.
+     */
+    const struct cbar_line_config *configs() const
+    {
+        return configs_;
+    }
+
+private:
+    template <int Id>
+    using line = std::tuple_element_t<Id, std::tuple<Lines...>>;
+
+    template <std::size_t... Ids>
+    void configure(const char *const *names, std::index_sequence<Ids...>)
+    {
+        ((configs_[Ids].name = names ? names[Ids] : "line",
+          configs_[Ids].type = detail::traits<Lines>::type,
+          detail::traits<Lines>::configure(configs_[Ids])), ...);
+    }
+
+    template <std::size_t... Ids>
+    void evaluate_all(int delay, std::index_sequence<Ids...>)
+    {
+        (evaluate<int(Ids), Lines>(delay), ...);
+    }
+
+    template <int Id, class Line>
+    void evaluate(int delay)
+    {
+        using traits = detail::traits<Line>;
+        static_assert(traits::input < Id, "lines may only read lines declared before them");
+        static_assert(traits::input >= -1, "no such input line");
+
+        [[maybe_unused]] detail::state &state = states_[Id];
+        [[maybe_unused]] int input = 0;
+        int previous = values_[Id].load(std::memory_order_relaxed);
+        int value = previous;
+
+        if constexpr (traits::input >= 0)
+            input = values_[traits::input].load(std::memory_order_relaxed);
+
+        if constexpr (traits::type == CBAR_INPUT) {
+            value = state.input_value.load(std::memory_order_relaxed);
+        } else if constexpr (traits::type == CBAR_EXTERNAL) {
+            evaluate_external(Line(), value);
+        } else if constexpr (traits::type == CBAR_THRESHOLD) {
+            evaluate_threshold(Line(), input, value);
+        } else if constexpr (traits::type == CBAR_DEBOUNCE) {
+            evaluate_debounce(Line(), input, state, delay, value);
+        } else if constexpr (traits::type == CBAR_CALCULATED) {
+            evaluate_calculated(Line(), value);
+        } else if constexpr (traits::type == CBAR_MONITOR) {
+            if (input != state.held) {
+                values_[Id].store(1, std::memory_order_release);
+                state.held = input;
+            }
+        } else if constexpr (traits::type == CBAR_PERIODIC) {
+            evaluate_periodic(Line(), state, delay, Id);
+        }
+
+        /* Pending lines are stored above, see cbar_evaluate(). */
+        if (value != previous)
+            values_[Id].store(value, std::memory_order_relaxed);
+    }
+
+    template <int (*Get)(intptr_t), intptr_t Priv, bool Invert>
+    static void evaluate_external(external<Get, Priv, Invert>, int &value)
+    {
+        int input = Get(Priv);
+        value = Invert ? !input : input;
+    }
+
+    template <int Input, int Up, int Down>
+    static void evaluate_threshold(threshold<Input, Up, Down>, int input, int &value)
+    {
+        int r = input >= (value ? Down : Up);
+
+        /* Swapping the up/down values inverts logic. */
+        value = (Up < Down) ? !r : r;
+    }
+
+    template <int Input, int Up, int Down>
+    static void evaluate_debounce(debounce<Input, Up, Down>, int input, detail::state &state,
+                                  int delay, int &value)
+    {
+        int timeout = input ? Up : Down;
+
+        if (state.held != input) {
+            // Line state just changed. Reset debounce timer.
+            state.held = input;
+            state.timer = 0;
+        } else if (state.held != value) {
+            // Line state is stabilizing. Bump debounce timer.
+            state.timer += delay;
+        }
+
+        if (state.held != value && state.timer >= timeout) {
+            // Line just stabilized. Register the change.
+            value = state.held;
+        }
+    }
+
+    template <int (*Get)(struct cbar *)>
+    void evaluate_calculated(calculated<Get>, int &value)
+    {
+        value = Get(&cbar_);
+    }
+
+    template <int Period>
+    void evaluate_periodic(periodic<Period>, detail::state &state, int delay, int id)
+    {
+        state.timer += delay;
+        if (state.timer >= Period) {
+            state.timer = 0;
+            values_[id].store(1, std::memory_order_release);
+        }
+    }
+
+    detail::state states_[count];
+    cbar_atomic_int values_[count] = {};
+    struct cbar_line_config configs_[count + 1] = {};
+    struct cbar cbar_ = {};
+};
+
+} // namespace cbar_static
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
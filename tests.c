@@ -6,9 +6,13 @@
  * published by Sam Hocevar. See the COPYING file for more details.
  */
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <check.h>
 
 #include "cbar.h"
@@ -284,6 +288,86 @@ END_TEST
 
 /****************************************************************************/
 
+#define RUN_INPUTS 4
+#define RUN_THRESHOLDS 19
+#define RUN_DEBOUNCES 13
+#define RUN_LINES (RUN_INPUTS+1+RUN_THRESHOLDS+RUN_DEBOUNCES)
+
+static struct cbar_line_config run_configs[RUN_LINES+1];
+static int run_joined[RUN_INPUTS+1];
+
+/*
+ * Runs of same-level threshold and debounce lines long enough for the vector
+ * kernels, with lengths that leave a scalar tail, against the scalar rules.
+ */
+START_TEST(test_cbar_runs)
+{
+    int value[RUN_LINES] = { 0 }, target[RUN_LINES], timer[RUN_LINES] = { 0 };
+    int inputs[RUN_INPUTS] = { 0 };
+
+    /* One logic line reading all inputs keeps them in one partition. */
+    for (int i=0; i<RUN_INPUTS; i++) {
+        run_configs[i] = (struct cbar_line_config) { "in", CBAR_INPUT };
+        run_joined[i] = i;
+    }
+    run_joined[RUN_INPUTS] = -1;
+    run_configs[RUN_INPUTS] = (struct cbar_line_config) { "joined", CBAR_LOGIC,
+        .logic = { CBAR_OR, run_joined } };
+    for (int i=0; i<RUN_THRESHOLDS; i++) {
+        int high = 30 + 3*i, low = 20 + 2*i;
+        /* Every third one is inverted. */
+        run_configs[RUN_INPUTS+1+i] = (struct cbar_line_config) { "threshold", CBAR_THRESHOLD,
+            .threshold = { i % RUN_INPUTS, i % 3 ? high : low, i % 3 ? low : high } };
+    }
+    for (int i=0; i<RUN_DEBOUNCES; i++) {
+        run_configs[RUN_INPUTS+1+RUN_THRESHOLDS+i] = (struct cbar_line_config) { "debounce",
+            CBAR_DEBOUNCE, .debounce = { i % RUN_INPUTS, 37*i % 200, 53*i % 200 } };
+    }
+    run_configs[RUN_LINES] = (struct cbar_line_config) { NULL };
+    for (int id=0; id<RUN_LINES; id++)
+        target[id] = INT_MIN;
+
+    CBAR_DECLARE(cbar, run_configs);
+    CBAR_INIT(cbar, run_configs);
+
+    unsigned seed = 1;
+    for (int tick=0; tick<2000; tick++) {
+        int delay = tick ? rand_r(&seed) % 100 : 0;
+        if (tick) {
+            for (int i=0; i<RUN_INPUTS; i++) {
+                if (rand_r(&seed) % 4)
+                    inputs[i] = rand_r(&seed) % 100;
+                cbar_input(&cbar, i, inputs[i]);
+            }
+            cbar_recalculate(&cbar, delay);
+        }
+
+        for (int id=RUN_INPUTS+1; id<RUN_LINES; id++) {
+            const struct cbar_line_config *config = &run_configs[id];
+            if (config->type == CBAR_THRESHOLD) {
+                int up = config->threshold.threshold_up, down = config->threshold.threshold_down;
+                int r = inputs[config->threshold.input] >= (value[id] ? down : up);
+                value[id] = (up < down) ? !r : r;
+            } else {
+                int input = inputs[config->debounce.input];
+                int timeout = input ? config->debounce.timeout_up : config->debounce.timeout_down;
+                if (target[id] != input) {
+                    target[id] = input;
+                    timer[id] = 0;
+                } else if (target[id] != value[id]) {
+                    timer[id] += delay;
+                }
+                if (target[id] != value[id] && timer[id] >= timeout)
+                    value[id] = target[id];
+            }
+            ck_assert_int_eq(cbar_value(&cbar, id), value[id]);
+        }
+    }
+}
+END_TEST
+
+/****************************************************************************/
+
 START_TEST(test_cbar_request)
 {
     enum lines {
@@ -330,6 +414,19 @@ static int calculate_idling(struct cbar *cbar)
            !cbar_value(cbar, LINE_IN_MOTION);
 }
 
+#define RECORD_LINES 2100
+
+static struct cbar_line_config record_configs[RECORD_LINES+1];
+
+/* Reads four lines, in three windows of IDs, twice each. */
+static int calculate_scattered(struct cbar *cbar)
+{
+    int sum = 0;
+    for (int pass=0; pass<2; pass++)
+        sum += cbar_value(cbar, 1) + cbar_value(cbar, 1500) + cbar_value(cbar, 2) + cbar_value(cbar, 2050);
+    return sum;
+}
+
 START_TEST(test_cbar_calculated)
 {
     static const struct cbar_line_config configs[] = {
@@ -363,6 +460,241 @@ START_TEST(test_cbar_calculated)
 }
 END_TEST
 
+enum calculated_inputs_lines {
+    LINE_IDLING,
+    LINE_ENGINE,
+    LINE_MOTION,
+    LINE_OTHER,
+};
+
+static int idling_calls;
+
+static int calculate_idling_counted(struct cbar *cbar)
+{
+    idling_calls++;
+    return cbar_value(cbar, LINE_ENGINE) && !cbar_value(cbar, LINE_MOTION);
+}
+
+START_TEST(test_cbar_calculated_inputs)
+{
+    static const int idling_inputs[] = { LINE_ENGINE, LINE_MOTION, -1 };
+    static const struct cbar_line_config configs[] = {
+        { "car_idling",     CBAR_CALCULATED, .calculated = { calculate_idling_counted, idling_inputs } },
+        { "engine_running", CBAR_INPUT },
+        { "in_motion",      CBAR_INPUT },
+        { "other",          CBAR_INPUT },
+        { NULL }
+    };
+
+    /* the callback reads the lines we're about to declare */
+    int ids[4];
+    struct cbar_line_config probe[] = {
+        { "engine_running", CBAR_INPUT },
+        { "in_motion",      CBAR_INPUT },
+        { "car_idling",     CBAR_CALCULATED, .calculated = { calculate_idling } },
+        { NULL }
+    };
+    CBAR_DECLARE(recorded, probe);
+    CBAR_INIT(recorded, probe);
+    ck_assert_int_eq(cbar_record_inputs(&recorded, LINE_CAR_IDLING, ids, 4), 1);
+    ck_assert_int_eq(ids[0], LINE_ENGINE_RUNNING);
+    cbar_input(&recorded, LINE_ENGINE_RUNNING, true);
+    cbar_recalculate(&recorded, 0);
+    ck_assert_int_eq(cbar_record_inputs(&recorded, LINE_CAR_IDLING, ids, 1), 2);
+    ck_assert_int_eq(cbar_record_inputs(&recorded, LINE_CAR_IDLING, ids, 4), 2);
+    ck_assert_int_eq(ids[1], LINE_IN_MOTION);
+
+    /* repeated reads count once, even past the end of the array */
+    for (int id=0; id<RECORD_LINES; id++)
+        record_configs[id] = (struct cbar_line_config) { NULL, CBAR_INPUT };
+    record_configs[0] = (struct cbar_line_config) { NULL, CBAR_CALCULATED, .calculated = { calculate_scattered } };
+    CBAR_DECLARE(scattered, record_configs);
+    CBAR_INIT(scattered, record_configs);
+    ck_assert_int_eq(cbar_record_inputs(&scattered, 0, ids, 2), 4);
+    ck_assert_int_eq(ids[0], 1);
+    ck_assert_int_eq(ids[1], 1500);
+    ck_assert_int_eq(cbar_record_inputs(&scattered, 0, ids, 4), 4);
+    ck_assert_int_eq(ids[2], 2);
+    ck_assert_int_eq(ids[3], 2050);
+
+    idling_calls = 0;
+    CBAR_DECLARE(cbar, configs);
+    CBAR_INIT(cbar, configs);
+    ck_assert_int_eq(idling_calls, 1);
+
+    /* nothing it reads has changed: no call */
+    cbar_recalculate(&cbar, 100);
+    cbar_input(&cbar, LINE_OTHER, 1);
+    cbar_recalculate(&cbar, 100);
+    ck_assert_int_eq(idling_calls, 1);
+
+    /* inputs are evaluated first, even though they're declared later */
+    cbar_input(&cbar, LINE_ENGINE, true);
+    cbar_recalculate(&cbar, 100);
+    ck_assert_int_eq(idling_calls, 2);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_IDLING), true);
+    cbar_input(&cbar, LINE_MOTION, true);
+    cbar_recalculate(&cbar, 100);
+    ck_assert_int_eq(idling_calls, 3);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_IDLING), false);
+    cbar_recalculate(&cbar, 100);
+    ck_assert_int_eq(idling_calls, 3);
+}
+END_TEST
+
+#define LOGIC_WIDE 100
+
+static struct cbar_line_config logic_wide_configs[2+LOGIC_WIDE+1];
+static int logic_wide_inputs[LOGIC_WIDE][3];
+
+START_TEST(test_cbar_logic)
+{
+    enum lines {
+        LINE_ENGINE,
+        LINE_MOTION,
+        LINE_SPEED,
+        LINE_IDLING,
+        LINE_ACTIVE,
+        LINE_STOPPED,
+        LINE_PARKED,
+        LINE_SHOWN,
+    };
+    const struct cbar_line_config configs[] = {
+        { "engine",  CBAR_INPUT },
+        { "motion",  CBAR_INPUT },
+        { "speed",   CBAR_INPUT },
+        { "idling",  CBAR_LOGIC, .logic = { CBAR_AND, CBAR_INPUTS(LINE_ENGINE, LINE_STOPPED) } },
+        { "active",  CBAR_LOGIC, .logic = { CBAR_OR, CBAR_INPUTS(LINE_ENGINE, LINE_MOTION, LINE_SPEED) } },
+        { "stopped", CBAR_LOGIC, .logic = { CBAR_NOT, CBAR_INPUTS(LINE_MOTION) } },
+        { "parked",  CBAR_LOGIC, .logic = { CBAR_NOT, CBAR_INPUTS(LINE_ENGINE, LINE_MOTION) } },
+        { "shown",   CBAR_LOGIC, .logic = { CBAR_SELECT, CBAR_INPUTS(LINE_MOTION, LINE_SPEED, LINE_ENGINE) } },
+        { NULL }
+    };
+
+    CBAR_DECLARE(cbar, configs);
+    CBAR_INIT(cbar, configs);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_IDLING), false);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_ACTIVE), false);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_STOPPED), true);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_PARKED), true);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_SHOWN), 0);
+
+    /* logic lines reading logic lines settle in one pass */
+    cbar_input(&cbar, LINE_ENGINE, 1);
+    cbar_recalculate(&cbar, 100);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_IDLING), true);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_ACTIVE), true);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_PARKED), false);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_SHOWN), 1);
+
+    /* any nonzero value is high; select passes values through */
+    cbar_input(&cbar, LINE_ENGINE, 0);
+    cbar_input(&cbar, LINE_MOTION, 7);
+    cbar_input(&cbar, LINE_SPEED, 1234);
+    cbar_recalculate(&cbar, 100);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_IDLING), false);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_ACTIVE), true);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_STOPPED), false);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_PARKED), false);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_SHOWN), 1234);
+
+    /* more lines than fit in a word, on one level */
+    logic_wide_configs[0] = (struct cbar_line_config) { "a", CBAR_INPUT };
+    logic_wide_configs[1] = (struct cbar_line_config) { "b", CBAR_INPUT };
+    for (int i=0; i<LOGIC_WIDE; i++) {
+        int *inputs = logic_wide_inputs[i];
+        inputs[0] = i % 2;
+        inputs[1] = i % 5 ? 1 - i % 2 : -1;
+        inputs[2] = -1;
+        logic_wide_configs[2+i] = (struct cbar_line_config) { "wide", CBAR_LOGIC,
+            .logic = { (enum cbar_logic_op) (CBAR_AND + i % 3), inputs } };
+    }
+    CBAR_DECLARE(wide, logic_wide_configs);
+    CBAR_INIT(wide, logic_wide_configs);
+    for (int a=0; a<2; a++) {
+        for (int b=0; b<2; b++) {
+            cbar_input(&wide, 0, a);
+            cbar_input(&wide, 1, b);
+            cbar_recalculate(&wide, 0);
+            for (int i=0; i<LOGIC_WIDE; i++) {
+                int first = i % 2 ? b : a, second = i % 2 ? a : b;
+                bool pair = i % 5;
+                int expected =
+                    i % 3 == 0 ? (first && (!pair || second)) :
+                    i % 3 == 1 ? (first || (pair && second)) :
+                                 !(first || (pair && second));
+                ck_assert_int_eq(cbar_value(&wide, 2+i), expected);
+            }
+        }
+    }
+}
+END_TEST
+
+/****************************************************************************/
+
+START_TEST(test_cbar_filter)
+{
+    enum lines {
+        IN_LEVEL,
+        LINE_AVERAGE,
+        LINE_SMOOTH,
+        LINE_MEDIAN,
+        LINE_ALARM,
+    };
+    const struct cbar_line_config configs[] = {
+        { "level",   CBAR_INPUT },
+        { "average", CBAR_FILTER, .filter = { IN_LEVEL, CBAR_AVERAGE, 4 } },
+        { "smooth",  CBAR_FILTER, .filter = { IN_LEVEL, CBAR_EXPONENTIAL, 2 } },
+        { "median",  CBAR_FILTER, .filter = { IN_LEVEL, CBAR_MEDIAN, 3 } },
+        { "alarm",   CBAR_THRESHOLD, .threshold = { LINE_MEDIAN, 50, 40 } },
+        { NULL }
+    };
+    static const int samples[][4] = {
+        /* level, average, smooth, median */
+        {  10,  10,  10,  10 },
+        {  20,  15,  13,  10 },     /* lower middle until the window fills */
+        {  30,  20,  17,  20 },
+        { 100,  40,  38,  30 },     /* a spike doesn't get past the median */
+        {  30,  45,  36,  30 },
+        {  30,  48,  34,  30 },     /* filters move on unchanged input too */
+    };
+
+    CBAR_DECLARE(cbar, configs);
+    CBAR_INIT(cbar, configs);
+    CBAR_FILTER_DECLARE(cbar, CBAR_FILTER_SIZE(4) + CBAR_FILTER_SIZE(0) + CBAR_FILTER_SIZE(3));
+
+    /* held at zero until started, and so is everything reading them */
+    cbar_input(&cbar, IN_LEVEL, 70);
+    cbar_recalculate(&cbar, 0);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_AVERAGE), 0);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_SMOOTH), 0);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_MEDIAN), 0);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_ALARM), false);
+
+    ck_assert_int_eq(CBAR_FILTER_START(cbar), 0);
+    for (size_t i=0; i<sizeof(samples)/sizeof(samples[0]); i++) {
+        cbar_input(&cbar, IN_LEVEL, samples[i][0]);
+        cbar_recalculate(&cbar, 10);
+        ck_assert_int_eq(cbar_value(&cbar, LINE_AVERAGE), samples[i][1]);
+        ck_assert_int_eq(cbar_value(&cbar, LINE_SMOOTH), samples[i][2]);
+        ck_assert_int_eq(cbar_value(&cbar, LINE_MEDIAN), samples[i][3]);
+        ck_assert_int_eq(cbar_value(&cbar, LINE_ALARM), false);
+    }
+
+    /* windows that don't fit */
+    CBAR_DECLARE(twin, configs);
+    CBAR_INIT(twin, configs);
+    CBAR_FILTER_DECLARE(twin, CBAR_FILTER_SIZE(3));
+    errno = 0;
+    ck_assert_int_eq(CBAR_FILTER_START(twin), -1);
+    ck_assert_int_eq(errno, ENOSPC);
+    cbar_input(&twin, IN_LEVEL, 70);
+    cbar_recalculate(&twin, 0);
+    ck_assert_int_eq(cbar_value(&twin, LINE_SMOOTH), 0);
+    ck_assert_int_eq(cbar_value(&twin, LINE_ALARM), false);
+}
+END_TEST
+
 /****************************************************************************/
 
 static int temperature;
@@ -476,6 +808,1376 @@ END_TEST
 
 /****************************************************************************/
 
+static int speed;
+static int calculate_speed(struct cbar *cbar)
+{
+    return speed;
+}
+
+START_TEST(test_cbar_incremental)
+{
+    enum lines {
+        LINE_IN0,
+        LINE_REQUEST,
+        LINE_SPEED,
+        LINE_DEBOUNCE,
+        LINE_MONITOR_REQUEST,
+        LINE_MONITOR_DEBOUNCE,
+        LINE_MOVING,
+    };
+    static const struct cbar_line_config configs[] = {
+        { "in0",              CBAR_INPUT },
+        { "request",          CBAR_REQUEST },
+        { "speed",            CBAR_CALCULATED, .calculated = { calculate_speed } },
+        { "debounce",         CBAR_DEBOUNCE, .debounce = { LINE_IN0, 1000, 1000 } },
+        { "monitor_request",  CBAR_MONITOR, .monitor = { LINE_REQUEST } },
+        { "monitor_debounce", CBAR_MONITOR, .monitor = { LINE_DEBOUNCE } },
+        { "moving",           CBAR_THRESHOLD, .threshold = { LINE_SPEED, 10, 5 } },
+        { NULL }
+    };
+
+    CBAR_DECLARE(cbar, configs);
+    speed = 0;
+    CBAR_INIT(cbar, configs);
+    cbar_pending(&cbar, LINE_MONITOR_REQUEST);
+    cbar_pending(&cbar, LINE_MONITOR_DEBOUNCE);
+
+    /* quiet ticks don't fire anything */
+    cbar_recalculate(&cbar, 100);
+    ck_assert_int_eq(cbar_pending(&cbar, LINE_MONITOR_REQUEST), false);
+    ck_assert_int_eq(cbar_pending(&cbar, LINE_MONITOR_DEBOUNCE), false);
+
+    /* debounce timer keeps running with no further input changes */
+    cbar_input(&cbar, LINE_IN0, true);
+    cbar_recalculate(&cbar, 0);
+    cbar_recalculate(&cbar, 500);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_DEBOUNCE), false);
+    cbar_recalculate(&cbar, 500);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_DEBOUNCE), true);
+    ck_assert_int_eq(cbar_pending(&cbar, LINE_MONITOR_DEBOUNCE), true);
+
+    /* posting and consuming a request are changes too */
+    cbar_post(&cbar, LINE_REQUEST);
+    cbar_recalculate(&cbar, 100);
+    ck_assert_int_eq(cbar_pending(&cbar, LINE_MONITOR_REQUEST), true);
+    ck_assert_int_eq(cbar_pending(&cbar, LINE_REQUEST), true);
+    cbar_recalculate(&cbar, 100);
+    ck_assert_int_eq(cbar_pending(&cbar, LINE_MONITOR_REQUEST), true);
+
+    /* calculated lines are polled, so their dependents follow them */
+    speed = 20;
+    cbar_recalculate(&cbar, 100);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_MOVING), true);
+    speed = 0;
+    cbar_recalculate(&cbar, 100);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_MOVING), false);
+}
+END_TEST
+
+/****************************************************************************/
+
+START_TEST(test_cbar_order)
+{
+    enum lines {
+        LINE_MONITOR,
+        LINE_DEBOUNCE,
+        LINE_THRESHOLD,
+        LINE_VOLTAGE,
+    };
+    static const struct cbar_line_config configs[] = {
+        { "monitor",   CBAR_MONITOR, .monitor = { LINE_DEBOUNCE } },
+        { "debounce",  CBAR_DEBOUNCE, .debounce = { LINE_THRESHOLD, 0, 0 } },
+        { "threshold", CBAR_THRESHOLD, .threshold = { LINE_VOLTAGE, 1000, 1000 } },
+        { "voltage",   CBAR_INPUT },
+        { NULL }
+    };
+
+    CBAR_DECLARE(cbar, configs);
+    ck_assert_int_eq(CBAR_INIT(cbar, configs), 0);
+    ck_assert_int_eq(cbar_pending(&cbar, LINE_MONITOR), true);
+
+    /* backward references propagate in a single recalculation */
+    cbar_input(&cbar, LINE_VOLTAGE, 1200);
+    cbar_recalculate(&cbar, 0);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_THRESHOLD), true);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_DEBOUNCE), true);
+    ck_assert_int_eq(cbar_pending(&cbar, LINE_MONITOR), true);
+
+    cbar_input(&cbar, LINE_VOLTAGE, 800);
+    cbar_recalculate(&cbar, 0);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_DEBOUNCE), false);
+    ck_assert_int_eq(cbar_pending(&cbar, LINE_MONITOR), true);
+}
+END_TEST
+
+START_TEST(test_cbar_cycle)
+{
+    enum lines {
+        LINE_VOLTAGE,
+        LINE_A,
+        LINE_B,
+        LINE_C,
+    };
+    static const struct cbar_line_config configs[] = {
+        { "voltage", CBAR_INPUT },
+        { "a",       CBAR_THRESHOLD, .threshold = { LINE_C, 1, 1 } },
+        { "b",       CBAR_DEBOUNCE, .debounce = { LINE_A, 0, 0 } },
+        { "c",       CBAR_THRESHOLD, .threshold = { LINE_B, 1, 1 } },
+        { NULL }
+    };
+
+    CBAR_DECLARE(cbar, configs);
+
+    /* lines reading each other can't be ordered */
+    errno = 0;
+    ck_assert_int_eq(CBAR_INIT(cbar, configs), -1);
+    ck_assert_int_eq(errno, ELOOP);
+}
+END_TEST
+
+/****************************************************************************/
+
+START_TEST(test_cbar_nonblocking)
+{
+    enum lines {
+        LINE_IN0,
+        LINE_REQUEST,
+        LINE_MONITOR,
+    };
+    static const struct cbar_line_config configs[] = {
+        { "in0",     CBAR_INPUT },
+        { "request", CBAR_REQUEST },
+        { "monitor", CBAR_MONITOR, .monitor = { LINE_IN0 } },
+        { NULL }
+    };
+
+    CBAR_DECLARE(cbar, configs);
+    CBAR_INIT(cbar, configs);
+
+    /* pretend a recalculation is in progress; none of these may block */
+    pthread_mutex_lock(&cbar.mutex);
+    cbar_input(&cbar, LINE_IN0, 42);
+    cbar_post(&cbar, LINE_REQUEST);
+    ck_assert_int_eq(cbar_pending(&cbar, LINE_REQUEST), true);
+    ck_assert_int_eq(cbar_pending(&cbar, LINE_MONITOR), true);
+    ck_assert_int_eq(cbar_pending(&cbar, LINE_MONITOR), false);
+    pthread_mutex_unlock(&cbar.mutex);
+
+    /* changes made meanwhile are picked up by the next recalculation */
+    cbar_recalculate(&cbar, 0);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_IN0), 42);
+    ck_assert_int_eq(cbar_pending(&cbar, LINE_MONITOR), true);
+}
+END_TEST
+
+/****************************************************************************/
+
+static void *post_later(void *arg)
+{
+    struct cbar *cbar = arg;
+    usleep(50000);
+    cbar_post(cbar, 0);
+    return NULL;
+}
+
+START_TEST(test_cbar_wait)
+{
+    enum lines {
+        LINE_REQUEST,
+        LINE_IN0,
+        LINE_MONITOR,
+    };
+    static const struct cbar_line_config configs[] = {
+        { "request", CBAR_REQUEST },
+        { "in0",     CBAR_INPUT },
+        { "monitor", CBAR_MONITOR, .monitor = { LINE_IN0 } },
+        { NULL }
+    };
+
+    CBAR_DECLARE(cbar, configs);
+    CBAR_INIT(cbar, configs);
+    int ids[4];
+
+    /* the initial monitor event is returned right away */
+    ck_assert_int_eq(cbar_wait(&cbar, ids, 4), 1);
+    ck_assert_int_eq(ids[0], LINE_MONITOR);
+
+    /* nothing pending: time out */
+    ck_assert_int_eq(cbar_wait_timeout(&cbar, ids, 4, 10), 0);
+
+    /* recalculation raising a monitor */
+    cbar_input(&cbar, LINE_IN0, 1);
+    cbar_recalculate(&cbar, 0);
+    ck_assert_int_eq(cbar_wait_timeout(&cbar, ids, 4, 10), 1);
+    ck_assert_int_eq(ids[0], LINE_MONITOR);
+    ck_assert_int_eq(cbar_pending(&cbar, LINE_MONITOR), false);
+
+    /* wake up when a request is posted from another thread */
+    pthread_t thread;
+    pthread_create(&thread, NULL, post_later, &cbar);
+    ck_assert_int_eq(cbar_wait_timeout(&cbar, ids, 4, 5000), 1);
+    ck_assert_int_eq(ids[0], LINE_REQUEST);
+    pthread_join(thread, NULL);
+
+    /* with nobody waiting, posting doesn't touch the wait lock */
+    pthread_mutex_lock(&cbar.wait_mutex);
+    cbar_post(&cbar, LINE_REQUEST);
+    pthread_mutex_unlock(&cbar.wait_mutex);
+    ck_assert_int_eq(cbar_wait_timeout(&cbar, ids, 4, 0), 1);
+    ck_assert_int_eq(ids[0], LINE_REQUEST);
+}
+END_TEST
+
+#define DRAIN_MONITORS 200
+
+static struct cbar_line_config drain_configs[2*DRAIN_MONITORS+2];
+
+static void drain_fire(struct cbar *cbar, const int *ids, int n)
+{
+    for (int i=0; i<n; i++)
+        cbar_input(cbar, ids[i], !cbar_value(cbar, ids[i]));
+    cbar_recalculate(cbar, 0);
+}
+
+START_TEST(test_cbar_pending_drain)
+{
+    enum { LINE_REQUEST = 2*DRAIN_MONITORS };
+    for (int i=0; i<DRAIN_MONITORS; i++) {
+        drain_configs[i] = (struct cbar_line_config) { "in", CBAR_INPUT };
+        drain_configs[DRAIN_MONITORS+i] = (struct cbar_line_config) { "monitor", CBAR_MONITOR, .monitor = { i } };
+    }
+    drain_configs[LINE_REQUEST] = (struct cbar_line_config) { "request", CBAR_REQUEST };
+
+    CBAR_DECLARE(cbar, drain_configs);
+    CBAR_INIT(cbar, drain_configs);
+    int ids[2*DRAIN_MONITORS];
+
+    /* initial monitor events, a bounded number at a time */
+    ck_assert_int_eq(cbar_pending_drain(&cbar, ids, 128), 128);
+    ck_assert_int_eq(ids[0], DRAIN_MONITORS);
+    ck_assert_int_eq(cbar_pending_drain(&cbar, ids, 128), DRAIN_MONITORS-128);
+    ck_assert_int_eq(ids[DRAIN_MONITORS-129], 2*DRAIN_MONITORS-1);
+    ck_assert_int_eq(cbar_pending_drain(&cbar, ids, 128), 0);
+
+    /* without a queue, lines come in ID order */
+    drain_fire(&cbar, (const int []) { 150 }, 1);
+    drain_fire(&cbar, (const int []) { 3, 70 }, 2);
+    cbar_post(&cbar, LINE_REQUEST);
+    ck_assert_int_eq(cbar_pending_drain(&cbar, ids, 8), 4);
+    ck_assert_int_eq(ids[0], DRAIN_MONITORS+3);
+    ck_assert_int_eq(ids[1], DRAIN_MONITORS+70);
+    ck_assert_int_eq(ids[2], DRAIN_MONITORS+150);
+    ck_assert_int_eq(ids[3], LINE_REQUEST);
+
+    /* lines cleared with cbar_pending() aren't returned again */
+    drain_fire(&cbar, (const int []) { 3, 5 }, 2);
+    ck_assert_int_eq(cbar_pending(&cbar, DRAIN_MONITORS+3), true);
+    ck_assert_int_eq(cbar_pending_drain(&cbar, ids, 8), 1);
+    ck_assert_int_eq(ids[0], DRAIN_MONITORS+5);
+
+    /* with a queue, they come in the order they were raised */
+    CBAR_DECLARE(queued, drain_configs);
+    CBAR_QUEUE_DECLARE(queued, 4);
+    CBAR_INIT(queued, drain_configs);
+    CBAR_QUEUE_START(queued);
+    ck_assert_int_eq(cbar_pending_drain(&queued, ids, 2*DRAIN_MONITORS), DRAIN_MONITORS);
+    drain_fire(&queued, (const int []) { 150 }, 1);
+    cbar_post(&queued, LINE_REQUEST);
+    drain_fire(&queued, (const int []) { 3 }, 1);
+    ck_assert_int_eq(cbar_pending_drain(&queued, ids, 8), 3);
+    ck_assert_int_eq(ids[0], DRAIN_MONITORS+150);
+    ck_assert_int_eq(ids[1], LINE_REQUEST);
+    ck_assert_int_eq(ids[2], DRAIN_MONITORS+3);
+
+    /* and when it fills up, the bitmap catches the rest */
+    drain_fire(&queued, (const int []) { 1, 2, 3, 4, 5, 6 }, 6);
+    ck_assert_int_eq(cbar_pending_drain(&queued, ids, 5), 5);
+    ck_assert_int_eq(cbar_pending_drain(&queued, ids+5, 8), 1);
+    for (int i=0; i<6; i++)
+        ck_assert_int_eq(ids[i], DRAIN_MONITORS+1+i);
+    ck_assert_int_eq(cbar_pending_drain(&queued, ids, 8), 0);
+}
+END_TEST
+
+/****************************************************************************/
+
+START_TEST(test_cbar_next_deadline)
+{
+    enum lines {
+        LINE_IN0,
+        LINE_DEBOUNCE,
+        LINE_TICK,
+    };
+    static const struct cbar_line_config configs[] = {
+        { "in0",      CBAR_INPUT },
+        { "debounce", CBAR_DEBOUNCE, .debounce = { LINE_IN0, 300, 700 } },
+        { "tick",     CBAR_PERIODIC, .periodic = { 1000 } },
+        { NULL }
+    };
+
+    CBAR_DECLARE(cbar, configs);
+    CBAR_INIT(cbar, configs);
+
+    /* only the periodic timer is running */
+    ck_assert_int_eq(cbar_next_deadline(&cbar), 1000);
+    cbar_recalculate(&cbar, 400);
+    ck_assert_int_eq(cbar_next_deadline(&cbar), 600);
+
+    /* debouncer starts counting once it sees the change */
+    cbar_input(&cbar, LINE_IN0, true);
+    cbar_recalculate(&cbar, 0);
+    ck_assert_int_eq(cbar_next_deadline(&cbar), 300);
+    cbar_recalculate(&cbar, cbar_next_deadline(&cbar));
+    ck_assert_int_eq(cbar_value(&cbar, LINE_DEBOUNCE), true);
+
+    /* back to the periodic timer; sleeping exactly that long fires it */
+    ck_assert_int_eq(cbar_next_deadline(&cbar), 300);
+    cbar_recalculate(&cbar, cbar_next_deadline(&cbar));
+    ck_assert_int_eq(cbar_pending(&cbar, LINE_TICK), true);
+    ck_assert_int_eq(cbar_next_deadline(&cbar), 1000);
+
+    /* going down uses the other timeout */
+    cbar_input(&cbar, LINE_IN0, false);
+    cbar_recalculate(&cbar, 0);
+    ck_assert_int_eq(cbar_next_deadline(&cbar), 700);
+
+    /* sampled lines are due too, unless the sampler thread reads them */
+    static const struct cbar_line_config sampled_configs[] = {
+        { "tick", CBAR_PERIODIC, .periodic = { 1000 } },
+        { "adc",  CBAR_EXTERNAL, .external = { gpio_get, GPIO_IN0, false, 150 } },
+        { NULL }
+    };
+    CBAR_DECLARE(sampled, sampled_configs);
+    CBAR_SAMPLER_DECLARE(sampled);
+    CBAR_INIT(sampled, sampled_configs);
+    ck_assert_int_eq(cbar_next_deadline(&sampled), 150);
+    gpio_set(GPIO_IN0, true);
+    cbar_recalculate(&sampled, 100);
+    ck_assert_int_eq(cbar_next_deadline(&sampled), 50);
+    ck_assert_int_eq(cbar_value(&sampled, 1), 0);
+    cbar_recalculate(&sampled, cbar_next_deadline(&sampled));
+    ck_assert_int_eq(cbar_value(&sampled, 1), 1);
+    ck_assert_int_eq(cbar_next_deadline(&sampled), 150);
+    ck_assert_int_eq(CBAR_SAMPLER_START(sampled), 0);
+    ck_assert_int_eq(cbar_next_deadline(&sampled), 850);
+    cbar_sampler_stop(&sampled);
+    gpio_set(GPIO_IN0, false);
+}
+END_TEST
+
+/****************************************************************************/
+
+START_TEST(test_cbar_input_batch)
+{
+    enum lines {
+        LINE_SPEED,
+        LINE_RPM,
+        LINE_MONITOR_SPEED,
+        LINE_MONITOR_RPM,
+    };
+    static const struct cbar_line_config configs[] = {
+        { "speed",         CBAR_INPUT },
+        { "rpm",           CBAR_INPUT },
+        { "monitor_speed", CBAR_MONITOR, .monitor = { LINE_SPEED } },
+        { "monitor_rpm",   CBAR_MONITOR, .monitor = { LINE_RPM } },
+        { NULL }
+    };
+    static const int ids[] = { LINE_SPEED, LINE_RPM };
+
+    CBAR_DECLARE(cbar, configs);
+    CBAR_INIT(cbar, configs);
+    cbar_pending(&cbar, LINE_MONITOR_SPEED);
+    cbar_pending(&cbar, LINE_MONITOR_RPM);
+
+    /* batches take effect on the next recalculation, like single inputs */
+    cbar_input_batch(&cbar, ids, (const int[]) { 50, 2000 }, 2);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_SPEED), 0);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_RPM), 0);
+    cbar_recalculate(&cbar, 100);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_SPEED), 50);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_RPM), 2000);
+    ck_assert_int_eq(cbar_pending(&cbar, LINE_MONITOR_SPEED), true);
+    ck_assert_int_eq(cbar_pending(&cbar, LINE_MONITOR_RPM), true);
+
+    /* apply and recalculate at once; unchanged values don't fire */
+    cbar_recalculate_batch(&cbar, ids, (const int[]) { 50, 2500 }, 2, 100);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_RPM), 2500);
+    ck_assert_int_eq(cbar_pending(&cbar, LINE_MONITOR_SPEED), false);
+    ck_assert_int_eq(cbar_pending(&cbar, LINE_MONITOR_RPM), true);
+
+    /* empty batches are fine */
+    cbar_recalculate_batch(&cbar, NULL, NULL, 0, 100);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_SPEED), 50);
+}
+END_TEST
+
+/****************************************************************************/
+
+START_TEST(test_cbar_dump)
+{
+    enum lines {
+        LINE_MONITOR,
+        LINE_THRESHOLD,
+        LINE_VOLTAGE,
+    };
+    static const struct cbar_line_config configs[] = {
+        { "monitor",   CBAR_MONITOR, .monitor = { LINE_THRESHOLD } },
+        { "threshold", CBAR_THRESHOLD, .threshold = { LINE_VOLTAGE, 1000, 1000 } },
+        { "voltage",   CBAR_INPUT },
+        { NULL }
+    };
+
+    CBAR_DECLARE(cbar, configs);
+    CBAR_INIT(cbar, configs);
+    cbar_input(&cbar, LINE_VOLTAGE, 1234);
+    cbar_recalculate(&cbar, 0);
+
+    /* lines are listed in declaration order, whatever the evaluation order */
+    char *buf;
+    size_t size;
+    FILE *stream = open_memstream(&buf, &size);
+    cbar_dump(stream, &cbar);
+    fclose(stream);
+    ck_assert_str_eq(buf,
+        "cbar: monitor = 1\r\n"
+        "cbar: threshold = 1\r\n"
+        "cbar: voltage = 1234\r\n");
+    free(buf);
+}
+END_TEST
+
+#define LOOKUP_LINES 50000
+
+static struct cbar_line_config lookup_configs[LOOKUP_LINES+1];
+static char lookup_names[LOOKUP_LINES][16];
+CBAR_DECLARE(lookup_cbar, lookup_configs);
+CBAR_INDEX_DECLARE(lookup_cbar, lookup_configs);
+
+START_TEST(test_cbar_lookup)
+{
+    enum lines {
+        LINE_MONITOR,
+        LINE_THRESHOLD,
+        LINE_VOLTAGE,
+        LINE_UNNAMED,
+    };
+    static const struct cbar_line_config configs[] = {
+        { "monitor",   CBAR_MONITOR, .monitor = { LINE_THRESHOLD } },
+        { "threshold", CBAR_THRESHOLD, .threshold = { LINE_VOLTAGE, 1000, 1000 } },
+        { "voltage",   CBAR_INPUT },
+        { NULL,        CBAR_INPUT },
+        { NULL }
+    };
+
+    CBAR_DECLARE(cbar, configs);
+    CBAR_INDEX_DECLARE(cbar, configs);
+    CBAR_INIT(cbar, configs);
+    ck_assert_int_eq(CBAR_INDEX_BUILD(cbar), 0);
+    ck_assert_int_eq(cbar_lookup(&cbar, "monitor"), LINE_MONITOR);
+    ck_assert_int_eq(cbar_lookup(&cbar, "threshold"), LINE_THRESHOLD);
+    ck_assert_int_eq(cbar_lookup(&cbar, "voltage"), LINE_VOLTAGE);
+    ck_assert_int_eq(cbar_lookup(&cbar, "volt"), -1);
+    ck_assert_int_eq(cbar_lookup(&cbar, ""), -1);
+
+    /* named variants */
+    int value = -1;
+    ck_assert_int_eq(cbar_input_named(&cbar, "voltage", 1234), 0);
+    cbar_recalculate(&cbar, 0);
+    ck_assert_int_eq(cbar_value_named(&cbar, "threshold", &value), 0);
+    ck_assert_int_eq(value, 1);
+    ck_assert_int_eq(cbar_value_named(&cbar, "current", &value), -1);
+    ck_assert_int_eq(errno, ENOENT);
+    ck_assert_int_eq(cbar_input_named(&cbar, "threshold", 0), -1);
+    ck_assert_int_eq(errno, ENOENT);
+
+    /* names must be unique */
+    static const struct cbar_line_config twins[] = {
+        { "voltage", CBAR_INPUT },
+        { "current", CBAR_INPUT },
+        { "voltage", CBAR_INPUT },
+        { NULL }
+    };
+    CBAR_DECLARE(twin, twins);
+    CBAR_INDEX_DECLARE(twin, twins);
+    CBAR_INIT(twin, twins);
+    ck_assert_int_eq(CBAR_INDEX_BUILD(twin), -1);
+    ck_assert_int_eq(errno, EEXIST);
+
+    /* every line of a big graph is found */
+    for (int i=0; i<LOOKUP_LINES; i++) {
+        snprintf(lookup_names[i], sizeof(lookup_names[i]), "line%d", i);
+        lookup_configs[i] = (struct cbar_line_config) { lookup_names[i], CBAR_INPUT };
+    }
+    CBAR_INIT(lookup_cbar, lookup_configs);
+    ck_assert_int_eq(CBAR_INDEX_BUILD(lookup_cbar), 0);
+    for (int i=0; i<LOOKUP_LINES; i++)
+        ck_assert_int_eq(cbar_lookup(&lookup_cbar, lookup_names[i]), i);
+    ck_assert_int_eq(cbar_lookup(&lookup_cbar, "line50000"), -1);
+}
+END_TEST
+
+/* The image checksum: FNV-1a over native 64-bit words. */
+static uint64_t image_checksum(const char *data, size_t size)
+{
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+    for (size_t i=0; i<size; i+=8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * UINT64_C(0x100000001b3);
+    }
+    return hash;
+}
+
+START_TEST(test_cbar_image)
+{
+    enum lines {
+        LINE_MONITOR,
+        LINE_DEBOUNCE,
+        LINE_THRESHOLD,
+        LINE_VOLTAGE,
+    };
+    static const struct cbar_line_config configs[] = {
+        { "monitor",   CBAR_MONITOR, .monitor = { LINE_DEBOUNCE } },
+        { "debounce",  CBAR_DEBOUNCE, .debounce = { LINE_THRESHOLD, 100, 100 } },
+        { "threshold", CBAR_THRESHOLD, .threshold = { LINE_VOLTAGE, 1000, 1000 } },
+        { "voltage",   CBAR_INPUT },
+        { NULL }
+    };
+
+    /* build step */
+    CBAR_DECLARE(built, configs);
+    CBAR_INDEX_DECLARE(built, configs);
+    CBAR_INIT(built, configs);
+    ck_assert_int_eq(CBAR_INDEX_BUILD(built), 0);
+    char *buf;
+    size_t size;
+    FILE *stream = open_memstream(&buf, &size);
+    ck_assert_int_eq(cbar_image_write(stream, &built), 0);
+    fclose(stream);
+    ck_assert_int_eq(size % 8, 0);
+
+    /* boot from the image */
+    CBAR_DECLARE(cbar, configs);
+    ck_assert_int_eq(CBAR_INIT_IMAGE(cbar, configs, buf, size), 0);
+    ck_assert_int_eq(cbar_lookup(&cbar, "threshold"), LINE_THRESHOLD);
+    ck_assert_int_eq(cbar_lookup(&cbar, "current"), -1);
+    ck_assert(cbar_pending(&cbar, LINE_MONITOR));
+    cbar_input(&cbar, LINE_VOLTAGE, 1500);
+    cbar_recalculate(&cbar, 0);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_THRESHOLD), 1);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_DEBOUNCE), 0);
+    cbar_recalculate(&cbar, 100);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_DEBOUNCE), 1);
+    ck_assert(cbar_pending(&cbar, LINE_MONITOR));
+
+    /* the image doesn't match changed configs */
+    static const struct cbar_line_config changed[] = {
+        { "monitor",   CBAR_MONITOR, .monitor = { LINE_DEBOUNCE } },
+        { "debounce",  CBAR_DEBOUNCE, .debounce = { LINE_THRESHOLD, 100, 200 } },
+        { "threshold", CBAR_THRESHOLD, .threshold = { LINE_VOLTAGE, 1000, 1000 } },
+        { "voltage",   CBAR_INPUT },
+        { NULL }
+    };
+    CBAR_DECLARE(stale, changed);
+    ck_assert_int_eq(CBAR_INIT_IMAGE(stale, changed, buf, size), -1);
+    ck_assert_int_eq(errno, EINVAL);
+    ck_assert_int_eq(CBAR_INIT(stale, changed), 0);
+
+    /* nor is a truncated or corrupted one accepted */
+    ck_assert_int_eq(CBAR_INIT_IMAGE(cbar, configs, buf, size - 8), -1);
+    ck_assert_int_eq(errno, EINVAL);
+    buf[0] ^= 1;
+    ck_assert_int_eq(CBAR_INIT_IMAGE(cbar, configs, buf, size), -1);
+    ck_assert_int_eq(errno, EINVAL);
+    buf[0] ^= 1;
+    struct cbar_image *header = (struct cbar_image *) buf;
+    for (size_t bit=header->ops*8; bit<size*8; bit++) {
+        buf[bit/8] ^= 1 << bit%8;
+        ck_assert_int_eq(CBAR_INIT_IMAGE(cbar, configs, buf, size), -1);
+        ck_assert_int_eq(errno, EINVAL);
+        buf[bit/8] ^= 1 << bit%8;
+    }
+
+    /* a bad link is caught even under a matching checksum */
+    struct cbar_op *ops = (struct cbar_op *) (buf + header->ops);
+    int rank = ((const int *) (buf + header->ranks))[LINE_VOLTAGE];
+    int dependents = ops[rank].dependents;
+    ops[rank].dependents = 1 << 20;
+    header->checksum = image_checksum(buf + header->ops, size - header->ops);
+    ck_assert_int_eq(CBAR_INIT_IMAGE(cbar, configs, buf, size), -1);
+    ck_assert_int_eq(errno, EINVAL);
+    ops[rank].dependents = dependents;
+    header->checksum = image_checksum(buf + header->ops, size - header->ops);
+    ck_assert_int_eq(CBAR_INIT_IMAGE(cbar, configs, buf, size), 0);
+    ck_assert_int_eq(CBAR_INIT(cbar, configs), 0);
+    free(buf);
+
+    /* an image without a name index */
+    CBAR_DECLARE(plain, configs);
+    CBAR_INIT(plain, configs);
+    stream = open_memstream(&buf, &size);
+    ck_assert_int_eq(cbar_image_write(stream, &plain), 0);
+    fclose(stream);
+    CBAR_DECLARE(booted, configs);
+    if (CBAR_INIT_IMAGE(booted, configs, buf, size) != 0)
+        ck_assert_int_eq(CBAR_INIT(booted, configs), 0);
+    ck_assert(booted.ops != booted_ops);
+    cbar_input(&booted, LINE_VOLTAGE, 1500);
+    cbar_recalculate(&booted, 0);
+    ck_assert_int_eq(cbar_value(&booted, LINE_THRESHOLD), 1);
+    free(buf);
+}
+END_TEST
+
+static atomic_int export_running;
+static atomic_int export_torn;
+
+static void *export_read(void *arg)
+{
+    const struct cbar_shared_reader *reader = arg;
+    while (atomic_load(&export_running)) {
+        int values[2];
+        cbar_shared_read(reader, values, 2, NULL);
+        if (values[0] != values[1])
+            atomic_fetch_add(&export_torn, 1);
+    }
+    return NULL;
+}
+
+START_TEST(test_cbar_export)
+{
+    enum lines {
+        LINE_IN0,
+        LINE_IN1,
+        LINE_THRESHOLD,
+    };
+    static const struct cbar_line_config configs[] = {
+        { "in0",       CBAR_INPUT },
+        { "in1",       CBAR_INPUT },
+        { "threshold", CBAR_THRESHOLD, .threshold = { LINE_IN0, 10, 10 } },
+        { NULL }
+    };
+    char name[32];
+    snprintf(name, sizeof(name), "/cbar-test-%d", (int) getpid());
+
+    CBAR_DECLARE(cbar, configs);
+    CBAR_INIT(cbar, configs);
+    cbar_input(&cbar, LINE_IN0, 42);
+    cbar_recalculate(&cbar, 5);
+    ck_assert_int_eq(cbar_export_start(&cbar, name), 0);
+    struct cbar_shared_reader reader;
+    ck_assert_int_eq(cbar_shared_open(&reader, name), 0);
+
+    /* one export at a time */
+    char other[40];
+    snprintf(other, sizeof(other), "%s-other", name);
+    errno = 0;
+    ck_assert_int_eq(cbar_export_start(&cbar, other), -1);
+    ck_assert_int_eq(errno, EBUSY);
+    ck_assert_int_eq(shm_unlink(other), -1);
+
+    /* the current state is exported right away */
+    int values[4] = { -1, -1, -1, -1 };
+    unsigned long time;
+    ck_assert_int_eq(cbar_shared_read(&reader, values, 4, &time), 3);
+    ck_assert_int_eq(values[LINE_IN0], 42);
+    ck_assert_int_eq(values[LINE_IN1], 0);
+    ck_assert_int_eq(values[LINE_THRESHOLD], 1);
+    ck_assert_int_eq(values[3], -1);
+    ck_assert_int_eq(time, 5);
+
+    /* and then after every recalculation */
+    unsigned sequence = cbar_shared_begin(&reader);
+    cbar_input(&cbar, LINE_IN0, 7);
+    cbar_recalculate(&cbar, 5);
+    ck_assert(cbar_shared_retry(&reader, sequence));
+    sequence = cbar_shared_begin(&reader);
+    ck_assert_int_eq(cbar_shared_value(&reader, LINE_IN0), 7);
+    ck_assert_int_eq(cbar_shared_value(&reader, LINE_THRESHOLD), 0);
+    ck_assert(!cbar_shared_retry(&reader, sequence));
+
+    /* lines changed in one recalculation are never seen apart */
+    cbar_input(&cbar, LINE_IN1, 7);
+    cbar_recalculate(&cbar, 5);
+    pthread_t thread;
+    atomic_store(&export_running, 1);
+    pthread_create(&thread, NULL, export_read, &reader);
+    for (int i=0; i<20000; i++) {
+        static const int ids[] = { LINE_IN0, LINE_IN1 };
+        const int inputs[] = { i, i };
+        cbar_recalculate_batch(&cbar, ids, inputs, 2, 1);
+    }
+    atomic_store(&export_running, 0);
+    pthread_join(thread, NULL);
+    ck_assert_int_eq(atomic_load(&export_torn), 0);
+
+    /* readers keep the last values */
+    cbar_export_stop(&cbar);
+    struct cbar_shared_reader gone;
+    ck_assert_int_eq(cbar_shared_open(&gone, name), -1);
+    ck_assert_int_eq(errno, ENOENT);
+    ck_assert_int_eq(cbar_shared_value(&reader, LINE_IN1), 19999);
+    cbar_shared_close(&reader);
+
+    /* objects too short for the lines they claim to have are refused */
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    ck_assert_int_ne(fd, -1);
+    struct cbar_shared header = { .count = 1000 };
+    ck_assert_int_eq(write(fd, &header, sizeof(header)), sizeof(header));
+    close(fd);
+    errno = 0;
+    ck_assert_int_eq(cbar_shared_open(&gone, name), -1);
+    ck_assert_int_eq(errno, EINVAL);
+    shm_unlink(name);
+}
+END_TEST
+
+START_TEST(test_cbar_snapshot)
+{
+    enum lines {
+        LINE_IN0,
+        LINE_IN1,
+        LINE_IN2,
+    };
+    static const struct cbar_line_config configs[] = {
+        { "in0", CBAR_INPUT },
+        { "in1", CBAR_INPUT },
+        { "in2", CBAR_INPUT },
+        { NULL }
+    };
+
+    CBAR_DECLARE(cbar, configs);
+    CBAR_INIT(cbar, configs);
+    CBAR_SNAPSHOT_DECLARE(encoder, CBAR_COUNT(configs));
+    CBAR_SNAPSHOT_INIT(encoder);
+    CBAR_SNAPSHOT_DECLARE(decoder, CBAR_COUNT(configs));
+    CBAR_SNAPSHOT_INIT(decoder);
+    uint8_t buf[64];
+    int size;
+
+    /* the first frame is a keyframe */
+    cbar_input(&cbar, LINE_IN0, 300);
+    cbar_recalculate(&cbar, 1000);
+    size = cbar_snapshot_encode(&cbar, &encoder, buf, sizeof(buf), false);
+    ck_assert_int_eq(size, 12);
+    ck_assert_int_eq(buf[0], 1);
+    ck_assert_int_eq(cbar_snapshot_decode(&decoder, buf, size), size);
+    ck_assert_int_eq(decoder_values[LINE_IN0], 300);
+    ck_assert_int_eq(decoder_values[LINE_IN1], 0);
+    ck_assert_int_eq(decoder.time, 1000);
+
+    /* deltas only carry changed lines */
+    cbar_input(&cbar, LINE_IN2, -1);
+    cbar_recalculate(&cbar, 10);
+    size = cbar_snapshot_encode(&cbar, &encoder, buf, sizeof(buf), false);
+    ck_assert_int_eq(size, 5);
+    ck_assert_int_eq(memcmp(buf, (const uint8_t []) { 0, 10, 3, 1, 0 }, 5), 0);
+
+    /* frames are only applied whole */
+    ck_assert_int_eq(cbar_snapshot_decode(&decoder, buf, size-1), 0);
+    ck_assert_int_eq(decoder_values[LINE_IN2], 0);
+    ck_assert_int_eq(cbar_snapshot_decode(&decoder, buf, size), size);
+    ck_assert_int_eq(decoder_values[LINE_IN2], -1);
+    ck_assert_int_eq(decoder.time, 1010);
+
+    /* frames stream back to back */
+    cbar_recalculate(&cbar, 10);
+    size = cbar_snapshot_encode(&cbar, &encoder, buf, sizeof(buf), false);
+    ck_assert_int_eq(size, 3);
+    cbar_input(&cbar, LINE_IN1, INT_MIN);
+    cbar_recalculate(&cbar, 10);
+    size += cbar_snapshot_encode(&cbar, &encoder, buf+size, sizeof(buf)-size, false);
+    int taken = cbar_snapshot_decode(&decoder, buf, size);
+    ck_assert_int_eq(taken, 3);
+    ck_assert_int_eq(cbar_snapshot_decode(&decoder, buf+taken, size-taken), size-taken);
+    ck_assert_int_eq(decoder_values[LINE_IN1], INT_MIN);
+    ck_assert_int_eq(decoder.time, 1030);
+
+    /* a frame that doesn't fit is dropped, and the next is a keyframe */
+    cbar_input(&cbar, LINE_IN0, 1);
+    cbar_recalculate(&cbar, 10);
+    ck_assert_int_eq(cbar_snapshot_encode(&cbar, &encoder, buf, 3, false), -1);
+    ck_assert_int_eq(errno, ENOBUFS);
+    size = cbar_snapshot_encode(&cbar, &encoder, buf, sizeof(buf), false);
+    ck_assert_int_eq(buf[0], 1);
+    ck_assert_int_eq(cbar_snapshot_decode(&decoder, buf, size), size);
+    for (int id=0; id<3; id++)
+        ck_assert_int_eq(decoder_values[id], cbar_value(&cbar, id));
+
+    /* deltas are refused until a keyframe comes */
+    CBAR_SNAPSHOT_DECLARE(late, CBAR_COUNT(configs));
+    CBAR_SNAPSHOT_INIT(late);
+    ck_assert_int_eq(cbar_snapshot_decode(&late, (const uint8_t []) { 0, 10, 0 }, 3), -1);
+    ck_assert_int_eq(errno, EINVAL);
+    /* and so is garbage */
+    ck_assert_int_eq(cbar_snapshot_decode(&late, (const uint8_t []) { 1, 3, 0, 4, 0, 0 }, 6), -1);
+    ck_assert_int_eq(errno, EINVAL);
+}
+END_TEST
+
+static int get_slowly(intptr_t priv)
+{
+    usleep(priv);
+    return 1;
+}
+
+START_TEST(test_cbar_profile)
+{
+    enum lines {
+        LINE_SLOW,
+        LINE_THRESHOLD,
+        LINE_VOLTAGE,
+    };
+    static const struct cbar_line_config configs[] = {
+        { "slow",      CBAR_EXTERNAL, .external = { get_slowly, 2000 } },
+        { "threshold", CBAR_THRESHOLD, .threshold = { LINE_VOLTAGE, 1000, 1000 } },
+        { "voltage",   CBAR_INPUT },
+        { NULL }
+    };
+
+    CBAR_DECLARE(cbar, configs);
+    CBAR_PROFILE_DECLARE(cbar, configs);
+    CBAR_INIT(cbar, configs);
+    CBAR_PROFILE_START(cbar);
+
+    /* the slow callback is charged to its line, and to the tick */
+    for (int i=0; i<3; i++)
+        cbar_recalculate(&cbar, 0);
+    ck_assert_int_eq(cbar_profile.tick.count, 3);
+    ck_assert_int_eq(cbar_profile.lines[LINE_SLOW].count, 3);
+    ck_assert(cbar_profile.lines[LINE_SLOW].max >= 2000000);
+    ck_assert(cbar_profile.lines[LINE_SLOW].total <= cbar_profile.locked.total);
+    ck_assert(cbar_profile.locked.total <= cbar_profile.tick.total);
+
+    /* only lines that were evaluated are counted */
+    ck_assert_int_eq(cbar_profile.lines[LINE_THRESHOLD].count, 0);
+    cbar_input(&cbar, LINE_VOLTAGE, 1234);
+    cbar_recalculate(&cbar, 0);
+    ck_assert_int_eq(cbar_profile.lines[LINE_VOLTAGE].count, 1);
+    ck_assert_int_eq(cbar_profile.lines[LINE_THRESHOLD].count, 1);
+
+    /* histograms add up */
+    unsigned long samples = 0;
+    for (int bucket=0; bucket<CBAR_PROFILE_BUCKETS; bucket++)
+        samples += cbar_profile.lines[LINE_SLOW].histogram[bucket];
+    ck_assert_int_eq(samples, 4);
+
+    char *buf;
+    size_t size;
+    FILE *stream = open_memstream(&buf, &size);
+    cbar_profile_dump(stream, &cbar);
+    fclose(stream);
+    ck_assert(strstr(buf, "cbar: [tick] count=4 ") == buf);
+    ck_assert(strstr(buf, "cbar: slow count=4 "));
+    ck_assert(strstr(buf, "cbar: threshold count=1 "));
+    free(buf);
+
+    /* results survive stopping */
+    cbar_profile_stop(&cbar);
+    cbar_recalculate(&cbar, 0);
+    ck_assert_int_eq(cbar_profile.tick.count, 4);
+    ck_assert_int_eq(cbar_profile.lines[LINE_SLOW].count, 4);
+}
+END_TEST
+
+START_TEST(test_cbar_trace)
+{
+    enum lines {
+        LINE_MONITOR,
+        LINE_DEBOUNCE,
+        LINE_IN,
+    };
+    static const struct cbar_line_config configs[] = {
+        { "monitor",  CBAR_MONITOR, .monitor = { LINE_DEBOUNCE } },
+        { "debounce", CBAR_DEBOUNCE, .debounce = { LINE_IN, 20, 20 } },
+        { "in",       CBAR_INPUT },
+        { NULL }
+    };
+
+    CBAR_DECLARE(cbar, configs);
+    CBAR_TRACE_DECLARE(cbar, 4);
+    CBAR_INIT(cbar, configs);
+    cbar_pending(&cbar, LINE_MONITOR);
+    CBAR_TRACE_START(cbar);
+
+    struct cbar_trace_event events[8];
+    ck_assert_int_eq(cbar_trace_read(&cbar, events, 8), 0);
+
+    /* transitions come out in order, stamped with the time */
+    cbar_input(&cbar, LINE_IN, 1);
+    cbar_recalculate(&cbar, 10);
+    cbar_recalculate(&cbar, 10);
+    cbar_recalculate(&cbar, 10);
+    ck_assert_int_eq(cbar_trace_read(&cbar, events, 8), 3);
+    ck_assert_int_eq(events[0].id, LINE_IN);
+    ck_assert_int_eq(events[0].previous, 0);
+    ck_assert_int_eq(events[0].value, 1);
+    ck_assert_int_eq(events[0].time, 10);
+    ck_assert_int_eq(events[1].id, LINE_DEBOUNCE);
+    ck_assert_int_eq(events[1].time, 30);
+    ck_assert_int_eq(events[2].id, LINE_MONITOR);
+    ck_assert_int_eq(events[2].value, 1);
+    ck_assert_int_eq(events[2].time, 30);
+
+    /* reading in pieces */
+    cbar_pending(&cbar, LINE_MONITOR);
+    cbar_input(&cbar, LINE_IN, 0);
+    cbar_recalculate(&cbar, 10);
+    cbar_recalculate(&cbar, 20);
+    ck_assert_int_eq(cbar_trace_read(&cbar, events, 1), 1);
+    ck_assert_int_eq(events[0].id, LINE_IN);
+    ck_assert_int_eq(events[0].previous, 1);
+    ck_assert_int_eq(events[0].value, 0);
+    ck_assert_int_eq(cbar_trace_read(&cbar, events, 8), 2);
+    ck_assert_int_eq(events[0].id, LINE_DEBOUNCE);
+    ck_assert_int_eq(events[0].time, 60);
+
+    /* a full buffer drops new transitions */
+    for (int i=0; i<6; i++) {
+        cbar_input(&cbar, LINE_IN, i % 2);
+        cbar_recalculate(&cbar, 0);
+    }
+    ck_assert_int_eq(cbar_trace_dropped(&cbar), 1);
+    ck_assert_int_eq(cbar_trace_read(&cbar, events, 8), 4);
+    ck_assert_int_eq(events[3].value, 0);
+    ck_assert_int_eq(cbar_trace_read(&cbar, events, 8), 0);
+
+    cbar_trace_stop(&cbar);
+    cbar_input(&cbar, LINE_IN, 0);
+    cbar_recalculate(&cbar, 0);
+    ck_assert_int_eq(cbar_trace_read(&cbar, events, 8), 0);
+}
+END_TEST
+
+static int sample;
+static int get_sample(intptr_t priv)
+{
+    return sample;
+}
+
+START_TEST(test_cbar_simulate)
+{
+    enum lines {
+        LINE_IN,
+        LINE_DEBOUNCE,
+        LINE_MONITOR,
+        LINE_ADC,
+        LINE_THRESHOLD,
+        LINE_PERIODIC,
+        LINE_SLOW,
+    };
+    static const struct cbar_line_config configs[] = {
+        { "in",        CBAR_INPUT },
+        { "debounce",  CBAR_DEBOUNCE, .debounce = { LINE_IN, 30, 50 } },
+        { "monitor",   CBAR_MONITOR, .monitor = { LINE_DEBOUNCE } },
+        { "adc",       CBAR_EXTERNAL, .external = { get_sample } },
+        { "threshold", CBAR_THRESHOLD, .threshold = { LINE_ADC, 600, 400 } },
+        { "periodic",  CBAR_PERIODIC, .periodic = { 250 } },
+        { "slow",      CBAR_DEBOUNCE, .debounce = { LINE_MONITOR, 7, 7 } },
+        { NULL }
+    };
+    static const char recording[] =
+        "# time id previous value\n"
+        "5 0 0 1\n"
+        "20 0 1 0\n"
+        "22 0 0 1\n"
+        "22 4 0 1\n"
+        "\n"
+        "100 3 0 700\n"
+        "130 3 700 500\n"
+        "131 3 500 300\n"
+        "400 0 1 0\n"
+        "430 0 0 1\n";
+
+    /* reference: tick every milisecond */
+    sample = 0;
+    CBAR_DECLARE(ref, configs);
+    CBAR_TRACE_DECLARE(ref, 64);
+    CBAR_INIT(ref, configs);
+    CBAR_TRACE_START(ref);
+    char *expected;
+    size_t expected_size;
+    FILE *output = open_memstream(&expected, &expected_size);
+    FILE *input = fmemopen((void *) recording, sizeof(recording) - 1, "r");
+    struct cbar_trace_event event;
+    int status = cbar_trace_scan(input, &event);
+    for (int t=1; t<=1000; t++) {
+        for (; status == 1 && (int) event.time <= t; status = cbar_trace_scan(input, &event)) {
+            if (event.id == LINE_IN)
+                cbar_input(&ref, LINE_IN, event.value);
+            else if (event.id == LINE_ADC)
+                sample = event.value;
+        }
+        cbar_recalculate(&ref, 1);
+        cbar_pending(&ref, LINE_MONITOR);
+        cbar_pending(&ref, LINE_PERIODIC);
+        struct cbar_trace_event events[64];
+        cbar_trace_write(output, events, cbar_trace_read(&ref, events, 64));
+    }
+    ck_assert_int_eq(status, 0);
+    fclose(input);
+    fclose(output);
+
+    /* simulation: same transitions */
+    sample = 0;
+    CBAR_DECLARE(cbar, configs);
+    CBAR_TRACE_DECLARE(cbar, 64);
+    CBAR_INIT(cbar, configs);
+    CBAR_TRACE_START(cbar);
+    char *actual;
+    size_t actual_size;
+    output = open_memstream(&actual, &actual_size);
+    input = fmemopen((void *) recording, sizeof(recording) - 1, "r");
+    ck_assert_int_eq(cbar_simulate(&cbar, input, output, 1000), 0);
+    fclose(input);
+    fclose(output);
+
+    ck_assert(strstr(expected, "22 0 0 1\n52 1 0 1\n52 2 0 1\n"));
+    ck_assert_str_eq(actual, expected);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_THRESHOLD), 0);
+    free(expected);
+    free(actual);
+
+    /* garbage in */
+    static const char garbage[] = "10 0 0 1\nbogus\n";
+    input = fmemopen((void *) garbage, sizeof(garbage) - 1, "r");
+    errno = 0;
+    ck_assert_int_eq(cbar_simulate(&cbar, input, NULL, 2000), -1);
+    ck_assert_int_eq(errno, EINVAL);
+    fclose(input);
+
+    /* a last record cut short, with no newline after it */
+    static const char truncated[] = "10 0 0 1\n20 0 1";
+    input = fmemopen((void *) truncated, sizeof(truncated) - 1, "r");
+    ck_assert_int_eq(cbar_trace_scan(input, &event), 1);
+    errno = 0;
+    ck_assert_int_eq(cbar_trace_scan(input, &event), -1);
+    ck_assert_int_eq(errno, EINVAL);
+    fclose(input);
+
+    /* long comments and CRLF blank lines are skipped */
+    char annotated[512];
+    snprintf(annotated, sizeof(annotated), "#%0200d\n10 0 0 1\r\n\r\n  \t\r\n20 0 1 0\r\n", 0);
+    input = fmemopen(annotated, strlen(annotated), "r");
+    ck_assert_int_eq(cbar_trace_scan(input, &event), 1);
+    ck_assert_int_eq(event.time, 10);
+    ck_assert_int_eq(event.value, 1);
+    ck_assert_int_eq(cbar_trace_scan(input, &event), 1);
+    ck_assert_int_eq(event.time, 20);
+    ck_assert_int_eq(event.value, 0);
+    ck_assert_int_eq(cbar_trace_scan(input, &event), 0);
+    fclose(input);
+}
+END_TEST
+
+static long recalculate_ms(struct cbar *cbar)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    cbar_recalculate(cbar, 10);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+}
+
+static int get_both(struct cbar *cbar)
+{
+    return cbar_value(cbar, 1) + cbar_value(cbar, 2);
+}
+
+START_TEST(test_cbar_partitions)
+{
+    enum lines {
+        LINE_BOTH,
+        LINE_LEFT,
+        LINE_RIGHT,
+        LINE_SLOW_LEFT,
+        LINE_SLOW_RIGHT,
+    };
+    static const struct cbar_line_config configs[] = {
+        { "both",       CBAR_CALCULATED, .calculated = { get_both } },
+        { "left",       CBAR_THRESHOLD, .threshold = { LINE_SLOW_LEFT, 1, 0 } },
+        { "right",      CBAR_THRESHOLD, .threshold = { LINE_SLOW_RIGHT, 1, 0 } },
+        { "slow_left",  CBAR_EXTERNAL, .external = { get_slowly, 50000 } },
+        { "slow_right", CBAR_EXTERNAL, .external = { get_slowly, 50000 } },
+        { NULL }
+    };
+
+    CBAR_DECLARE(cbar, configs);
+    CBAR_POOL_DECLARE(cbar, 1);
+    CBAR_INIT(cbar, configs);
+
+    /* two independent clusters, plus the calculated line on its own */
+    ck_assert_int_eq(cbar.n_partitions, 3);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_BOTH), 2);
+
+    /* with a worker, the slow lines are read at the same time */
+    ck_assert_int_eq(CBAR_POOL_START(cbar), 0);
+    ck_assert_int_lt(recalculate_ms(&cbar), 90);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_LEFT), 1);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_RIGHT), 1);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_BOTH), 2);
+
+    cbar_pool_stop(&cbar);
+    cbar_recalculate(&cbar, 10);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_BOTH), 2);
+}
+END_TEST
+
+static int slow_flags[16];
+
+static int get_flag_slowly(intptr_t priv)
+{
+    usleep(10000);
+    return slow_flags[priv];
+}
+
+START_TEST(test_cbar_pool_callbacks)
+{
+#define SLOW(N) { "slow", CBAR_EXTERNAL, .external = { get_flag_slowly, N } }
+    static const struct cbar_line_config configs[] = {
+        SLOW(0), SLOW(1), SLOW(2), SLOW(3), SLOW(4), SLOW(5), SLOW(6), SLOW(7),
+        SLOW(8), SLOW(9), SLOW(10), SLOW(11), SLOW(12), SLOW(13), SLOW(14), SLOW(15),
+        { NULL }
+    };
+#undef SLOW
+
+    for (int i=0; i<16; i++)
+        slow_flags[i] = 0;
+    CBAR_DECLARE(ref, configs);
+    CBAR_TRACE_DECLARE(ref, 16);
+    CBAR_INIT(ref, configs);
+    CBAR_TRACE_START(ref);
+    CBAR_DECLARE(cbar, configs);
+    CBAR_TRACE_DECLARE(cbar, 16);
+    CBAR_POOL_DECLARE(cbar, 1);
+    CBAR_INIT(cbar, configs);
+    CBAR_TRACE_START(cbar);
+    ck_assert_int_eq(CBAR_POOL_START(cbar), 0);
+
+    /* eight partitions of two lines; while tracing, partitions take turns,
+     * but the two callbacks in each still run side by side */
+    for (int i=0; i<16; i++)
+        slow_flags[i] = 1;
+    ck_assert_int_ge(recalculate_ms(&ref), 160);
+    ck_assert_int_lt(recalculate_ms(&cbar), 130);
+
+    /* same transitions, in the same order */
+    struct cbar_trace_event expected[16], events[16];
+    ck_assert_int_eq(cbar_trace_read(&ref, expected, 16), 16);
+    ck_assert_int_eq(cbar_trace_read(&cbar, events, 16), 16);
+    for (int i=0; i<16; i++) {
+        ck_assert_int_eq(events[i].id, expected[i].id);
+        ck_assert_int_eq(events[i].value, 1);
+    }
+
+    cbar_pool_stop(&cbar);
+}
+END_TEST
+
+static struct cbar *sampled_cbar;
+static atomic_int sampled_value;
+static atomic_int sampled_calls;
+static atomic_bool sampled_locked;
+
+static int get_sampled(intptr_t priv)
+{
+    if (pthread_mutex_trylock(&sampled_cbar->mutex) == 0)
+        pthread_mutex_unlock(&sampled_cbar->mutex);
+    else
+        sampled_locked = true;
+    sampled_calls++;
+    return sampled_value;
+}
+
+START_TEST(test_cbar_sampled)
+{
+    enum lines {
+        LINE_MONITOR,
+        LINE_SAMPLED,
+    };
+    static const struct cbar_line_config configs[] = {
+        { "monitor", CBAR_MONITOR, .monitor = { LINE_SAMPLED } },
+        { "sampled", CBAR_EXTERNAL, .external = { get_sampled, 0, false, 100 } },
+        { NULL }
+    };
+
+    CBAR_DECLARE(cbar, configs);
+    CBAR_SAMPLER_DECLARE(cbar);
+    sampled_cbar = &cbar;
+    sampled_value = 3;
+    sampled_calls = 0;
+    sampled_locked = false;
+    CBAR_INIT(cbar, configs);
+    ck_assert_int_eq(sampled_calls, 1);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_SAMPLED), 3);
+    cbar_pending(&cbar, LINE_MONITOR);
+
+    /* sampled only when due, and never under the lock */
+    sampled_value = 5;
+    cbar_recalculate(&cbar, 50);
+    ck_assert_int_eq(sampled_calls, 1);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_SAMPLED), 3);
+    cbar_recalculate(&cbar, 50);
+    ck_assert_int_eq(sampled_calls, 2);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_SAMPLED), 5);
+    ck_assert_int_eq(cbar_pending(&cbar, LINE_MONITOR), 1);
+    ck_assert(!sampled_locked);
+
+    /* an unchanged sample doesn't wake anything up */
+    cbar_recalculate(&cbar, 100);
+    ck_assert_int_eq(sampled_calls, 3);
+    ck_assert_int_eq(cbar_pending(&cbar, LINE_MONITOR), 0);
+
+    /* the sampler thread samples in its own time */
+    ck_assert_int_eq(CBAR_SAMPLER_START(cbar), 0);
+    sampled_value = 7;
+    usleep(150000);
+    cbar_sampler_stop(&cbar);
+    int calls = sampled_calls;
+    ck_assert_int_ge(calls, 4);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_SAMPLED), 5);
+    cbar_recalculate(&cbar, 0);
+    ck_assert_int_eq(sampled_calls, calls);
+    ck_assert_int_eq(cbar_value(&cbar, LINE_SAMPLED), 7);
+    ck_assert(!sampled_locked);
+}
+END_TEST
+
+/****************************************************************************/
+
+#define FLEET_INSTANCES 40
+#define FLEET_TICKS 50
+
+enum fleet_lines {
+    FLEET_IN,
+    FLEET_EXT,
+    FLEET_THRESHOLD,
+    FLEET_DEBOUNCE,
+    FLEET_REQUEST,
+    FLEET_SUM,
+    FLEET_ANY,
+    FLEET_MONITOR,
+    FLEET_PERIODIC,
+    FLEET_QUIET,
+    FLEET_SHOWN,
+    FLEET_LINES,
+};
+
+static int fleet_sample;
+static int fleet_get(intptr_t priv)
+{
+    return fleet_sample;
+}
+
+static int fleet_sum(struct cbar *cbar)
+{
+    return cbar_value(cbar, FLEET_IN) + cbar_value(cbar, FLEET_EXT);
+}
+
+static int fleet_any(struct cbar *cbar)
+{
+    return cbar_value(cbar, FLEET_DEBOUNCE) || cbar_value(cbar, FLEET_SUM) > 150;
+}
+
+static const struct cbar_line_config fleet_configs[] = {
+    { "in",        CBAR_INPUT },
+    { "ext",       CBAR_EXTERNAL, .external = { fleet_get } },
+    { "threshold", CBAR_THRESHOLD, .threshold = { FLEET_IN, 50, 40 } },
+    { "debounce",  CBAR_DEBOUNCE, .debounce = { FLEET_THRESHOLD, 30, 20 } },
+    { "request",   CBAR_REQUEST },
+    { "sum",       CBAR_CALCULATED, .calculated = { fleet_sum, CBAR_INPUTS(FLEET_IN, FLEET_EXT) } },
+    { "any",       CBAR_CALCULATED, .calculated = { fleet_any } },
+    { "monitor",   CBAR_MONITOR, .monitor = { FLEET_DEBOUNCE } },
+    { "periodic",  CBAR_PERIODIC, .periodic = { 70 } },
+    { "quiet",     CBAR_LOGIC, .logic = { CBAR_NOT, CBAR_INPUTS(FLEET_DEBOUNCE, FLEET_ANY) } },
+    { "shown",     CBAR_LOGIC, .logic = { CBAR_SELECT, CBAR_INPUTS(FLEET_THRESHOLD, FLEET_IN, FLEET_EXT) } },
+    { NULL }
+};
+
+CBAR_FLEET_DECLARE(fleet, fleet_configs, FLEET_INSTANCES, 3);
+static int fleet_history[FLEET_TICKS][FLEET_INSTANCES][FLEET_LINES+1];
+
+/* Inputs of one instance on one tick, the same for the fleet and the
+ * instance it's checked against. */
+static void fleet_inputs(unsigned *seed, int *in, int *ext, bool *post)
+{
+    *in = rand_r(seed) % 100;
+    *ext = rand_r(seed) % 100;
+    *post = rand_r(seed) % 4 == 0;
+}
+
+START_TEST(test_cbar_fleet)
+{
+    CBAR_DECLARE(cbar, fleet_configs);
+    CBAR_INIT(cbar, fleet_configs);
+    ck_assert_int_eq(CBAR_FLEET_INIT(fleet, cbar, FLEET_INSTANCES), 0);
+
+    /* every instance is evaluated, whichever shard it's in */
+    unsigned seeds[FLEET_INSTANCES];
+    for (int i=0; i<FLEET_INSTANCES; i++)
+        seeds[i] = i + 1;
+    for (int tick=0; tick<FLEET_TICKS; tick++) {
+        for (int i=0; i<FLEET_INSTANCES; i++) {
+            int in, ext;
+            bool post;
+            fleet_inputs(&seeds[i], &in, &ext, &post);
+            cbar_fleet_input(&fleet, i, FLEET_IN, in);
+            cbar_fleet_input(&fleet, i, FLEET_EXT, ext);
+            if (post)
+                cbar_fleet_post(&fleet, i, FLEET_REQUEST);
+        }
+        cbar_fleet_recalculate(&fleet, 10);
+        for (int i=0; i<FLEET_INSTANCES; i++) {
+            for (int id=0; id<FLEET_LINES; id++)
+                fleet_history[tick][i][id] = cbar_fleet_value(&fleet, i, id);
+            fleet_history[tick][i][FLEET_LINES] =
+                cbar_fleet_pending(&fleet, i, FLEET_REQUEST) << 2 |
+                cbar_fleet_pending(&fleet, i, FLEET_MONITOR) << 1 |
+                cbar_fleet_pending(&fleet, i, FLEET_PERIODIC);
+        }
+    }
+    cbar_fleet_stop(&fleet);
+
+    /* ...exactly like a cbar instance of its own */
+    for (int i=0; i<FLEET_INSTANCES; i++) {
+        unsigned seed = i + 1;
+        fleet_sample = 0;
+        CBAR_INIT(cbar, fleet_configs);
+        for (int tick=0; tick<FLEET_TICKS; tick++) {
+            int in;
+            bool post;
+            fleet_inputs(&seed, &in, &fleet_sample, &post);
+            cbar_input(&cbar, FLEET_IN, in);
+            if (post)
+                cbar_post(&cbar, FLEET_REQUEST);
+            cbar_recalculate(&cbar, 10);
+            for (int id=0; id<FLEET_LINES; id++)
+                ck_assert_int_eq(cbar_value(&cbar, id), fleet_history[tick][i][id]);
+            int pending =
+                cbar_pending(&cbar, FLEET_REQUEST) << 2 |
+                cbar_pending(&cbar, FLEET_MONITOR) << 1 |
+                cbar_pending(&cbar, FLEET_PERIODIC);
+            ck_assert_int_eq(pending, fleet_history[tick][i][FLEET_LINES]);
+        }
+    }
+
+    /* filter lines have nowhere to keep their windows */
+    static const struct cbar_line_config filtered_configs[] = {
+        { "level",   CBAR_INPUT },
+        { "average", CBAR_FILTER, .filter = { 0, CBAR_AVERAGE, 4 } },
+        { NULL }
+    };
+    CBAR_DECLARE(filtered, filtered_configs);
+    CBAR_INIT(filtered, filtered_configs);
+    CBAR_FLEET_DECLARE(filtered_fleet, filtered_configs, 16, 2);
+    errno = 0;
+    ck_assert_int_eq(CBAR_FLEET_INIT(filtered_fleet, filtered, 16), -1);
+    ck_assert_int_eq(errno, EINVAL);
+}
+END_TEST
+
+/****************************************************************************/
+
 Suite *cbar_suite(void)
 {
     Suite *s = suite_create("cbar");
@@ -486,10 +2188,34 @@ Suite *cbar_suite(void)
     tcase_add_test(tc, test_cbar_external);
     tcase_add_test(tc, test_cbar_threshold);
     tcase_add_test(tc, test_cbar_debounce);
+    tcase_add_test(tc, test_cbar_runs);
     tcase_add_test(tc, test_cbar_request);
     tcase_add_test(tc, test_cbar_calculated);
+    tcase_add_test(tc, test_cbar_calculated_inputs);
+    tcase_add_test(tc, test_cbar_logic);
+    tcase_add_test(tc, test_cbar_filter);
     tcase_add_test(tc, test_cbar_monitor);
     tcase_add_test(tc, test_cbar_periodic);
+    tcase_add_test(tc, test_cbar_incremental);
+    tcase_add_test(tc, test_cbar_order);
+    tcase_add_test(tc, test_cbar_cycle);
+    tcase_add_test(tc, test_cbar_nonblocking);
+    tcase_add_test(tc, test_cbar_wait);
+    tcase_add_test(tc, test_cbar_pending_drain);
+    tcase_add_test(tc, test_cbar_next_deadline);
+    tcase_add_test(tc, test_cbar_input_batch);
+    tcase_add_test(tc, test_cbar_dump);
+    tcase_add_test(tc, test_cbar_lookup);
+    tcase_add_test(tc, test_cbar_image);
+    tcase_add_test(tc, test_cbar_export);
+    tcase_add_test(tc, test_cbar_snapshot);
+    tcase_add_test(tc, test_cbar_profile);
+    tcase_add_test(tc, test_cbar_trace);
+    tcase_add_test(tc, test_cbar_simulate);
+    tcase_add_test(tc, test_cbar_partitions);
+    tcase_add_test(tc, test_cbar_pool_callbacks);
+    tcase_add_test(tc, test_cbar_sampled);
+    tcase_add_test(tc, test_cbar_fleet);
     suite_add_tcase(s, tc);
 
     return s;